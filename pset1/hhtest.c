@@ -3,52 +3,61 @@
 #include <math.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <time.h>
 #define NALLOCATORS 40
+#define MAXTHREADS 64
+#define MAXPHASES 256
 
-void m61_printhhreport(void);
 // hhtest: A sample framework for evaluating heavy hitter reports.
 
-// 40 different allocation functions give 40 different call sites
-void f00(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f01(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f02(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f03(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f04(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f05(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f06(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f07(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f08(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f09(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f10(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f11(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f12(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f13(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f14(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f15(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f16(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f17(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f18(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f19(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f20(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f21(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f22(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f23(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f24(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f25(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f26(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f27(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f28(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f29(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f30(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f31(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f32(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f33(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f34(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f35(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f36(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f37(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f38(size_t sz) { void *ptr = malloc(sz); free(ptr); }
-void f39(size_t sz) { void *ptr = malloc(sz); free(ptr); }
+// 40 different allocation functions give 40 different call sites.
+// Each also defines fNN_line, the line m61 will attribute its calls to,
+// so hhtest can check m61's report against what it actually did.
+#define ALLOCATOR(n) \
+    void f##n(size_t sz) { void *ptr = malloc(sz); free(ptr); } \
+    enum { f##n##_line = __LINE__ };
+
+ALLOCATOR(00)
+ALLOCATOR(01)
+ALLOCATOR(02)
+ALLOCATOR(03)
+ALLOCATOR(04)
+ALLOCATOR(05)
+ALLOCATOR(06)
+ALLOCATOR(07)
+ALLOCATOR(08)
+ALLOCATOR(09)
+ALLOCATOR(10)
+ALLOCATOR(11)
+ALLOCATOR(12)
+ALLOCATOR(13)
+ALLOCATOR(14)
+ALLOCATOR(15)
+ALLOCATOR(16)
+ALLOCATOR(17)
+ALLOCATOR(18)
+ALLOCATOR(19)
+ALLOCATOR(20)
+ALLOCATOR(21)
+ALLOCATOR(22)
+ALLOCATOR(23)
+ALLOCATOR(24)
+ALLOCATOR(25)
+ALLOCATOR(26)
+ALLOCATOR(27)
+ALLOCATOR(28)
+ALLOCATOR(29)
+ALLOCATOR(30)
+ALLOCATOR(31)
+ALLOCATOR(32)
+ALLOCATOR(33)
+ALLOCATOR(34)
+ALLOCATOR(35)
+ALLOCATOR(36)
+ALLOCATOR(37)
+ALLOCATOR(38)
+ALLOCATOR(39)
 
 // An array of those allocation functions
 void (*allocators[])(size_t) = {
@@ -58,6 +67,18 @@ void (*allocators[])(size_t) = {
     &f30, &f31, &f32, &f33, &f34, &f35, &f36, &f37, &f38, &f39
 };
 
+// The source lines of those allocation functions
+const int allocator_lines[NALLOCATORS] = {
+    f00_line, f01_line, f02_line, f03_line, f04_line,
+    f05_line, f06_line, f07_line, f08_line, f09_line,
+    f10_line, f11_line, f12_line, f13_line, f14_line,
+    f15_line, f16_line, f17_line, f18_line, f19_line,
+    f20_line, f21_line, f22_line, f23_line, f24_line,
+    f25_line, f26_line, f27_line, f28_line, f29_line,
+    f30_line, f31_line, f32_line, f33_line, f34_line,
+    f35_line, f36_line, f37_line, f38_line, f39_line
+};
+
 // Sizes passed to those allocation functions.
 // Later allocation functions have much bigger sizes.
 size_t sizes[NALLOCATORS] = {
@@ -66,7 +87,19 @@ size_t sizes[NALLOCATORS] = {
     128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32768, 65536
 };
 
-static void phase(double skew, unsigned long long count) {
+// A worker thread runs a list of phases and keeps its own exact
+// count of every allocator's calls and bytes (the ground truth).
+typedef struct worker {
+    pthread_t thread;
+    int nphases;
+    double skews[MAXPHASES];
+    unsigned long long counts[MAXPHASES];
+    unsigned short seed[3];             // private nrand48 state
+    unsigned long long calls[NALLOCATORS];
+    unsigned long long bytes[NALLOCATORS];
+} worker;
+
+static void phase(worker *w, double skew, unsigned long long count) {
     // Calculate the probability we'll call allocator I.
     // That probability equals  2^(-I*skew) / \sum_{i=0}^40 2^(-I*skew).
     // When skew=0, every allocator is called with equal probability.
@@ -81,28 +114,79 @@ static void phase(double skew, unsigned long long count) {
     double ppos = 0;
     for (int i = 0; i < NALLOCATORS; ++i) {
         ppos += pow(0.5, i * skew);
-        limit[i] = RAND_MAX * (ppos / sum_p);
+        limit[i] = 2147483647L * (ppos / sum_p);
     }
     // Now the probability we call allocator I equals
-    // (limit[i] - limit[i-1]) / (double) RAND_MAX,
+    // (limit[i] - limit[i-1]) / (double) 2^31,
     // if we pretend that limit[-1] == 0.
 
-    // Pick `count` random allocators and call them.
+    // Pick `count` random allocators and call them. nrand48 keeps this
+    // thread's sequence independent of every other thread's.
     for (unsigned long long i = 0; i < count; ++i) {
-        long x = random();
+        long x = nrand48(w->seed);
         int r = 0;
         while (r < NALLOCATORS - 1 && x > limit[r])
             ++r;
         allocators[r](sizes[r]);
+        ++w->calls[r];
+        w->bytes[r] += sizes[r];
     }
 }
 
+static void *run_worker(void *arg) {
+    worker *w = (worker *) arg;
+    for (int i = 0; i < w->nphases; ++i)
+        phase(w, w->skews[i], w->counts[i]);
+    return NULL;
+}
+
+// Compare m61's heavy hitters with the ground truth in `truth`; the
+// true heavy hitters are the allocators above M61_HH_THRESHOLD of `total`.
+// Returns 1 if the report is exactly right.
+static int score(const char *what, int bycount,
+                 const unsigned long long truth[NALLOCATORS],
+                 unsigned long long total) {
+    int istrue[NALLOCATORS], reported[NALLOCATORS];
+    int ntrue = 0, nreported = 0, nhit = 0, nwrong = 0;
+    for (int i = 0; i < NALLOCATORS; ++i) {
+        istrue[i] = truth[i] > M61_HH_THRESHOLD * total;
+        ntrue += istrue[i];
+        reported[i] = 0;
+    }
+
+    struct m61_heavyhitter hh[NALLOCATORS];
+    size_t n = m61_getheavyhitters(hh, NALLOCATORS, bycount);
+    for (size_t j = 0; j < n; ++j) {
+        int r = 0;
+        while (r < NALLOCATORS && (strcmp(hh[j].file, __FILE__) != 0
+                                   || hh[j].line != allocator_lines[r]))
+            ++r;
+        ++nreported;
+        if (r == NALLOCATORS || reported[r])
+            continue;
+        reported[r] = 1;
+        if (istrue[r]) {
+            ++nhit;
+            // the reported amount must be exact, too
+            if ((bycount ? hh[j].count : hh[j].size) != truth[r])
+                ++nwrong;
+        }
+    }
+
+    double precision = nreported ? (double) nhit / nreported : 1;
+    double recall = ntrue ? (double) nhit / ntrue : 1;
+    printf("hhtest: by %s: precision %.3f recall %.3f (%d reported, %d true, %d miscounted)\n",
+           what, precision, recall, nreported, ntrue, nwrong);
+    return nhit == nreported && nhit == ntrue && nwrong == 0;
+}
+
 int main(int argc, char **argv) {
     if (argc > 1 && (strcmp(argv[1], "-h") == 0
                      || strcmp(argv[1], "--help") == 0)) {
-        printf("Usage: ./hhtest\n\
-       OR ./hhtest SKEW [COUNT]\n\
-       OR ./hhtest SKEW1 COUNT1 SKEW2 COUNT2 ...\n\
+        printf("Usage: ./hhtest [-t NTHREADS]\n\
+       OR ./hhtest [-t NTHREADS] SKEW [COUNT]\n\
+       OR ./hhtest [-t NTHREADS] SKEW1 COUNT1 SKEW2 COUNT2 ...\n\
+       OR ./hhtest [-t NTHREADS] SKEW1 COUNT1 ... / SKEW1 COUNT1 ... / ...\n\
 \n\
   Each SKEW is a real number. 0 means each allocator is called equally\n\
   frequently. 1 means the first allocator is called twice as much as the\n\
@@ -112,21 +196,100 @@ int main(int argc, char **argv) {
   The default is 1000000.\n\
 \n\
   If you give multiple SKEW COUNT pairs, then ./hhtest runs several\n\
-  allocation phases in order.\n");
+  allocation phases in order.\n\
+\n\
+  Phase lists separated by / run concurrently in separate threads.\n\
+  NTHREADS (default: one per phase list) threads are started; thread I\n\
+  runs phase list I modulo the number of lists.\n\
+\n\
+  After printing m61's heavy hitter report, ./hhtest compares it with\n\
+  the calls it actually made, prints precision, recall and throughput,\n\
+  and exits with status 1 if the report was wrong.\n");
         exit(0);
     }
 
-    // parse arguments and run phases
-    for (int position = 1; position == 1 || position < argc; position += 2) {
-        double skew = 0;
-        if (position < argc)
-            skew = strtod(argv[position], 0);
+    int nthreads = 0;
+    if (argc > 2 && strcmp(argv[1], "-t") == 0) {
+        nthreads = strtol(argv[2], 0, 0);
+        argc -= 2, argv += 2;
+    }
 
-        unsigned long long count = 1000000;
-        if (position + 1 < argc)
-            count = strtoull(argv[position + 1], 0, 0);
+    // parse arguments into phase lists, one per `/`-separated group
+    // (no malloc here: m61 would count it against the ground truth)
+    int ngroups = 0;
+    static worker groups[MAXTHREADS];
+    int position = 1;
+    do {
+        worker *g = &groups[ngroups++];
+        g->nphases = 0;
+        do {
+            double skew = 0;
+            if (position < argc && strcmp(argv[position], "/") != 0)
+                skew = strtod(argv[position++], 0);
 
-        phase(skew, count);
+            unsigned long long count = 1000000;
+            if (position < argc && strcmp(argv[position], "/") != 0)
+                count = strtoull(argv[position++], 0, 0);
+
+            g->skews[g->nphases] = skew;
+            g->counts[g->nphases] = count;
+            ++g->nphases;
+            if (g->nphases == MAXPHASES && position < argc
+                && strcmp(argv[position], "/") != 0) {
+                fprintf(stderr, "hhtest: more than %d phases in a list\n",
+                        MAXPHASES);
+                exit(1);
+            }
+        } while (position < argc && strcmp(argv[position], "/") != 0);
+        ++position;
+    } while (position < argc && ngroups < MAXTHREADS);
+    if (position < argc)
+        fprintf(stderr, "hhtest: ignoring phase lists after the first %d\n",
+                MAXTHREADS);
+    if (nthreads <= 0)
+        nthreads = ngroups;
+    if (nthreads > MAXTHREADS)
+        nthreads = MAXTHREADS;
+
+    // run phases
+    static worker workers[MAXTHREADS];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int t = 0; t < nthreads; ++t) {
+        workers[t] = groups[t % ngroups];
+        workers[t].seed[0] = 0x330E;
+        workers[t].seed[1] = t;
+        workers[t].seed[2] = t >> 16;
+        memset(workers[t].calls, 0, sizeof(workers[t].calls));
+        memset(workers[t].bytes, 0, sizeof(workers[t].bytes));
+        int r = pthread_create(&workers[t].thread, NULL, run_worker, &workers[t]);
+        if (r != 0) {
+            fprintf(stderr, "hhtest: %s\n", strerror(r));
+            exit(1);
+        }
     }
+
+    // sum the ground truth
+    unsigned long long calls[NALLOCATORS] = {0}, bytes[NALLOCATORS] = {0};
+    unsigned long long ncalls = 0, nbytes = 0;
+    for (int t = 0; t < nthreads; ++t) {
+        pthread_join(workers[t].thread, NULL);
+        for (int i = 0; i < NALLOCATORS; ++i) {
+            calls[i] += workers[t].calls[i];
+            bytes[i] += workers[t].bytes[i];
+            ncalls += workers[t].calls[i];
+            nbytes += workers[t].bytes[i];
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec)
+        + (end.tv_nsec - start.tv_nsec) / 1e9;
+
     m61_printhhreport();
+    int ok = score("size", 0, bytes, nbytes);
+    ok = score("count", 1, calls, ncalls) && ok;
+    printf("hhtest: %d thread%s, %llu allocations in %.3fs (%.0f allocations/sec)\n",
+           nthreads, nthreads == 1 ? "" : "s", ncalls, elapsed,
+           elapsed > 0 ? ncalls / elapsed : 0);
+    return ok ? 0 : 1;
 }
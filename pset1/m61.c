@@ -4,190 +4,321 @@
 #include <string.h>
 #include <stdio.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Every block handed out by m61 is laid out as
+//
+//     [slack][struct m61_header][payload: sz bytes][redzone: M61_REDZONE]
+//
+// The header sits immediately before the payload and the redzone
+// immediately after it. Slack only appears in front of aligned blocks.
+// Payloads are always at least M61_ALIGN-aligned.
+
+#define M61_ALIGN 16            // minimum alignment of every payload
+#define M61_REDZONE 32          // canary bytes after every payload
+#define M61_CANARY 0xBD         // value of every redzone byte
+#define M61_MAGIC ((size_t) 0x6D36316DUL)  // "m61m", xor'ed with payload
+#define M61_HDRSIZE ((sizeof(m61_header) + M61_ALIGN - 1) & ~(size_t) (M61_ALIGN - 1))
+#define M61_NSITES 4096         // allocation sites tracked for hh reports
+#define M61_PREFETCH 8          // heap sweeps prefetch this many blocks ahead
+
+// m61_chunk: one system allocation backing a whole m61_malloc_batch call;
+// it is released when its last object is freed
+typedef struct m61_chunk {
+    size_t nlive;               // objects in this chunk not yet freed
+} m61_chunk;
+
+typedef struct m61_header {
+    size_t sz;                  // payload size requested by the caller
+    size_t index;               // position in the active block table
+    void *base;                 // system allocation, or the m61_chunk
+    size_t batched;             // nonzero if `base` is an m61_chunk
+    size_t magic;               // M61_MAGIC ^ payload address
+} m61_header;
+
+// m61_site: allocation statistics for one file:line pair
+typedef struct m61_heavyhitter m61_site;
 
 // the struct memstat keeps record of all memory statistics
 typedef struct memstat {
 // the following 6 variables will keep record of counters and size statistics
-size_t allocated;
-size_t sizeallocated;
-size_t freed;
-size_t sizefreed;
-size_t failed;
-size_t failedsize;
-// sztbl stores all necessary informations on allocated memory
-// [0][1] stores current length, have to increase the number of rows 
-// allocated for heavier uses
-// [0] is the pointer's address, [1] is actual (data) size, [2] is aligned size
-// if [1] < [2], [3] is the data in the next byte after the physical size
-// else [3] is the data in the next word after the aligned size
-// [4] is the number in the file name, [5] is line number
-int sztbl[500][6];
-// fltbl stores size and frequency with respect of each file and line pair
-// each sheet stores allocation info for each file,
-// fist row stores number of files in [0], current file name pointer in [1],
-// and number of lines in [2], each of the following row stores info for each
-// memory allocating line of code in this file, [1] frequency, [2] total size
-size_t fltbl[5][100][3];
+unsigned long long allocated;
+unsigned long long sizeallocated;
+unsigned long long freed;
+unsigned long long sizefreed;
+unsigned long long failed;
+unsigned long long failedsize;
+// the active block table, one entry per live block, kept as parallel
+// arrays so heap sweeps stream through just the fields they need; each
+// block's header remembers its index so free can validate and remove it
+// in O(1)
+void **active;                  // payload pointers
+size_t *activesz;               // payload sizes
+const char **activefile;        // allocation sites
+int *activeline;
+unsigned char *activebad;       // set once a corruption has been reported
+size_t nactive;
+size_t activecap;
+// lowest and highest addresses ever handed to us by the system malloc
+uintptr_t heapmin;
+uintptr_t heapmax;
+// sites is an open-addressed hash table keyed by file and line
+m61_site sites[M61_NSITES];
+// background heap checker: every `checkperiod` ms, check `checkbudget`
+// blocks starting at `checkcursor`
+unsigned checkperiod;
+size_t checkbudget;
+size_t checkcursor;
+int checkrunning;
+pthread_t checker;
 } memstat;
 
 // initialize with 0 statistics
 memstat stat = {.allocated = 0,
-				.sizeallocated = 0,
-				.freed = 0,
-				.sizefreed = 0,
-				.failed = 0,
-				.failedsize = 0,
-				.sztbl = {{0, 1, 0, 0}}, // skip the 0th row for metadata
-				.fltbl = {{{1, 0, 0}}} // there is at least one file
+                .sizeallocated = 0,
+                .freed = 0,
+                .sizefreed = 0,
+                .failed = 0,
+                .failedsize = 0,
+                .heapmin = UINTPTR_MAX,
+                .heapmax = 0
 };
 
+// m61_lock protects `stat`; every public function takes it
+static pthread_mutex_t m61_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t m61_checkcond = PTHREAD_COND_INITIALIZER;
 
 
-void *m61_malloc(size_t sz, const char *file, int line) {
-    (void) file, (void) line;   // avoid uninitialized variable warnings
-    void * retptr = malloc(sz);
-    // record as fail if returned pointer is null
-    if (retptr == NULL) {
-        stat.failed++;
-        stat.failedsize += sz;
-        return retptr;
-    } else {
-    // on success, record as allocated
-        stat.allocated++;
-        stat.sizeallocated += sz;
-        // record allocation info of this line of code
-        for (uint j = 0; j < stat.fltbl[0][0][0]; j++) {
-            if (stat.fltbl[0][0][1] == 0) // at start, all pages are empty
-                stat.fltbl[0][0][1] = (int) file; // page has file name in row 0
-            if ((uint)file == stat.fltbl[j][0][1]) { // same page for same file
-                if (stat.fltbl[j][0][2] == 0) { // empty, add first ln metadata
-                    stat.fltbl[j][1][0] = line;
-                    stat.fltbl[j][0][2] += 1;
-                }
-                for (uint k = 1; k <= stat.fltbl[j][0][2]; k++) {
-                    if ((uint)line == stat.fltbl[j][k][0]) { // if line alloc'd
-                        stat.fltbl[j][k][1] += 1;
-                        stat.fltbl[j][k][2] += sz;
-                        break;
-                    } else if (k == stat.fltbl[j][0][2]) { // new row for line
-                        stat.fltbl[j][0][2] += 1;
-                        stat.fltbl[j][k+1][0] = line;
-                    }
-                }
-                break;
-            } else if (j == stat.fltbl[0][0][0]-1) { // use a new page for file
-                stat.fltbl[0][0][0] += 1;
-                stat.fltbl[j+1][0][1] = (int)file;
-            }
+static inline m61_header *m61_hdr(void *ptr) {
+    return (m61_header *) ((char *) ptr - sizeof(m61_header));
+}
+
+// record the allocation site `file`:`line` for `n` allocations of `sz` bytes
+static void m61_countsite(const char *file, int line, size_t n, size_t sz) {
+    size_t h = ((uintptr_t) file * 31 + (unsigned) line) % M61_NSITES;
+    for (size_t probe = 0; probe < M61_NSITES; ++probe) {
+        m61_site *s = &stat.sites[(h + probe) % M61_NSITES];
+        if (s->file == NULL) {
+            s->file = file;
+            s->line = line;
         }
-        for (int i = 1; i <= stat.sztbl[0][1]; i++) {
-            // updates "next block" data, in case of later allocation overwrite
-            // don't have to consider byte overwrite since allocation is aligned
-            if (stat.sztbl[i][0] != 0 && stat.sztbl[i][1] == stat.sztbl[i][2])
-            	stat.sztbl[i][3] = *(int *)((char *)(stat.sztbl[i][0]) + stat.sztbl[i][2]);
-            // if occupies a previously emptied block
-            if (stat.sztbl[i][0] == (int)retptr && stat.sztbl[i][1] == 0) {
-                stat.sztbl[i][1] = sz; // physical size
-                while (sz % 4 != 0)
-                    sz++;
-                stat.sztbl[i][2] = sz; // aligned size
-                if (stat.sztbl[i][1] < stat.sztbl[i][2]) {
-                	// if two sizes not equal, record canary byte value
-                	stat.sztbl[i][3] = *((char *)retptr + sz - 4 + (stat.sztbl[i][2] - stat.sztbl[i][1]) - 1) = (char) rand();
-                } else {
-                	// record word value after allocated block
-                	stat.sztbl[i][3] = *(int *)((char *)retptr + sz);
-                }
-                stat.sztbl[i][4] = (int)file;
-                stat.sztbl[i][5] = line;
-                return retptr;
-            }
+        if (s->file == file && s->line == line) {
+            s->count += n;
+            s->size += (unsigned long long) n * sz;
+            return;
         }
-        // put new info of allocation to the end of the table, similar to above
-        stat.sztbl[(stat.sztbl[0][1] + 1)][0] = (int)retptr;
-        stat.sztbl[(stat.sztbl[0][1] + 1)][1] = sz;
-        stat.sztbl[(stat.sztbl[0][1] + 1)][4] = (int)file;
-        stat.sztbl[(stat.sztbl[0][1] + 1)][5] = line;
-        while (sz % 4 != 0)
-            sz++;
-        stat.sztbl[(stat.sztbl[0][1] + 1)][2] = sz;
-        if (stat.sztbl[(stat.sztbl[0][1] + 1)][1] < stat.sztbl[(stat.sztbl[0][1] + 1)][2])
-        	stat.sztbl[(stat.sztbl[0][1] + 1)][3] = *((char *)retptr + sz - 4 + (stat.sztbl[(stat.sztbl[0][1] + 1)][2] - stat.sztbl[(stat.sztbl[0][1] + 1)][1]) - 1) = (char) rand();
-        else
-        	stat.sztbl[(stat.sztbl[0][1] + 1)][3] = *(int *)((char *)retptr + sz);
-        stat.sztbl[0][1] += 1;
-        return retptr;
-     }
+    }
+    // table full: the site goes uncounted, totals stay correct
 }
 
-void m61_free(void *ptr, const char *file, int line) {
-    (void) file, (void) line;   // avoid uninitialized variable warnings
+// grow one column of the active table to `cap` entries
+static int m61_growcolumn(void *pcolumn, size_t cap, size_t eltsize) {
+    void *column = realloc(*(void **) pcolumn, cap * eltsize);
+    if (!column)
+        return -1;
+    *(void **) pcolumn = column;
+    return 0;
+}
+
+// make room for `n` more entries in the active table
+static int m61_reserve(size_t n) {
+    if (stat.nactive + n <= stat.activecap)
+        return 0;
+    size_t cap = stat.activecap ? stat.activecap : 256;
+    while (cap < stat.nactive + n)
+        cap *= 2;
+    // a failure leaves the table valid at its old capacity
+    if (m61_growcolumn(&stat.active, cap, sizeof(*stat.active)) < 0
+        || m61_growcolumn(&stat.activesz, cap, sizeof(*stat.activesz)) < 0
+        || m61_growcolumn(&stat.activefile, cap, sizeof(*stat.activefile)) < 0
+        || m61_growcolumn(&stat.activeline, cap, sizeof(*stat.activeline)) < 0
+        || m61_growcolumn(&stat.activebad, cap, sizeof(*stat.activebad)) < 0)
+        return -1;
+    stat.activecap = cap;
+    return 0;
+}
+
+static void m61_noteheap(void *base, size_t total) {
+    if ((uintptr_t) base < stat.heapmin)
+        stat.heapmin = (uintptr_t) base;
+    if ((uintptr_t) base + total > stat.heapmax)
+        stat.heapmax = (uintptr_t) base + total;
+}
+
+// fill in the header and redzone of a new block and make it active
+static void m61_track(void *ptr, size_t sz, void *base, int batched,
+                      const char *file, int line) {
+    m61_header *h = m61_hdr(ptr);
+    h->sz = sz;
+    h->index = stat.nactive;
+    h->base = base;
+    h->batched = batched;
+    h->magic = M61_MAGIC ^ (uintptr_t) ptr;
+    memset((char *) ptr + sz, M61_CANARY, M61_REDZONE);
+    stat.active[stat.nactive] = ptr;
+    stat.activesz[stat.nactive] = sz;
+    stat.activefile[stat.nactive] = file;
+    stat.activeline[stat.nactive] = line;
+    stat.activebad[stat.nactive] = 0;
+    stat.nactive++;
+}
+
+static void m61_fail(size_t sz) {
+    stat.failed++;
+    stat.failedsize += sz;
+}
+
+// allocate a tracked block of `sz` bytes whose payload is a multiple of
+// `align`, which must be a power of two no smaller than M61_ALIGN
+static void *m61_alloc(size_t align, size_t sz, const char *file, int line) {
+    size_t slack = align - M61_ALIGN;
+    // prevents size overflow
+    if (sz > (size_t) -1 - M61_HDRSIZE - M61_REDZONE - slack
+        || m61_reserve(1) < 0) {
+        m61_fail(sz);
+        return NULL;
+    }
+    size_t total = M61_HDRSIZE + slack + sz + M61_REDZONE;
+    char *base = (char *) malloc(total);
+    if (!base) {
+        m61_fail(sz);
+        return NULL;
+    }
+    uintptr_t p = (uintptr_t) base + M61_HDRSIZE;
+    p = (p + align - 1) & ~(uintptr_t) (align - 1);
+    m61_track((void *) p, sz, base, 0, file, line);
+    m61_noteheap(base, total);
+    m61_countsite(file, line, 1, sz);
+    stat.allocated++;
+    stat.sizeallocated += sz;
+    return (void *) p;
+}
+
+void *m61_malloc(size_t sz, const char *file, int line) {
+    pthread_mutex_lock(&m61_lock);
+    void *ptr = m61_alloc(M61_ALIGN, sz, file, line);
+    pthread_mutex_unlock(&m61_lock);
+    return ptr;
+}
+
+// returns 1 iff `ptr` is the payload of an active block
+static int m61_isactive(void *ptr) {
+    if ((uintptr_t) ptr % M61_ALIGN != 0
+        || (uintptr_t) ptr < stat.heapmin + M61_HDRSIZE)
+        return 0;
+    m61_header *h = m61_hdr(ptr);
+    return h->index < stat.nactive && stat.active[h->index] == ptr;
+}
+
+// print the "not allocated" diagnosis for `ptr`, including the block it
+// points into, if any
+static void m61_badfree(void *ptr, const char *file, int line) {
+    printf("MEMORY BUG: %s:%d: invalid free of pointer %p, not allocated\n", file, line, ptr);
+    for (size_t i = 0; i < stat.nactive; i++) {
+        char *p = (char *) stat.active[i];
+        if (p < (char *) ptr && (char *) ptr < p + stat.activesz[i])
+            printf("  %s:%d: %p is %zu bytes inside a %zu byte region allocated here\n",
+                   stat.activefile[i], stat.activeline[i], ptr,
+                   (size_t) ((char *) ptr - p), stat.activesz[i]);
+    }
+}
+
+// returns 1 iff all M61_REDZONE bytes at `rz` still hold M61_CANARY
+static inline int m61_redzoneok(const unsigned char *rz) {
+#if defined(__AVX2__)
+    __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) rz),
+                                   _mm256_set1_epi8((char) M61_CANARY));
+    return _mm256_movemask_epi8(eq) == -1;
+#elif defined(__SSE2__)
+    __m128i canary = _mm_set1_epi8((char) M61_CANARY);
+    __m128i lo = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) rz), canary);
+    __m128i hi = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (rz + 16)), canary);
+    return _mm_movemask_epi8(_mm_and_si128(lo, hi)) == 0xFFFF;
+#else
+    for (int i = 0; i < M61_REDZONE; i++)
+        if (rz[i] != M61_CANARY)
+            return 0;
+    return 1;
+#endif
+}
+
+// check active block `i`: returns 0 if intact, 1 if its header was
+// overwritten, 2 if its redzone was
+static int m61_damage(size_t i) {
+    void *ptr = stat.active[i];
+    m61_header *h = m61_hdr(ptr);
+    if (h->magic != (M61_MAGIC ^ (uintptr_t) ptr) || h->sz != stat.activesz[i]
+        || h->index != i)
+        return 1;
+    return m61_redzoneok((const unsigned char *) ptr + stat.activesz[i]) ? 0 : 2;
+}
+
+// release active block `ptr`; returns its size, or -1 after reporting
+// a memory bug
+static long long m61_release(void *ptr, const char *file, int line) {
     // out of heap free
-    if (0x804b004 > (int)ptr || 0xb000000 < (int)ptr) {
+    if ((uintptr_t) ptr < stat.heapmin || (uintptr_t) ptr >= stat.heapmax) {
         printf("MEMORY BUG: %s:%d: invalid free of pointer %p, not in heap\n", file, line, ptr);
-        return;
+        return -1;
     }
-    // all other checks
-    for (int i = 1; i <= stat.sztbl[0][1]; i++) {
-        if (stat.sztbl[i][0] == (int)ptr && stat.sztbl[i][1] != 0) {
-        	// check for over-written data after the end of allocated bytes
-            if (stat.sztbl[i][1] < stat.sztbl[i][2]) {
-                if (stat.sztbl[i][3] != *((char *)stat.sztbl[i][0] + stat.sztbl[i][2] - 4 + (stat.sztbl[i][2] - stat.sztbl[i][1]) - 1)) {
-                	printf("MEMORY BUG: %s:%d: detected wild write during free of pointer %p\n", file, line, ptr);
-                	return;
-            	}
-            } else {
-            	// check for over-written data after the end of an allocated block
-                if (stat.sztbl[i][3] != *(int *)((char *)ptr + stat.sztbl[i][2])) {
-                	printf("MEMORY BUG: %s:%d: detected wild write during free of pointer %p\n", file, line, ptr);
-                	return;
-            	}
-            }
-            // free success
-            stat.sizefreed += stat.sztbl[i][1];
-            // set size as 0
-            stat.sztbl[i][1] = 0;
-            stat.sztbl[i][2] = 0;
-            stat.freed++;
-            break;
-        }
-        // if freeing twice
-        if (stat.sztbl[i][0] == (int)ptr && stat.sztbl[i][1] == 0) {
-            printf("MEMORY BUG: %s:%d: invalid free of pointer %p\n", file, line, ptr);
-            return;
-        }
-        // an address not in the list
-        if (i == stat.sztbl[0][1]) {
-            printf("MEMORY BUG: %s:%d: invalid free of pointer %p, not allocated\n", file, line, ptr);
-            for (i = 1; i <= stat.sztbl[0][1]; i++) {
-                if (stat.sztbl[i][0] < (int)ptr && stat.sztbl[i][0] + stat.sztbl[i][1] > (int)ptr) {
-                    printf("  %s:%d: %p is %d bytes inside a %d byte region allocated here\n", file, stat.sztbl[i][5], ptr, (int)ptr-stat.sztbl[i][0], stat.sztbl[i][1]);
-                }
-            }
-            return;
-       }
+    if (!m61_isactive(ptr)) {
+        m61_badfree(ptr, file, line);
+        return -1;
+    }
+    m61_header *h = m61_hdr(ptr);
+    size_t i = h->index;
+    // check for over-written data around the allocated bytes
+    if (m61_damage(i)) {
+        printf("MEMORY BUG: %s:%d: detected wild write during free of pointer %p\n", file, line, ptr);
+        return -1;
     }
-    free(ptr);
+    // move the last active block into the freed slot
+    size_t last = --stat.nactive;
+    if (i != last) {
+        stat.active[i] = stat.active[last];
+        stat.activesz[i] = stat.activesz[last];
+        stat.activefile[i] = stat.activefile[last];
+        stat.activeline[i] = stat.activeline[last];
+        stat.activebad[i] = stat.activebad[last];
+        m61_hdr(stat.active[i])->index = i;
+    }
+    size_t sz = h->sz;
+    h->magic = 0;
+    if (!h->batched)
+        free(h->base);
+    else if (--((m61_chunk *) h->base)->nlive == 0)
+        free(h->base);
+    return (long long) sz;
+}
+
+void m61_free(void *ptr, const char *file, int line) {
+    if (!ptr)
+        return;
+    pthread_mutex_lock(&m61_lock);
+    long long sz = m61_release(ptr, file, line);
+    if (sz >= 0) {
+        // free success
+        stat.freed++;
+        stat.sizefreed += sz;
+    }
+    pthread_mutex_unlock(&m61_lock);
 }
 
 void *m61_realloc(void *ptr, size_t sz, const char *file, int line) {
     void *new_ptr = NULL;
     if (sz) {
-        new_ptr = m61_malloc(sz, file, line);
-        if (ptr) {
+        pthread_mutex_lock(&m61_lock);
+        new_ptr = m61_alloc(M61_ALIGN, sz, file, line);
+        size_t oldsz = ptr && m61_isactive(ptr) ? m61_hdr(ptr)->sz : 0;
+        pthread_mutex_unlock(&m61_lock);
+        if (ptr && new_ptr) {
             // copies data into new block
-            for (int i = 0; i < ((*((int *)ptr-1))/16)*16; i++) {
-                *((char *)new_ptr+i) = *((char *)ptr+i);
-            }
-            for (int i = 1; i <= stat.sztbl[0][1]; i++) {
-            	// updates data word adjacent to all previously allocated blocks
-            	if (stat.sztbl[i][0] != 0 && stat.sztbl[i][1] == stat.sztbl[i][2]) {
-            		stat.sztbl[i][3] = *(int *)((char *)(stat.sztbl[i][0]) + stat.sztbl[i][2]);
-            	} else if (stat.sztbl[i][0] != 0) {
-            		// updates canary byte adjacent to previously allocated bytes
-            		stat.sztbl[i][3] = *((char *)stat.sztbl[i][0] + stat.sztbl[i][2] - 4 + (stat.sztbl[i][2] - stat.sztbl[i][1]) - 1) = (char) rand();
-            	}
-            }
+            memcpy(new_ptr, ptr, oldsz < sz ? oldsz : sz);
             m61_free(ptr, file, line);
         }
     } else {
@@ -199,25 +330,189 @@ void *m61_realloc(void *ptr, size_t sz, const char *file, int line) {
 void *m61_calloc(size_t nmemb, size_t sz, const char *file, int line) {
     void *ptr = NULL;
     // prevents size overflow
-    if ((long long)nmemb * (long long)sz < (long long)((size_t) - 1))
+    if (sz == 0 || nmemb <= (size_t) -1 / sz)
         ptr = m61_malloc(nmemb * sz, file, line);
-    else
+    else {
+        pthread_mutex_lock(&m61_lock);
         stat.failed++;
+        pthread_mutex_unlock(&m61_lock);
+    }
     if (ptr)
         memset(ptr, 0, nmemb * sz);
     return ptr;
 }
 
+void *m61_memalign(size_t alignment, size_t sz, const char *file, int line) {
+    void *ptr = NULL;
+    pthread_mutex_lock(&m61_lock);
+    // alignment must be a power of two
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0
+        || alignment > ((size_t) -1 >> 1))
+        m61_fail(sz);
+    else
+        ptr = m61_alloc(alignment < M61_ALIGN ? M61_ALIGN : alignment,
+                        sz, file, line);
+    pthread_mutex_unlock(&m61_lock);
+    return ptr;
+}
+
+void *m61_aligned_alloc(size_t alignment, size_t sz, const char *file, int line) {
+    // C11 additionally requires the size to be a multiple of the alignment
+    if (alignment == 0 || sz % alignment != 0) {
+        pthread_mutex_lock(&m61_lock);
+        m61_fail(sz);
+        pthread_mutex_unlock(&m61_lock);
+        return NULL;
+    }
+    return m61_memalign(alignment, sz, file, line);
+}
+
+size_t m61_malloc_batch(size_t n, size_t sz, void **ptrs, const char *file, int line) {
+    if (n == 0)
+        return 0;
+    // each object is header + payload + redzone, rounded to M61_ALIGN
+    size_t stride = 0, total = 0;
+    if (sz <= (size_t) -1 - M61_HDRSIZE - M61_REDZONE - M61_ALIGN) {
+        stride = (M61_HDRSIZE + sz + M61_REDZONE + M61_ALIGN - 1)
+            & ~(size_t) (M61_ALIGN - 1);
+        if (n <= ((size_t) -1 - M61_ALIGN) / stride)
+            total = M61_ALIGN + n * stride;
+    }
+    pthread_mutex_lock(&m61_lock);
+    char *base = total && m61_reserve(n) >= 0 ? (char *) malloc(total) : NULL;
+    if (!base) {
+        stat.failed += n;
+        stat.failedsize += (unsigned long long) n * sz;
+        pthread_mutex_unlock(&m61_lock);
+        return 0;
+    }
+    // the chunk header occupies the first M61_ALIGN bytes
+    ((m61_chunk *) base)->nlive = n;
+    char *obj = base + M61_ALIGN;
+    for (size_t i = 0; i < n; i++, obj += stride) {
+        ptrs[i] = obj + M61_HDRSIZE;
+        m61_track(ptrs[i], sz, base, 1, file, line);
+    }
+    m61_noteheap(base, total);
+    m61_countsite(file, line, n, sz);
+    stat.allocated += n;
+    stat.sizeallocated += (unsigned long long) n * sz;
+    pthread_mutex_unlock(&m61_lock);
+    return n;
+}
+
+void m61_free_batch(size_t n, void **ptrs, const char *file, int line) {
+    unsigned long long nfreed = 0, szfreed = 0;
+    pthread_mutex_lock(&m61_lock);
+    for (size_t i = 0; i < n; i++) {
+        if (!ptrs[i])
+            continue;
+        long long sz = m61_release(ptrs[i], file, line);
+        if (sz >= 0) {
+            nfreed++;
+            szfreed += sz;
+        }
+    }
+    stat.freed += nfreed;
+    stat.sizefreed += szfreed;
+    pthread_mutex_unlock(&m61_lock);
+}
+
+// check up to `n` active blocks starting at index `start`, wrapping
+// around; reports each damaged block (only once if `quiet_repeats`) and
+// returns the number of damaged blocks seen
+static size_t m61_sweep(size_t start, size_t n, int quiet_repeats) {
+    size_t nbad = 0;
+    if (stat.nactive == 0)
+        return 0;
+    if (n > stat.nactive)
+        n = stat.nactive;
+    start %= stat.nactive;
+    for (size_t k = 0; k < n; k++) {
+        size_t i = start + k < stat.nactive ? start + k : start + k - stat.nactive;
+        // the table tells us where upcoming headers and redzones are, so
+        // start those cache misses early
+        size_t ahead = i + M61_PREFETCH < stat.nactive ? i + M61_PREFETCH : i;
+        __builtin_prefetch(m61_hdr(stat.active[ahead]));
+        __builtin_prefetch((char *) stat.active[ahead] + stat.activesz[ahead]);
+        int damage = m61_damage(i);
+        if (!damage)
+            continue;
+        nbad++;
+        if (quiet_repeats && stat.activebad[i])
+            continue;
+        stat.activebad[i] = 1;
+        printf("MEMORY BUG: checkheap: detected wild write %s pointer %p\n",
+               damage == 1 ? "before" : "after", stat.active[i]);
+        printf("  %s:%d: %zu byte region allocated here\n",
+               stat.activefile[i], stat.activeline[i], stat.activesz[i]);
+    }
+    if (nbad)
+        fflush(stdout);
+    return nbad;
+}
+
+size_t m61_checkheap(void) {
+    pthread_mutex_lock(&m61_lock);
+    size_t nbad = m61_sweep(0, stat.nactive, 0);
+    pthread_mutex_unlock(&m61_lock);
+    return nbad;
+}
+
+// m61_checker: background thread body for m61_setcheckheap
+static void *m61_checker(void *arg) {
+    (void) arg;
+    pthread_mutex_lock(&m61_lock);
+    while (stat.checkperiod) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += stat.checkperiod / 1000;
+        deadline.tv_nsec += (long) (stat.checkperiod % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        int r = pthread_cond_timedwait(&m61_checkcond, &m61_lock, &deadline);
+        if (r == ETIMEDOUT && stat.checkperiod) {
+            m61_sweep(stat.checkcursor, stat.checkbudget, 1);
+            stat.checkcursor += stat.checkbudget;
+            if (stat.nactive)
+                stat.checkcursor %= stat.nactive;
+        }
+    }
+    pthread_mutex_unlock(&m61_lock);
+    return NULL;
+}
+
+void m61_setcheckheap(unsigned period_ms, size_t budget) {
+    pthread_mutex_lock(&m61_lock);
+    stat.checkperiod = budget ? period_ms : 0;
+    stat.checkbudget = budget;
+    int stop = !stat.checkperiod && stat.checkrunning;
+    if (stat.checkperiod && !stat.checkrunning)
+        stat.checkrunning = pthread_create(&stat.checker, NULL, m61_checker, NULL) == 0;
+    else if (stop)
+        stat.checkrunning = 0;
+    pthread_t checker = stat.checker;
+    pthread_cond_signal(&m61_checkcond);
+    pthread_mutex_unlock(&m61_lock);
+    // the checker needs m61_lock to notice it should exit
+    if (stop)
+        pthread_join(checker, NULL);
+}
+
 void m61_getstatistics(struct m61_statistics *stats) {
     // Stub: set all statistics to enormous numbers
     memset(stats, 255, sizeof(struct m61_statistics));
     //writes cumulative variables to struct
+    pthread_mutex_lock(&m61_lock);
     stats->nactive = stat.allocated - stat.freed;
     stats->active_size = stat.sizeallocated - stat.sizefreed;
     stats->ntotal = stat.allocated;
     stats->total_size = stat.sizeallocated;
     stats->nfail = stat.failed;
     stats->fail_size = stat.failedsize;
+    pthread_mutex_unlock(&m61_lock);
 }
 
 void m61_printstatistics(void) {
@@ -231,43 +526,50 @@ void m61_printstatistics(void) {
 }
 
 void m61_printleakreport(void) {
-    for (int i = 1; i <= stat.sztbl[0][1]; i++)
-        if (stat.sztbl[i][1] != 0)
-            printf("LEAK CHECK: %s:%d: allocated object %p with size %i\n", (char *)stat.sztbl[i][4], stat.sztbl[i][5], (char *)stat.sztbl[i][0], stat.sztbl[i][1]);
+    pthread_mutex_lock(&m61_lock);
+    for (size_t i = 0; i < stat.nactive; i++)
+        printf("LEAK CHECK: %s:%d: allocated object %p with size %zu\n", stat.activefile[i], stat.activeline[i], stat.active[i], stat.activesz[i]);
+    pthread_mutex_unlock(&m61_lock);
 }
 
-// a compare function for qsort
-int comparesizet (const void *a, const void *b) { 
-       size_t *lla = (size_t *) a;
-       size_t *llb = (size_t *) b;
-       return (*lla < *llb) - (*lla > *llb);
-} 
+// compare functions for qsort, heaviest site first
+static int comparesize(const void *a, const void *b) {
+    const m61_site *sa = (const m61_site *) a;
+    const m61_site *sb = (const m61_site *) b;
+    return (sa->size < sb->size) - (sa->size > sb->size);
+}
 
-void m61_printhhreport(void) {
-    for (uint j = 0; j < stat.fltbl[0][0][0]; j++) {
-        // the following two arrays are for sorting with respect to freq and size
-        size_t freqarray[100] = {0};
-        size_t sizearray[100] = {0};
-        uint k;
-        // copies freq data and size data to the two separate arrays
-        for (k = 1; k <= stat.fltbl[j][0][2]; k++) {
-            freqarray[k-1] = stat.fltbl[j][k][1];
-            sizearray[k-1] = stat.fltbl[j][k][2];
-        }
-        // sorts the two arrays
-        qsort(freqarray, k, sizeof(size_t), comparesizet);
-        qsort(sizearray, k, sizeof(size_t), comparesizet);
-        // print the top several heavy-hitter by size that occupy >12% total size
-        for (int i = 0; i < 8; i++)
-            if ((double)sizearray[i]/(double)stat.sizeallocated > 0.12)
-                for (uint m = 1; m <= k; m++)
-                    if (stat.fltbl[j][m][2] == sizearray[i])
-                        printf("HEAVY HITTER: %s:%zu: %zu bytes (~%.1lf%%)\n", (char *)stat.fltbl[j][0][1], stat.fltbl[j][m][0], stat.fltbl[j][m][2], (double)stat.fltbl[j][m][2] * 100 / (double)stat.sizeallocated);
-        // print the top several heavy-hitter by freq that occupy >12% total size
-        for (int i = 0; i < 8; i++)
-            if ((double)freqarray[i] / (double)stat.allocated > 0.12)
-                for (uint m = 1; m <= k; m++)
-                    if (stat.fltbl[j][m][1] == freqarray[i])
-                        printf("HEAVY HITTER: %s:%zu: %zu times (~%.1lf%%)\n", (char *)stat.fltbl[j][0][1], stat.fltbl[j][m][0], stat.fltbl[j][m][2], (double)stat.fltbl[j][m][1] * 100 / (double)stat.allocated);
+static int comparecount(const void *a, const void *b) {
+    const m61_site *sa = (const m61_site *) a;
+    const m61_site *sb = (const m61_site *) b;
+    return (sa->count < sb->count) - (sa->count > sb->count);
+}
+
+size_t m61_getheavyhitters(struct m61_heavyhitter *hh, size_t max, int bycount) {
+    size_t n = 0;
+    pthread_mutex_lock(&m61_lock);
+    // collect the sites that occupy >12% of total size (or total count)
+    for (size_t i = 0; i < M61_NSITES && n < max; i++) {
+        const m61_site *s = &stat.sites[i];
+        if (s->file && (bycount ? s->count > M61_HH_THRESHOLD * stat.allocated
+                        : s->size > M61_HH_THRESHOLD * stat.sizeallocated))
+            hh[n++] = *s;
     }
+    pthread_mutex_unlock(&m61_lock);
+    qsort(hh, n, sizeof(*hh), bycount ? comparecount : comparesize);
+    return n;
+}
+
+void m61_printhhreport(void) {
+    // fewer than 1/M61_HH_THRESHOLD sites can each exceed the threshold
+    struct m61_heavyhitter hh[16];
+    struct m61_statistics stats;
+    m61_getstatistics(&stats);
+    // print the heavy-hitters by size, then by freq
+    size_t n = m61_getheavyhitters(hh, 16, 0);
+    for (size_t i = 0; i < n; i++)
+        printf("HEAVY HITTER: %s:%d: %llu bytes (~%.1lf%%)\n", hh[i].file, hh[i].line, hh[i].size, (double) hh[i].size * 100 / (double) stats.total_size);
+    n = m61_getheavyhitters(hh, 16, 1);
+    for (size_t i = 0; i < n; i++)
+        printf("HEAVY HITTER: %s:%d: %llu times (~%.1lf%%)\n", hh[i].file, hh[i].line, hh[i].count, (double) hh[i].count * 100 / (double) stats.ntotal);
 }
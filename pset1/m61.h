@@ -6,6 +6,10 @@ void *m61_malloc(size_t sz, const char *file, int line);
 void m61_free(void *ptr, const char *file, int line);
 void *m61_realloc(void *ptr, size_t sz, const char *file, int line);
 void *m61_calloc(size_t nmemb, size_t sz, const char *file, int line);
+void *m61_memalign(size_t alignment, size_t sz, const char *file, int line);
+void *m61_aligned_alloc(size_t alignment, size_t sz, const char *file, int line);
+size_t m61_malloc_batch(size_t n, size_t sz, void **ptrs, const char *file, int line);
+void m61_free_batch(size_t n, void **ptrs, const char *file, int line);
 
 struct m61_statistics {
     unsigned long long nactive;         // # active allocations
@@ -20,11 +24,32 @@ void m61_getstatistics(struct m61_statistics *stats);
 void m61_printstatistics(void);
 void m61_printleakreport(void);
 
+struct m61_heavyhitter {
+    const char *file;                   // allocation site
+    int line;
+    unsigned long long count;           // # allocations at this site
+    unsigned long long size;            // # bytes allocated at this site
+};
+
+// a site is a heavy hitter if it accounts for more than this fraction
+// of all bytes allocated (or of all allocations)
+#define M61_HH_THRESHOLD 0.12
+
+size_t m61_getheavyhitters(struct m61_heavyhitter *hh, size_t max, int bycount);
+void m61_printhhreport(void);
+
+size_t m61_checkheap(void);
+void m61_setcheckheap(unsigned period_ms, size_t budget);
+
 #if !M61_DISABLE
 #define malloc(sz)              m61_malloc((sz), __FILE__, __LINE__)
 #define free(ptr)               m61_free((ptr), __FILE__, __LINE__)
 #define realloc(ptr, sz)        m61_realloc((ptr), (sz), __FILE__, __LINE__)
 #define calloc(nmemb, sz)       m61_calloc((nmemb), (sz), __FILE__, __LINE__)
+#define memalign(align, sz)     m61_memalign((align), (sz), __FILE__, __LINE__)
+#define aligned_alloc(align, sz) m61_aligned_alloc((align), (sz), __FILE__, __LINE__)
+#define malloc_batch(n, sz, ptrs) m61_malloc_batch((n), (sz), (ptrs), __FILE__, __LINE__)
+#define free_batch(n, ptrs)     m61_free_batch((n), (ptrs), __FILE__, __LINE__)
 #endif
 
 #endif
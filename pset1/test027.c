@@ -0,0 +1,27 @@
+#include "m61.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <inttypes.h>
+// Aligned allocations are tracked like any other allocation.
+
+int main() {
+    char *a = (char *) memalign(64, 100);
+    char *b = (char *) aligned_alloc(4096, 8192);
+    char *c = (char *) memalign(8, 10);
+    assert((uintptr_t) a % 64 == 0);
+    assert((uintptr_t) b % 4096 == 0);
+    assert((uintptr_t) c % 8 == 0);
+    memset(a, 1, 100);
+    memset(b, 2, 8192);
+    assert(!memalign(48, 100));             // not a power of two
+    assert(!aligned_alloc(64, 100));        // size not a multiple
+    free(a);
+    free(c);
+    m61_printstatistics();
+    m61_printleakreport();
+}
+
+//! malloc count: active          1   total          3   fail          2
+//! malloc size:  active       8192   total       8302   fail        200
+//! LEAK CHECK: test027.c:10: allocated object ??{\w+}?? with size 8192
@@ -0,0 +1,16 @@
+#include "m61.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+// Boundary write error check on an aligned allocation.
+
+int main() {
+    char *ptr = (char *) memalign(256, 32);
+    for (int i = 0; i <= 32 /* Whoops! Should be < */; ++i)
+        ptr[i] = 'x';
+    free(ptr);
+    m61_printstatistics();
+}
+
+//! MEMORY BUG???: detected wild write during free of pointer ???
+//! ???
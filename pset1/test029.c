@@ -0,0 +1,25 @@
+#include "m61.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <inttypes.h>
+// Batch allocation: objects may be freed individually or in batches.
+
+int main() {
+    void *ptrs[100];
+    size_t n = malloc_batch(100, 24, ptrs);
+    assert(n == 100);
+    for (int i = 0; i < 100; ++i) {
+        assert((uintptr_t) ptrs[i] % __alignof__(double) == 0);
+        memset(ptrs[i], i, 24);
+    }
+    free(ptrs[0]);
+    free(ptrs[99]);
+    free_batch(97, &ptrs[1]);
+    m61_printstatistics();
+    m61_printleakreport();
+}
+
+//! malloc count: active          1   total        100   fail          0
+//! malloc size:  active         24   total       2400   fail          0
+//! LEAK CHECK: test029.c:10: allocated object ??{\w+}?? with size 24
@@ -0,0 +1,23 @@
+#include "m61.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+// Heap check finds boundary write errors in blocks that are never freed.
+
+int main() {
+    char *a = (char *) malloc(10);
+    char *b = (char *) malloc(20);
+    char *c = (char *) malloc(30);
+    (void) b;
+    strcpy(a, "0123456789");            // writes 11 bytes
+    memset(c, 0, 31);
+    size_t nbad = m61_checkheap();
+    printf("%zu corrupted blocks\n", nbad);
+}
+
+//!!SORT
+//!   test030.c:10: 30 byte region allocated here
+//!   test030.c:8: 10 byte region allocated here
+//! 2 corrupted blocks
+//! MEMORY BUG: checkheap: detected wild write after pointer ???
+//! MEMORY BUG: checkheap: detected wild write after pointer ???
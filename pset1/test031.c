@@ -0,0 +1,25 @@
+#include "m61.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+// The background heap checker reports each corrupted block once.
+
+int main() {
+    void *ptrs[1000];
+    for (int i = 0; i < 1000; ++i)
+        ptrs[i] = malloc(i + 1);
+    char *p = (char *) malloc(100);
+    p[100] = 'x';
+    m61_setcheckheap(1, 100);
+    usleep(200000);
+    m61_setcheckheap(0, 0);
+    for (int i = 0; i < 1000; ++i)
+        free(ptrs[i]);
+    m61_printstatistics();
+}
+
+//! MEMORY BUG: checkheap: detected wild write after pointer ???
+//!   test031.c:12: 100 byte region allocated here
+//! malloc count: active          1   total       1001   fail          0
+//! malloc size:  active        100   total     500600   fail          0
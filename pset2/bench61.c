@@ -0,0 +1,559 @@
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+// Usage: ./bench61 [-n REPS] [-p PROGRAMS] [-i IMPLS] [-z SIZES]
+//                  [-b BLOCKS] [-s STRIDES] [-S SEEDS] [-J THREADS] [-j]
+//                  [-B BASELINE] [-t PERCENT] [-T SECONDS] [-a]
+//    Benchmarks the pset2 programs across a matrix of file sizes,
+//    block sizes, strides, seeds, and thread counts, running each
+//    configuration
+//    against io61, stdio-io61, and slow-io61. Each configuration runs
+//    REPS times (default 5); the report gives the mean time, a 95%
+//    confidence interval, MB/s, and, for io61, system calls per MB. It
+//    is CSV on standard output, or JSON with -j.
+//
+//    PROGRAMS, IMPLS (io61, stdio, slow), SIZES, BLOCKS, STRIDES,
+//    SEEDS, and THREADS are comma-separated lists; sizes may end in k or
+//    m. The slow versions only run on the smallest size unless -a is
+//    given, and never run pipeexchange61, whose byte-at-a-time socket
+//    writes deadlock. For configurations that vary only in thread count, the
+//    speedup of each over one thread is also printed to standard error.
+//
+//    With -B, BASELINE is an earlier CSV report. A configuration whose
+//    MB/s fell more than PERCENT (default 10) below the baseline, with
+//    the two confidence intervals apart, is marked "regressed", and
+//    bench61 exits with status 1. Each run is killed after SECONDS
+//    (default 30).
+
+#define MAXLIST 16
+#define MAXRESULTS 4096
+
+// which matrix axes a program takes
+enum { AX_BLOCK = 1, AX_STRIDE = 2, AX_SEED = 4, AX_THREADS = 8 };
+
+typedef struct bench_program {
+    const char* name;
+    int axes;
+    const char* fixed;     /* extra arguments, or "" */
+    int file;              /* 0: no input; 1: input FILE; 2: FILE edited in place */
+    const char* noslow;    /* why the slow version is not run, or NULL */
+} bench_program;
+
+static const bench_program programs[] = {
+    { "cat61", 0, "", 1, NULL },
+    { "cat61", AX_THREADS, "", 1, NULL },
+    { "blockcat61", AX_BLOCK, "", 1, NULL },
+    { "randomcat61", AX_BLOCK | AX_SEED, "", 1, NULL },
+    { "reordercat61", AX_BLOCK | AX_SEED, "", 1, NULL },
+    { "stridecat61", AX_BLOCK | AX_STRIDE, "", 1, NULL },
+    { "ostridecat61", AX_BLOCK | AX_STRIDE, "", 1, NULL },
+    { "reverse61", 0, "", 1, NULL },
+    // The requester sends a whole batch before it reads any replies.
+    // slow-io61 sends each byte as its own socket buffer, and the
+    // kernel charges every one of them far more than a byte, so both
+    // sides fill their sockets and block, and the run always times out.
+    { "pipeexchange61", 0, "", 0,
+      "a batch of one-byte socket writes fills both sockets and deadlocks" },
+    { "inplace61", AX_BLOCK, "", 2, NULL },
+    { "recordcat61", AX_BLOCK, "-v", 1, NULL }
+};
+#define NPROGRAMS (sizeof(programs) / sizeof(programs[0]))
+
+static const char* const impls[] = { "io61", "stdio", "slow" };
+static const char* const impl_prefixes[] = { "", "stdio-", "slow-" };
+#define NIMPLS 3
+
+typedef struct bench_list {
+    size_t v[MAXLIST];
+    int n;
+} bench_list;
+
+typedef struct bench_result {
+    char impl[8];
+    char program[32];
+    char args[96];
+    size_t size;
+    int reps;              /* successful runs */
+    double time;           /* mean seconds */
+    double time_ci;        /* 95% confidence half-width */
+    double mbps;
+    double mbps_ci;
+    double syscalls_per_mb;  /* -1 if not reported */
+    const char* status;
+} bench_result;
+
+static bench_result results[MAXRESULTS];
+static int nresults;
+static double timeout_sec = 30;
+
+
+// parse_list(s, l)
+//    Parse comma-separated sizes like "4096,1m" into `l`.
+
+static void parse_list(const char* s, bench_list* l) {
+    l->n = 0;
+    while (*s && l->n < MAXLIST) {
+        char* end;
+        size_t x = strtoul(s, &end, 0);
+        if (*end == 'k' || *end == 'K')
+            x <<= 10, ++end;
+        else if (*end == 'm' || *end == 'M')
+            x <<= 20, ++end;
+        l->v[l->n++] = x;
+        s = *end == ',' ? end + 1 : end + strlen(end);
+    }
+}
+
+
+// in_list(s, name)
+//    Return nonzero if `name` is an element of comma-separated `s`, or
+//    if `s` is NULL.
+
+static int in_list(const char* s, const char* name) {
+    size_t len = strlen(name);
+    while (s && *s) {
+        const char* comma = strchr(s, ',');
+        size_t n = comma ? (size_t) (comma - s) : strlen(s);
+        if (n == len && memcmp(s, name, n) == 0)
+            return 1;
+        s += n + (comma != NULL);
+    }
+    return s == NULL;
+}
+
+
+// make_input(filename, size)
+//    Create `filename` with `size` bytes of text, as check.pl does,
+//    unless it already has that size.
+
+static void make_input(const char* filename, size_t size) {
+    struct stat st;
+    if (stat(filename, &st) == 0 && (size_t) st.st_size == size)
+        return;
+    FILE* words = fopen("/usr/share/dict/words", "r");
+    FILE* out = fopen(filename, "w");
+    if (!out) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    char buf[8192];
+    size_t n = 0;
+    while (n < size) {
+        size_t m = 0;
+        if (words && (m = fread(buf, 1, sizeof(buf), words)) == 0) {
+            rewind(words);
+            continue;
+        } else if (!words)
+            m = snprintf(buf, sizeof(buf), "line %zu of benchmark text\n", n);
+        if (m > size - n)
+            m = size - n;
+        fwrite(buf, 1, m, out);
+        n += m;
+    }
+    if (words)
+        fclose(words);
+    fclose(out);
+}
+
+
+// copy_file(from, to)
+//    Copy `from` to `to`, for programs that edit their input.
+
+static void copy_file(const char* from, const char* to) {
+    int in = open(from, O_RDONLY);
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    char buf[65536];
+    ssize_t r;
+    while (in >= 0 && out >= 0 && (r = read(in, buf, sizeof(buf))) > 0)
+        if (write(out, buf, r) != r)
+            break;
+    close(in);
+    close(out);
+}
+
+
+// json_number(buf, key)
+//    Return the number that follows `"key":` in `buf`, or -1.
+
+static double json_number(const char* buf, const char* key) {
+    char pat[64];
+    snprintf(pat, sizeof(pat), "\"%s\":", key);
+    const char* p = strstr(buf, pat);
+    return p ? strtod(p + strlen(pat), NULL) : -1;
+}
+
+
+// run_once(argv, report, sz, wall)
+//    Run `argv` with standard output sent to files/bench-out.txt and
+//    its profile report on file descriptor 100. Store the report in
+//    `report` and the elapsed wall-clock time in `*wall`. Returns 0 on
+//    success and -1 if the program failed or ran out of time.
+
+static int run_once(char** argv, char* report, size_t sz, double* wall) {
+    int pfd[2];
+    if (pipe(pfd) < 0)
+        return -1;
+    pid_t p = fork();
+    if (p == 0) {
+        setpgid(0, 0);
+        int out = open("files/bench-out.txt", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, STDIN_FILENO);
+        dup2(out, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        dup2(pfd[1], 100);
+        close(pfd[0]);
+        close(pfd[1]);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    close(pfd[1]);
+    if (p < 0) {
+        close(pfd[0]);
+        return -1;
+    }
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t len = 0;
+    int timed_out = 0;
+    while (1) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double left = timeout_sec - (now.tv_sec - start.tv_sec)
+            - (now.tv_nsec - start.tv_nsec) / 1e9;
+        struct pollfd pf = { pfd[0], POLLIN, 0 };
+        if (left <= 0 || poll(&pf, 1, (int) (left * 1000) + 1) == 0) {
+            timed_out = 1;
+            break;
+        }
+        ssize_t r = read(pfd[0], report + len, sz - 1 - len);
+        if (r > 0)
+            len += r;
+        else if (r == 0 || (errno != EINTR && errno != EAGAIN))
+            break;
+    }
+    report[len] = '\0';
+    close(pfd[0]);
+    if (timed_out)
+        kill(-p, SIGKILL);
+    int status;
+    waitpid(p, &status, 0);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    *wall = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+    if (timed_out || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        return -1;
+    return 0;
+}
+
+
+// t95(df)
+//    Two-sided 95% Student's t quantile for `df` degrees of freedom.
+
+static double t95(int df) {
+    static const double t[] = {
+        0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306,
+        2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110,
+        2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056,
+        2.052, 2.048, 2.045, 2.042
+    };
+    return df < 1 ? 0 : df <= 30 ? t[df] : 1.96;
+}
+
+
+// bench(prog, args, input, size, nreps, impl_mask)
+//    Run one configuration of `prog` `nreps` times under each
+//    implementation in `impl_mask`, interleaving the implementations,
+//    and record the results.
+
+static void bench(const bench_program* prog, const char* args,
+                  const char* input, size_t size, int nreps, int impl_mask) {
+    double times[NIMPLS][64], calls[NIMPLS];
+    int n[NIMPLS] = { 0, 0, 0 }, failed[NIMPLS] = { 0, 0, 0 };
+    if (nreps > 64)
+        nreps = 64;
+    for (int i = 0; i < NIMPLS; ++i)
+        calls[i] = 0;
+
+    for (int rep = 0; rep < nreps; ++rep)
+        for (int i = 0; i < NIMPLS; ++i) {
+            if (!(impl_mask & (1 << i)) || failed[i])
+                continue;
+            // build argv: ./PREFIXprog [fixed] [args] [file]
+            char path[64], argbuf[256];
+            char* argv[32];
+            int argc = 0;
+            snprintf(path, sizeof(path), "./%s%s", impl_prefixes[i], prog->name);
+            argv[argc++] = path;
+            snprintf(argbuf, sizeof(argbuf), "%s %s", prog->fixed, args);
+            for (char* tok = strtok(argbuf, " "); tok && argc < 30;
+                 tok = strtok(NULL, " "))
+                argv[argc++] = tok;
+            if (prog->file == 2) {
+                copy_file(input, "files/bench-inplace.txt");
+                argv[argc++] = (char*) "files/bench-inplace.txt";
+            } else if (prog->file == 1)
+                argv[argc++] = (char*) input;
+            argv[argc] = NULL;
+
+            // prefer the program's own profile time, which excludes
+            // process startup; fall back to wall-clock time
+            char report[16384];
+            double wall, t;
+            if (run_once(argv, report, sizeof(report), &wall) < 0) {
+                failed[i] = 1;
+                continue;
+            }
+            t = json_number(report, "time");
+            times[i][n[i]++] = t >= 0 ? t : wall;
+            double r = json_number(report, "io_reads"),
+                w = json_number(report, "io_writes");
+            calls[i] = r >= 0 && w >= 0 && calls[i] >= 0 ? calls[i] + r + w : -1;
+        }
+
+    for (int i = 0; i < NIMPLS && nresults < MAXRESULTS; ++i) {
+        if (!(impl_mask & (1 << i)))
+            continue;
+        bench_result* res = &results[nresults++];
+        snprintf(res->impl, sizeof(res->impl), "%s", impls[i]);
+        snprintf(res->program, sizeof(res->program), "%s", prog->name);
+        snprintf(res->args, sizeof(res->args), "%s%s%s", prog->fixed,
+                 *prog->fixed && *args ? " " : "", args);
+        res->size = size;
+        res->reps = n[i];
+        res->status = failed[i] || n[i] == 0 ? "failed" : "ok";
+        double mean = 0, var = 0;
+        for (int k = 0; k < n[i]; ++k)
+            mean += times[i][k];
+        mean = n[i] ? mean / n[i] : 0;
+        for (int k = 0; k < n[i]; ++k)
+            var += (times[i][k] - mean) * (times[i][k] - mean);
+        var = n[i] > 1 ? var / (n[i] - 1) : 0;
+        res->time = mean;
+        res->time_ci = n[i] > 1 ? t95(n[i] - 1) * sqrt(var / n[i]) : 0;
+        double mb = size / 1048576.0;
+        res->mbps = mean > 0 && mb > 0 ? mb / mean : 0;
+        res->mbps_ci = mean > 0 ? res->mbps * res->time_ci / mean : 0;
+        res->syscalls_per_mb = calls[i] >= 0 && n[i] && mb > 0
+            ? calls[i] / n[i] / mb : -1;
+    }
+}
+
+
+// print_scaling()
+//    For each io61 result run with "-j N", print its speedup over the
+//    same configuration with "-j 1".
+
+static void print_scaling(void) {
+    for (int i = 0; i < nresults; ++i) {
+        bench_result* one = &results[i];
+        if (strcmp(one->impl, "io61") != 0 || strcmp(one->args, "-j 1") != 0
+            || strcmp(one->status, "ok") != 0 || one->mbps <= 0)
+            continue;
+        fprintf(stderr, "SCALING: %s size %zu: 1 thread %.1f MB/s",
+                one->program, one->size, one->mbps);
+        for (int j = 0; j < nresults; ++j) {
+            bench_result* r = &results[j];
+            if (j != i && strcmp(r->impl, "io61") == 0
+                && strcmp(r->program, one->program) == 0
+                && r->size == one->size && strncmp(r->args, "-j ", 3) == 0
+                && strcmp(r->status, "ok") == 0)
+                fprintf(stderr, ", %s threads %.2fx", r->args + 3,
+                        r->mbps / one->mbps);
+        }
+        fprintf(stderr, "\n");
+    }
+}
+
+
+// check_baseline(filename, threshold)
+//    Compare the results with the CSV report in `filename`, marking
+//    regressions. Returns the number of regressions.
+
+static int check_baseline(const char* filename, double threshold) {
+    FILE* f = fopen(filename, "r");
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    char line[512];
+    int nregressed = 0;
+    while (fgets(line, sizeof(line), f)) {
+        char impl[8], program[32], args[96];
+        size_t size;
+        int reps;
+        double time, time_ci, mbps, mbps_ci;
+        if (sscanf(line, "%7[^,],%31[^,],%95[^,],%zu,%d,%lf,%lf,%lf,%lf",
+                   impl, program, args, &size, &reps, &time, &time_ci,
+                   &mbps, &mbps_ci) != 9)
+            continue;
+        if (strcmp(args, "-") == 0)
+            args[0] = '\0';
+        for (int i = 0; i < nresults; ++i) {
+            bench_result* r = &results[i];
+            if (strcmp(r->impl, impl) != 0 || strcmp(r->program, program) != 0
+                || strcmp(r->args, args) != 0 || r->size != size
+                || strcmp(r->status, "ok") != 0 || mbps <= 0)
+                continue;
+            if (r->mbps < mbps * (1 - threshold)
+                && r->mbps + r->mbps_ci < mbps - mbps_ci) {
+                r->status = "regressed";
+                ++nregressed;
+                fprintf(stderr, "REGRESSION: %s %s %s size %zu: %.1f MB/s, baseline %.1f MB/s\n",
+                        impl, program, r->args, size, r->mbps, mbps);
+            }
+        }
+    }
+    fclose(f);
+    return nregressed;
+}
+
+
+static void print_csv(void) {
+    printf("impl,program,args,size,reps,time,time_ci95,mbps,mbps_ci95,syscalls_per_mb,status\n");
+    for (int i = 0; i < nresults; ++i) {
+        bench_result* r = &results[i];
+        printf("%s,%s,%s,%zu,%d,%.6f,%.6f,%.2f,%.2f,", r->impl, r->program,
+               *r->args ? r->args : "-", r->size, r->reps, r->time,
+               r->time_ci, r->mbps, r->mbps_ci);
+        if (r->syscalls_per_mb >= 0)
+            printf("%.2f", r->syscalls_per_mb);
+        printf(",%s\n", r->status);
+    }
+}
+
+
+static void print_json(void) {
+    printf("[");
+    for (int i = 0; i < nresults; ++i) {
+        bench_result* r = &results[i];
+        printf("%s\n {\"impl\":\"%s\", \"program\":\"%s\", \"args\":\"%s\", \"size\":%zu, \"reps\":%d, \"time\":%.6f, \"time_ci95\":%.6f, \"mbps\":%.2f, \"mbps_ci95\":%.2f, ",
+               i ? "," : "", r->impl, r->program, r->args, r->size, r->reps,
+               r->time, r->time_ci, r->mbps, r->mbps_ci);
+        if (r->syscalls_per_mb >= 0)
+            printf("\"syscalls_per_mb\":%.2f, ", r->syscalls_per_mb);
+        else
+            printf("\"syscalls_per_mb\":null, ");
+        printf("\"status\":\"%s\"}", r->status);
+    }
+    printf("\n]\n");
+}
+
+
+int main(int argc, char** argv) {
+    int nreps = 5, json = 0, all_slow = 0;
+    const char* program_list = NULL;
+    const char* impl_list = NULL;
+    const char* baseline = NULL;
+    double threshold = 0.10;
+    bench_list sizes, blocks, strides, seeds, threads;
+    parse_list("1m,5m,20m", &sizes);
+    parse_list("1,4096,65536", &blocks);
+    parse_list("4096,1048576", &strides);
+    parse_list("1,2", &seeds);
+    parse_list("1,2,4,8", &threads);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:p:i:z:b:s:S:J:jB:t:T:a")) != -1)
+        switch (opt) {
+        case 'n': nreps = atoi(optarg); break;
+        case 'p': program_list = optarg; break;
+        case 'i': impl_list = optarg; break;
+        case 'z': parse_list(optarg, &sizes); break;
+        case 'b': parse_list(optarg, &blocks); break;
+        case 's': parse_list(optarg, &strides); break;
+        case 'S': parse_list(optarg, &seeds); break;
+        case 'J': parse_list(optarg, &threads); break;
+        case 'j': json = 1; break;
+        case 'B': baseline = optarg; break;
+        case 't': threshold = atof(optarg) / 100; break;
+        case 'T': timeout_sec = atof(optarg); break;
+        case 'a': all_slow = 1; break;
+        default:
+            fprintf(stderr, "Usage: ./bench61 [-n REPS] [-p PROGRAMS] [-i IMPLS] [-z SIZES] [-b BLOCKS]\n"
+                    "                 [-s STRIDES] [-S SEEDS] [-J THREADS] [-j] [-B BASELINE]\n"
+                    "                 [-t PERCENT] [-T SECONDS] [-a]\n");
+            exit(1);
+        }
+    if (nreps < 1 || sizes.n == 0) {
+        fprintf(stderr, "bench61: nothing to run\n");
+        exit(1);
+    }
+    mkdir("files", 0777);
+
+    int impl_mask = 0;
+    for (int i = 0; i < NIMPLS; ++i)
+        if (in_list(impl_list, impls[i]))
+            impl_mask |= 1 << i;
+    size_t smallest = sizes.v[0];
+    for (int z = 1; z < sizes.n; ++z)
+        smallest = sizes.v[z] < smallest ? sizes.v[z] : smallest;
+
+    for (size_t p = 0; p < NPROGRAMS; ++p) {
+        const bench_program* prog = &programs[p];
+        if (!in_list(program_list, prog->name))
+            continue;
+        for (int z = 0; z < (prog->file ? sizes.n : 1); ++z) {
+            size_t size = prog->file ? sizes.v[z] : 0;
+            char input[64];
+            snprintf(input, sizeof(input), "files/bench-%zu.txt", size);
+            if (prog->file)
+                make_input(input, size);
+            int mask = impl_mask;
+            if (!all_slow && size != smallest && prog->file)
+                mask &= ~4;
+            if (prog->noslow && (mask & 4)) {
+                fprintf(stderr, "%s: not running slow-%s: %s\n",
+                        prog->name, prog->name, prog->noslow);
+                mask &= ~4;
+            }
+            // walk the axes the program takes
+            int nb = prog->axes & AX_BLOCK ? blocks.n : 1;
+            int ns = prog->axes & AX_STRIDE ? strides.n : 1;
+            int nd = prog->axes & AX_SEED ? seeds.n : 1;
+            int nj = prog->axes & AX_THREADS ? threads.n : 1;
+            for (int b = 0; b < nb; ++b)
+                for (int s = 0; s < ns; ++s)
+                    for (int d = 0; d < nd; ++d)
+                        for (int j = 0; j < nj; ++j) {
+                            char args[96];
+                            int len = 0;
+                            args[0] = '\0';
+                            if (prog->axes & AX_BLOCK)
+                                len += snprintf(args + len, sizeof(args) - len,
+                                                "%s-b %zu", len ? " " : "", blocks.v[b]);
+                            if (prog->axes & AX_STRIDE)
+                                len += snprintf(args + len, sizeof(args) - len,
+                                                "%s-s %zu", len ? " " : "", strides.v[s]);
+                            if (prog->axes & AX_SEED)
+                                len += snprintf(args + len, sizeof(args) - len,
+                                                "%s-S %zu", len ? " " : "", seeds.v[d]);
+                            if (prog->axes & AX_THREADS)
+                                len += snprintf(args + len, sizeof(args) - len,
+                                                "%s-j %zu", len ? " " : "", threads.v[j]);
+                            fprintf(stderr, "%s %s %zu\n", prog->name, args, size);
+                            bench(prog, args, input, size, nreps, mask);
+                        }
+        }
+    }
+
+    print_scaling();
+    int nregressed = baseline ? check_baseline(baseline, threshold) : 0;
+    if (json)
+        print_json();
+    else
+        print_csv();
+    unlink("files/bench-out.txt");
+    unlink("files/bench-inplace.txt");
+    return nregressed ? 1 : 0;
+}
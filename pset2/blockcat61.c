@@ -1,15 +1,45 @@
 #include "io61.h"
 
-// Usage: ./blockcat61 [-b BLOCKSIZE] [FILE]
+// Usage: ./blockcat61 [-b BLOCKSIZE] [-S SLOTSIZE] [-m] [-a] [-d] [-v] [-c]
+//                    [FILE]
 //    Copies the input FILE to standard output one block at a time.
-//    Default BLOCKSIZE is 4096.
+//    Default BLOCKSIZE is 4096. With -S, both files get a cache of 8
+//    slots of SLOTSIZE bytes. With -m, FILE is opened with IO61_MMAP.
+//    With -a, both files are opened with IO61_ASYNC, and with -d, with
+//    IO61_DIRECT.
+//    With -v, blocks are read with io61_read_view instead of being
+//    copied into a buffer. With -c, each block is moved by io61_copy.
 
 int main(int argc, char** argv) {
     // Parse arguments
-    size_t blocksize = 4096;
-    if (argc >= 3 && strcmp(argv[1], "-b") == 0) {
-        blocksize = strtoul(argv[2], 0, 0);
-        argc -= 2, argv += 2;
+    size_t blocksize = 4096, slotsize = 0;
+    int mode = O_RDONLY, outmode = O_WRONLY, view = 0, copy = 0;
+    while (argc >= 2) {
+        if (argc >= 3 && strcmp(argv[1], "-b") == 0) {
+            blocksize = strtoul(argv[2], 0, 0);
+            argc -= 2, argv += 2;
+        } else if (argc >= 3 && strcmp(argv[1], "-S") == 0) {
+            slotsize = strtoul(argv[2], 0, 0);
+            argc -= 2, argv += 2;
+        } else if (strcmp(argv[1], "-d") == 0) {
+            mode |= IO61_DIRECT;
+            outmode |= IO61_DIRECT;
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-m") == 0) {
+            mode |= IO61_MMAP;
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-a") == 0) {
+            mode |= IO61_ASYNC;
+            outmode |= IO61_ASYNC;
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-v") == 0) {
+            view = 1;
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-c") == 0) {
+            copy = 1;
+            --argc, ++argv;
+        } else
+            break;
     }
 
     // Allocate buffer, open files
@@ -18,15 +48,28 @@ int main(int argc, char** argv) {
 
     const char* in_filename = argc >= 2 ? argv[1] : NULL;
     io61_profile_begin();
-    io61_file* inf = io61_open_check(in_filename, O_RDONLY);
-    io61_file* outf = io61_fdopen(STDOUT_FILENO, O_WRONLY);
+    io61_file* inf = io61_open_check(in_filename, mode);
+    io61_file* outf = io61_fdopen(STDOUT_FILENO, outmode);
+    if (slotsize) {
+        io61_setcache(inf, 8, slotsize);
+        io61_setcache(outf, 8, slotsize);
+    }
 
     // Copy file data
     while (1) {
-        ssize_t amount = io61_read(inf, buf, blocksize);
+        const char* data = buf;
+        ssize_t amount;
+        if (copy) {
+            if (io61_copy(inf, outf, blocksize) <= 0)
+                break;
+            continue;
+        } else if (view)
+            amount = io61_read_view(inf, &data, blocksize);
+        else
+            amount = io61_read(inf, buf, blocksize);
         if (amount <= 0)
             break;
-        io61_write(outf, buf, amount);
+        io61_write(outf, data, amount);
     }
 
     io61_close(inf);
@@ -1,21 +1,88 @@
 #include "io61.h"
 
-// Usage: ./cat61 [FILE]
+// Usage: ./cat61 [-m] [-a] [-c] [-j THREADS] [-P PROGRESS] [-k] [-K]
+//                [-z] [-Z] [FILE]
 //    Copies the input FILE to standard output one character at a time.
+//    With -m, FILE is opened with IO61_MMAP. With -a, both files are
+//    opened with IO61_ASYNC. With -c, the whole file is copied by a
+//    single io61_copy call instead. With -j, it is copied by a single
+//    io61_pcopy call with THREADS threads, which records its progress in
+//    the file PROGRESS if -P is given. With -k, FILE is read through a
+//    CRC32C layer, and its checksum is appended to the output as a line
+//    "crc32c XXXXXXXX"; with -K, the output is written through one, and
+//    the checksum of what was written is appended. With -z, the output
+//    is compressed through io61_open_lz; with -Z, FILE is a compressed
+//    frame and is decompressed. Checksums cover uncompressed bytes.
 
 int main(int argc, char** argv) {
+    int mode = O_RDONLY, outmode = O_WRONLY, copy = 0, nthreads = 0;
+    int incrc = 0, outcrc = 0, inlz = 0, outlz = 0;
+    const char* progress = NULL;
+    while (argc >= 2) {
+        if (argc >= 3 && strcmp(argv[1], "-j") == 0) {
+            nthreads = strtol(argv[2], 0, 0);
+            --argc, ++argv;
+        } else if (argc >= 3 && strcmp(argv[1], "-P") == 0) {
+            progress = argv[2];
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-k") == 0)
+            incrc = 1;
+        else if (strcmp(argv[1], "-K") == 0)
+            outcrc = 1;
+        else if (strcmp(argv[1], "-z") == 0)
+            outlz = 1;
+        else if (strcmp(argv[1], "-Z") == 0)
+            inlz = 1;
+        else if (strcmp(argv[1], "-m") == 0)
+            mode |= IO61_MMAP;
+        else if (strcmp(argv[1], "-a") == 0) {
+            mode |= IO61_ASYNC;
+            outmode |= IO61_ASYNC;
+        } else if (strcmp(argv[1], "-c") == 0)
+            copy = 1;
+        else
+            break;
+        --argc, ++argv;
+    }
     const char* in_filename = argc >= 2 ? argv[1] : NULL;
     io61_profile_begin();
-    io61_file* inf = io61_open_check(in_filename, O_RDONLY);
-    io61_file* outf = io61_fdopen(STDOUT_FILENO, O_WRONLY);
+    io61_file* inf = io61_open_check(in_filename, mode);
+    io61_file* outf = io61_fdopen(STDOUT_FILENO, outmode);
+    if (inlz && inf)
+        inf = io61_open_lz(inf);
+    if (outlz && outf)
+        outf = io61_open_lz(outf);
+    if (incrc && inf)
+        inf = io61_open_crc32c(inf);
+    if (outcrc && outf)
+        outf = io61_open_crc32c(outf);
+    assert(inf && outf);
+
+    if (nthreads > 0) {
+        if (io61_pcopy(inf, outf, (size_t) -1, nthreads, progress) < 0) {
+            perror("io61_pcopy");
+            exit(1);
+        }
+    } else if (copy)
+        io61_copy(inf, outf, (size_t) -1);
 
-    while (1) {
+    while (!copy && nthreads == 0) {
         int ch = io61_readc(inf);
         if (ch == EOF)
             break;
         io61_writec(outf, ch);
     }
 
+    char line[32];
+    if (incrc) {
+        int n = snprintf(line, sizeof(line), "crc32c %08x\n", io61_crc32c(inf));
+        io61_write(outf, line, n);
+    }
+    if (outcrc) {
+        int n = snprintf(line, sizeof(line), "crc32c %08x\n", io61_crc32c(outf));
+        io61_write(outf, line, n);
+    }
+
     io61_close(inf);
     io61_close(outf);
     io61_profile_end();
@@ -83,11 +83,11 @@ sub run_time ($;$$$$) {
 
     POSIX::close($pw);
     my($nb, $buf);
-    $nb = POSIX::read($pr, $buf, 2000);
+    $nb = POSIX::read($pr, $buf, 16384);
     POSIX::close($pr);
 
     my($answer) = {};
-    while (defined($nb) && $buf =~ m,\"(.*?)\"\s*:\s*([\d.]+),g) {
+    while (defined($nb) && $buf =~ m,\"(\w+)\"\s*:\s*([\d.]+),g) {
         $answer->{$1} = $2;
     }
     $answer->{"time"} = $delta if !defined($answer->{"time"});
@@ -136,8 +136,36 @@ sub run_time_median ($;$$$) {
     return $tt;
 }
 
-sub run ($$$$;$) {
-    my($number, $infile, $command, $desc, $max_time) = @_;
+sub mib ($) {
+    return sprintf("%.1fMiB", $_[0] / 1048576);
+}
+
+sub print_counters ($) {
+    my($t) = @_;
+    return if !defined($t->{"io_reads"});
+    printf("IO61:      %d reads (%s), %d writes (%s), %d hits, %d misses,\n"
+           . "           %d seeks, %d flushes, %s memcpy'd\n",
+           $t->{"io_reads"}, mib($t->{"io_rbytes"}),
+           $t->{"io_writes"}, mib($t->{"io_wbytes"}),
+           $t->{"io_hits"}, $t->{"io_misses"}, $t->{"io_seeks"},
+           $t->{"io_flushes"}, mib($t->{"io_copied"}));
+}
+
+sub print_perf ($) {
+    my($t) = @_;
+    my(@x);
+    push @x, "$t->{cycles} cycles" if defined($t->{"cycles"});
+    push @x, "$t->{instructions} instructions" if defined($t->{"instructions"});
+    push @x, sprintf("%.2f IPC", $t->{"instructions"} / $t->{"cycles"})
+        if defined($t->{"instructions"}) && $t->{"cycles"};
+    push @x, "$t->{llc_misses} LLC misses" if defined($t->{"llc_misses"});
+    push @x, "$t->{ctxswitches} context switches" if defined($t->{"ctxswitches"});
+    push @x, "$t->{pagefaults} page faults" if defined($t->{"pagefaults"});
+    print "PERF:      ", join(", ", @x), "\n" if @x;
+}
+
+sub run ($$$$;$$) {
+    my($number, $infile, $command, $desc, $max_time, $expect) = @_;
     return if (@ARGV && !grep {
         $_ == $number
             || ($_ =~ m{^(\d+)-(\d+)$} && $number >= $1 && $number <= $2)
@@ -171,6 +199,8 @@ sub run ($$$$;$) {
                    $t->{"medianof"} == 1 ? "" : "s", $tt->{"medianof"});
         }
         printf("\n");
+        print_counters($tt);
+        print_perf($tt);
         push @ratios, $t->{"time"} / $tt->{"time"};
         push @basetimes, $t->{"time"};
         if ($base =~ m<files/baseout\.txt>
@@ -178,6 +208,11 @@ sub run ($$$$;$) {
             print "           ERROR! files/out.txt differs from base version\n";
             ++$nerror;
         }
+        if ($expect
+            && `cmp $expect files/out.txt >/dev/null 2>&1 || echo OOPS` eq "OOPS\n") {
+            print "           ERROR! files/out.txt differs from $expect\n";
+            ++$nerror;
+        }
     }
     print $tt->{"stderr"} if $tt->{"stderr"} ne "";
     print "\n";
@@ -220,6 +255,8 @@ if (!-d "files" && (-e "files" || !mkdir("files"))) {
 makefile("files/text1meg.txt", 1 << 20);
 makefile("files/text5meg.txt", 5 << 20);
 makefile("files/text20meg.txt", 20 << 20);
+# a frame written by io61.c, which every version must decode
+system("./cat61 -z files/text5meg.txt > files/text5meg.lz 2>/dev/null");
 
 $SIG{"INT"} = sub {
     summary();
@@ -306,4 +343,153 @@ run(20, "files/text5meg.txt",
     "./stridecat61 -s 1048576 files/text5meg.txt > files/out.txt",
     "1MB stride medium file", 20);
 
+run(21, "files/text5meg.txt",
+    "{ ./cat61 files/text1meg.txt; ./blockcat61 -d files/text5meg.txt; ./cat61 -c files/text1meg.txt; } > files/out.txt",
+    "writers in sequence on one regular file", 20);
+
+run(22, "files/text20meg.txt",
+    "./cat61 -m files/text20meg.txt > files/out.txt",
+    "mmap regular large file 1B", 20);
+
+run(23, "files/text20meg.txt",
+    "./blockcat61 -m files/text20meg.txt > files/out.txt",
+    "mmap regular large file 4KB", 20);
+
+run(24, "files/text20meg.txt",
+    "./blockcat61 -v files/text20meg.txt > files/out.txt",
+    "zero-copy view regular large file 4KB", 20);
+
+run(25, "files/text20meg.txt",
+    "./blockcat61 -m -v -b 1048576 files/text20meg.txt > files/out.txt",
+    "zero-copy view mmap regular large file 1MB", 20);
+
+run(26, "files/text20meg.txt",
+    "cat files/text20meg.txt | ./blockcat61 -m -v | cat > files/out.txt",
+    "zero-copy view piped large file 4KB", 20);
+
+run(27, "files/text5meg.txt",
+    "cp files/text5meg.txt files/out.txt && ./inplace61 files/out.txt",
+    "in-place read/write medium file 1KB", 20);
+
+run(28, "files/text20meg.txt",
+    "./cat61 -c files/text20meg.txt > files/out.txt",
+    "kernel copy regular large file", 20);
+
+run(29, "files/text20meg.txt",
+    "cat files/text20meg.txt | ./cat61 -c | cat > files/out.txt",
+    "kernel copy piped large file", 20);
+
+run(30, "files/text20meg.txt",
+    "./blockcat61 -c files/text20meg.txt > files/out.txt",
+    "kernel copy regular large file 4KB", 20);
+
+run(31, "files/text20meg.txt",
+    "./blockcat61 -b 1048576 files/text20meg.txt > files/out.txt",
+    "sequential regular large file 1MB", 20);
+
+run(32, "files/text20meg.txt",
+    "cat files/text20meg.txt | ./blockcat61 -b 1048576 | cat > files/out.txt",
+    "sequential piped large file 1MB", 20);
+
+run(33, "files/text5meg.txt",
+    "./recordcat61 files/text5meg.txt > files/out.txt",
+    "small records medium file 64B", 20);
+
+run(34, "files/text5meg.txt",
+    "./recordcat61 -v files/text5meg.txt > files/out.txt",
+    "vectored small records medium file 64B", 20);
+
+run(35, "files/text20meg.txt",
+    "./recordcat61 -v -b 262144 files/text20meg.txt > files/out.txt",
+    "vectored large records large file 256KB", 20);
+
+run(36, "files/text20meg.txt",
+    "dd if=files/text20meg.txt iflag=nocache count=0 2>/dev/null; ./cat61 -a files/text20meg.txt > files/out.txt",
+    "async cold regular large file 1B", 20);
+
+run(37, "files/text20meg.txt",
+    "dd if=files/text20meg.txt iflag=nocache count=0 2>/dev/null; ./blockcat61 -a files/text20meg.txt > files/out.txt",
+    "async cold regular large file 4KB", 20);
+
+run(38, "files/text20meg.txt",
+    "cat files/text20meg.txt | ./blockcat61 -a | cat > files/out.txt",
+    "async piped large file 4KB", 20);
+
+run(39, "files/text20meg.txt",
+    "./blockcat61 -d files/text20meg.txt > files/out.txt",
+    "direct regular large file 4KB", 20);
+
+run(40, "files/text20meg.txt",
+    "./blockcat61 -d -S 1048576 -b 1048576 files/text20meg.txt > files/out.txt",
+    "direct regular large file 1MB slots 1MB", 20);
+
+run(41, "files/text5meg.txt",
+    "./blockcat61 -d -b 1 files/text5meg.txt > files/out.txt",
+    "direct regular medium file 1B", 20);
+
+run(42, "files/text1meg.txt",
+    "./pipeexchange61 -n 200 > files/out.txt",
+    "request/response exchange, hand flushes", 20);
+
+run(43, "files/text1meg.txt",
+    "./pipeexchange61 -i -n 200 > files/out.txt",
+    "request/response exchange, interactive", 20);
+
+run(44, "files/text1meg.txt",
+    "./pipeexchange61 -s -n 200 > files/out.txt",
+    "request/response exchange, one socket per side", 20);
+
+run(45, "files/text1meg.txt",
+    "./pipeexchange61 -s -v -n 200 > files/out.txt",
+    "request/response exchange, one socket per side, writev", 20);
+
+run(46, "files/text20meg.txt",
+    "./linecat61 files/text20meg.txt > files/out.txt",
+    "lines regular large file", 20);
+
+run(47, "files/text20meg.txt",
+    "cat files/text20meg.txt | ./linecat61 | cat > files/out.txt",
+    "lines piped large file", 20);
+
+run(48, "files/text20meg.txt",
+    "./linecat61 -c files/text20meg.txt > files/out.txt",
+    "lines by character regular large file", 20);
+
+run(49, "files/text20meg.txt",
+    "./linecat61 -l files/text20meg.txt > files/out.txt",
+    "line count regular large file", 20);
+
+run(50, "files/text20meg.txt",
+    "./cat61 -j 4 files/text20meg.txt > files/out.txt",
+    "parallel copy regular large file 4 threads", 20);
+
+run(51, "files/text20meg.txt",
+    "./cat61 -k files/text20meg.txt > files/out.txt",
+    "checksummed read regular large file 1B", 20);
+
+run(52, "files/text20meg.txt",
+    "./cat61 -K files/text20meg.txt > files/out.txt",
+    "checksummed write regular large file 1B", 20);
+
+run(53, "files/text20meg.txt",
+    "./cat61 -c -k files/text20meg.txt > files/out.txt",
+    "checksummed kernel copy regular large file", 20);
+
+run(54, "files/text20meg.txt",
+    "./cat61 -c -z files/text20meg.txt | ./cat61 -c -Z > files/out.txt",
+    "compressed round trip through a pipe", 20);
+
+run(55, "files/text20meg.txt",
+    "./cat61 -c -z files/text20meg.txt > files/text20meg.lz && ./reordercat61 -b 65536 -Z files/text20meg.lz > files/out.txt",
+    "reorder compressed regular large file 64KiB", 20);
+
+run(56, "files/text5meg.txt",
+    "./cat61 -Z files/text5meg.lz > files/out.txt",
+    "decompress regular file written by io61", 20, "files/text5meg.txt");
+
+run(57, "files/text5meg.txt",
+    "./cat61 -z files/text5meg.txt | ./stdio-cat61 -Z > files/out.txt",
+    "compress through a pipe, decompress with stdio", 20,
+    "files/text5meg.txt");
+
 summary();
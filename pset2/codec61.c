@@ -0,0 +1,731 @@
+#include "codec61.h"
+#include <errno.h>
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define IO61_CRC32C_HW 1
+#include <nmmintrin.h>
+#endif
+
+// codec61.c
+//    The CRC32C checksum and the compressed frame codec, linked into
+//    every io61 version, and a plain frame reader and writer for the
+//    versions without layers of their own. See codec61.h for the frame
+//    format.
+
+
+// CRC32C (Castagnoli) checksums. io61_crc32c_update uses the SSE4.2
+// crc32 instruction when the CPU has it, 8 bytes at a time on x86-64
+// and 4 on i386 (the -m32 build), and a table otherwise. The table is constant, so threads can checksum
+// blocks concurrently without setting anything up first.
+
+static const uint32_t io61_crc32c_table[256] = {
+    0x00000000, 0xF26B8303, 0xE13B70F7, 0x1350F3F4, 0xC79A971F, 0x35F1141C,
+    0x26A1E7E8, 0xD4CA64EB, 0x8AD958CF, 0x78B2DBCC, 0x6BE22838, 0x9989AB3B,
+    0x4D43CFD0, 0xBF284CD3, 0xAC78BF27, 0x5E133C24, 0x105EC76F, 0xE235446C,
+    0xF165B798, 0x030E349B, 0xD7C45070, 0x25AFD373, 0x36FF2087, 0xC494A384,
+    0x9A879FA0, 0x68EC1CA3, 0x7BBCEF57, 0x89D76C54, 0x5D1D08BF, 0xAF768BBC,
+    0xBC267848, 0x4E4DFB4B, 0x20BD8EDE, 0xD2D60DDD, 0xC186FE29, 0x33ED7D2A,
+    0xE72719C1, 0x154C9AC2, 0x061C6936, 0xF477EA35, 0xAA64D611, 0x580F5512,
+    0x4B5FA6E6, 0xB93425E5, 0x6DFE410E, 0x9F95C20D, 0x8CC531F9, 0x7EAEB2FA,
+    0x30E349B1, 0xC288CAB2, 0xD1D83946, 0x23B3BA45, 0xF779DEAE, 0x05125DAD,
+    0x1642AE59, 0xE4292D5A, 0xBA3A117E, 0x4851927D, 0x5B016189, 0xA96AE28A,
+    0x7DA08661, 0x8FCB0562, 0x9C9BF696, 0x6EF07595, 0x417B1DBC, 0xB3109EBF,
+    0xA0406D4B, 0x522BEE48, 0x86E18AA3, 0x748A09A0, 0x67DAFA54, 0x95B17957,
+    0xCBA24573, 0x39C9C670, 0x2A993584, 0xD8F2B687, 0x0C38D26C, 0xFE53516F,
+    0xED03A29B, 0x1F682198, 0x5125DAD3, 0xA34E59D0, 0xB01EAA24, 0x42752927,
+    0x96BF4DCC, 0x64D4CECF, 0x77843D3B, 0x85EFBE38, 0xDBFC821C, 0x2997011F,
+    0x3AC7F2EB, 0xC8AC71E8, 0x1C661503, 0xEE0D9600, 0xFD5D65F4, 0x0F36E6F7,
+    0x61C69362, 0x93AD1061, 0x80FDE395, 0x72966096, 0xA65C047D, 0x5437877E,
+    0x4767748A, 0xB50CF789, 0xEB1FCBAD, 0x197448AE, 0x0A24BB5A, 0xF84F3859,
+    0x2C855CB2, 0xDEEEDFB1, 0xCDBE2C45, 0x3FD5AF46, 0x7198540D, 0x83F3D70E,
+    0x90A324FA, 0x62C8A7F9, 0xB602C312, 0x44694011, 0x5739B3E5, 0xA55230E6,
+    0xFB410CC2, 0x092A8FC1, 0x1A7A7C35, 0xE811FF36, 0x3CDB9BDD, 0xCEB018DE,
+    0xDDE0EB2A, 0x2F8B6829, 0x82F63B78, 0x709DB87B, 0x63CD4B8F, 0x91A6C88C,
+    0x456CAC67, 0xB7072F64, 0xA457DC90, 0x563C5F93, 0x082F63B7, 0xFA44E0B4,
+    0xE9141340, 0x1B7F9043, 0xCFB5F4A8, 0x3DDE77AB, 0x2E8E845F, 0xDCE5075C,
+    0x92A8FC17, 0x60C37F14, 0x73938CE0, 0x81F80FE3, 0x55326B08, 0xA759E80B,
+    0xB4091BFF, 0x466298FC, 0x1871A4D8, 0xEA1A27DB, 0xF94AD42F, 0x0B21572C,
+    0xDFEB33C7, 0x2D80B0C4, 0x3ED04330, 0xCCBBC033, 0xA24BB5A6, 0x502036A5,
+    0x4370C551, 0xB11B4652, 0x65D122B9, 0x97BAA1BA, 0x84EA524E, 0x7681D14D,
+    0x2892ED69, 0xDAF96E6A, 0xC9A99D9E, 0x3BC21E9D, 0xEF087A76, 0x1D63F975,
+    0x0E330A81, 0xFC588982, 0xB21572C9, 0x407EF1CA, 0x532E023E, 0xA145813D,
+    0x758FE5D6, 0x87E466D5, 0x94B49521, 0x66DF1622, 0x38CC2A06, 0xCAA7A905,
+    0xD9F75AF1, 0x2B9CD9F2, 0xFF56BD19, 0x0D3D3E1A, 0x1E6DCDEE, 0xEC064EED,
+    0xC38D26C4, 0x31E6A5C7, 0x22B65633, 0xD0DDD530, 0x0417B1DB, 0xF67C32D8,
+    0xE52CC12C, 0x1747422F, 0x49547E0B, 0xBB3FFD08, 0xA86F0EFC, 0x5A048DFF,
+    0x8ECEE914, 0x7CA56A17, 0x6FF599E3, 0x9D9E1AE0, 0xD3D3E1AB, 0x21B862A8,
+    0x32E8915C, 0xC083125F, 0x144976B4, 0xE622F5B7, 0xF5720643, 0x07198540,
+    0x590AB964, 0xAB613A67, 0xB831C993, 0x4A5A4A90, 0x9E902E7B, 0x6CFBAD78,
+    0x7FAB5E8C, 0x8DC0DD8F, 0xE330A81A, 0x115B2B19, 0x020BD8ED, 0xF0605BEE,
+    0x24AA3F05, 0xD6C1BC06, 0xC5914FF2, 0x37FACCF1, 0x69E9F0D5, 0x9B8273D6,
+    0x88D28022, 0x7AB90321, 0xAE7367CA, 0x5C18E4C9, 0x4F48173D, 0xBD23943E,
+    0xF36E6F75, 0x0105EC76, 0x12551F82, 0xE03E9C81, 0x34F4F86A, 0xC69F7B69,
+    0xD5CF889D, 0x27A40B9E, 0x79B737BA, 0x8BDCB4B9, 0x988C474D, 0x6AE7C44E,
+    0xBE2DA0A5, 0x4C4623A6, 0x5F16D052, 0xAD7D5351
+};
+
+static uint32_t io61_crc32c_sw(uint32_t crc, const unsigned char* p,
+                               size_t n) {
+    while (n-- > 0)
+        crc = io61_crc32c_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#if IO61_CRC32C_HW
+__attribute__((target("sse4.2")))
+static uint32_t io61_crc32c_hw(uint32_t crc, const unsigned char* p,
+                               size_t n) {
+#if defined(__x86_64__)
+    uint64_t c = crc;
+    for (; n > 0 && ((uintptr_t) p & 7); --n)
+        c = _mm_crc32_u8((uint32_t) c, *p++);
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t x;
+        memcpy(&x, p, 8);
+        c = _mm_crc32_u64(c, x);
+    }
+#else
+    uint32_t c = crc;
+    for (; n > 0 && ((uintptr_t) p & 3); --n)
+        c = _mm_crc32_u8(c, *p++);
+    for (; n >= 4; p += 4, n -= 4) {
+        uint32_t x;
+        memcpy(&x, p, 4);
+        c = _mm_crc32_u32(c, x);
+    }
+#endif
+    for (; n > 0; --n)
+        c = _mm_crc32_u8((uint32_t) c, *p++);
+    return (uint32_t) c;
+}
+#endif
+
+// io61_crc32c_update(crc, buf, sz)
+//    Return the CRC32C of the bytes that `crc` covers followed by
+//    `buf[0..sz)`. The CRC of no bytes is 0.
+
+uint32_t io61_crc32c_update(uint32_t crc, const void* buf, size_t sz) {
+#if IO61_CRC32C_HW
+    if (__builtin_cpu_supports("sse4.2"))
+        return ~io61_crc32c_hw(~crc, (const unsigned char*) buf, sz);
+#endif
+    return ~io61_crc32c_sw(~crc, (const unsigned char*) buf, sz);
+}
+
+
+// Frame records. Each field is stored little-endian a byte at a time,
+// so a frame reads the same on any host.
+
+static inline void io61_put32(unsigned char* p, uint32_t x) {
+    for (int i = 0; i < 4; ++i)
+        p[i] = x >> (8 * i);
+}
+
+static inline uint32_t io61_get32(const unsigned char* p) {
+    uint32_t x = 0;
+    for (int i = 0; i < 4; ++i)
+        x |= (uint32_t) p[i] << (8 * i);
+    return x;
+}
+
+static inline void io61_put64(unsigned char* p, uint64_t x) {
+    io61_put32(p, (uint32_t) x);
+    io61_put32(p + 4, (uint32_t) (x >> 32));
+}
+
+static inline uint64_t io61_get64(const unsigned char* p) {
+    return io61_get32(p) | (uint64_t) io61_get32(p + 4) << 32;
+}
+
+// io61_lz_putheader(p, bsize), io61_lz_getheader(p, bsize)
+//    Store the LZHEADERSIZE-byte header of a frame of blocks of at most
+//    `bsize` bytes at `p`, or parse the one at `p`. io61_lz_getheader
+//    returns 0 on success and -1 if `p` holds no header or `*bsize` is
+//    not between 1 and LZBLOCK.
+
+void io61_lz_putheader(unsigned char* p, uint32_t bsize) {
+    memcpy(p, LZMAGIC, 8);
+    io61_put32(p + 8, bsize);
+    io61_put32(p + 12, 0);
+}
+
+int io61_lz_getheader(const unsigned char* p, uint32_t* bsize) {
+    *bsize = io61_get32(p + 8);
+    if (memcmp(p, LZMAGIC, 8) != 0 || io61_get32(p + 12) != 0
+        || *bsize == 0 || *bsize > LZBLOCK)
+        return -1;
+    return 0;
+}
+
+// io61_lz_putblock(p, b), io61_lz_getblock(p, b)
+//    Store block record `b` in the LZRECORDSIZE bytes at `p`, or parse
+//    the one at `p` into `b`.
+
+void io61_lz_putblock(unsigned char* p, const io61_lz_block* b) {
+    io61_put32(p, b->usize);
+    io61_put32(p + 4, b->csize);
+    io61_put32(p + 8, b->crc);
+}
+
+void io61_lz_getblock(const unsigned char* p, io61_lz_block* b) {
+    b->usize = io61_get32(p);
+    b->csize = io61_get32(p + 4);
+    b->crc = io61_get32(p + 8);
+}
+
+// io61_lz_putindex(p, x, n), io61_lz_getindex(p, x, n)
+//    Store the `n` index records `x` in the `n * LZINDEXSIZE` bytes at
+//    `p`, or parse those at `p` into `x`. `p` may point at `x` itself.
+
+void io61_lz_putindex(unsigned char* p, const io61_lz_index* x, size_t n) {
+    for (size_t i = 0; i < n; ++i, p += LZINDEXSIZE) {
+        io61_lz_index e = x[i];
+        io61_put64(p, e.upos);
+        io61_put64(p + 8, e.coff);
+    }
+}
+
+void io61_lz_getindex(const unsigned char* p, io61_lz_index* x, size_t n) {
+    for (size_t i = 0; i < n; ++i, p += LZINDEXSIZE) {
+        io61_lz_index e = { io61_get64(p), io61_get64(p + 8) };
+        x[i] = e;
+    }
+}
+
+// io61_lz_puttrailer(p, t), io61_lz_gettrailer(p, t)
+//    Store trailer `t` in the LZTRAILERSIZE bytes at `p`, or parse the
+//    one at `p` into `t`. io61_lz_gettrailer returns 0 on success and
+//    -1 if `p` holds no trailer.
+
+void io61_lz_puttrailer(unsigned char* p, const io61_lz_trailer* t) {
+    io61_put64(p, t->idxoff);
+    io61_put64(p + 8, t->nblocks);
+    memcpy(p + 16, LZENDMAGIC, 8);
+}
+
+int io61_lz_gettrailer(const unsigned char* p, io61_lz_trailer* t) {
+    t->idxoff = io61_get64(p);
+    t->nblocks = io61_get64(p + 8);
+    return memcmp(p + 16, LZENDMAGIC, 8) == 0 ? 0 : -1;
+}
+
+// io61_lz_checkindex(x, t, bsize)
+//    Return 0 if the index `x`, which has `t->nblocks + 1` records,
+//    describes blocks that start right after the header, follow one
+//    another, hold between 1 and `bsize` bytes each, and end where the
+//    trailer `t` says the index starts. Returns -1 otherwise.
+
+int io61_lz_checkindex(const io61_lz_index* x, const io61_lz_trailer* t,
+                       uint32_t bsize) {
+    size_t nblocks = t->nblocks;
+    if (x[0].upos != 0 || x[0].coff != LZHEADERSIZE
+        || x[nblocks].coff + LZRECORDSIZE != t->idxoff)
+        return -1;
+    for (size_t k = 0; k < nblocks; ++k)
+        if (x[k + 1].upos <= x[k].upos
+            || x[k + 1].upos - x[k].upos > bsize
+            || x[k + 1].coff <= x[k].coff + LZRECORDSIZE
+            || x[k + 1].coff - x[k].coff > LZRECORDSIZE + (uint64_t) bsize)
+            return -1;
+    return 0;
+}
+
+
+// The block codec.
+
+static inline uint32_t io61_lzread32(const unsigned char* p) {
+    uint32_t x;
+    memcpy(&x, p, 4);
+    return x;
+}
+
+static inline size_t io61_lzhash(uint32_t x) {
+    return (x * 2654435761U) >> (32 - LZHASHBITS);
+}
+
+// io61_lzmatchlen(p, q, end)
+//    Return how many bytes at `p` equal those at `q`, looking no
+//    further than `end`. `q` is before `p`.
+
+static inline size_t io61_lzmatchlen(const unsigned char* p,
+                                     const unsigned char* q,
+                                     const unsigned char* end) {
+    const unsigned char* start = p;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; p + 8 <= end; p += 8, q += 8) {
+        uint64_t x, y;
+        memcpy(&x, p, 8);
+        memcpy(&y, q, 8);
+        if (x != y)
+            return p - start + (__builtin_ctzll(x ^ y) >> 3);
+    }
+#endif
+    while (p < end && *p == *q)
+        ++p, ++q;
+    return p - start;
+}
+
+// io61_lzlength(op, n)
+//    Append the extra length bytes for a count `n` >= 15 at `op`.
+
+static inline unsigned char* io61_lzlength(unsigned char* op, size_t n) {
+    for (n -= 15; n >= 255; n -= 255)
+        *op++ = 255;
+    *op++ = n;
+    return op;
+}
+
+// io61_lzcompress(src, n, dst, cap, table)
+//    Compress `src[0..n)` into `dst`, finding matches through `table`,
+//    which has 1 << LZHASHBITS entries. Returns the payload size, or 0
+//    if it would not be less than `cap`. As in LZ4, misses skip ahead
+//    faster the longer they run, and the last 12 bytes start no match.
+
+static size_t io61_lzcompress(const char* src, size_t n, char* dst,
+                              size_t cap, uint32_t* table) {
+    const unsigned char* base = (const unsigned char*) src;
+    const unsigned char* end = base + n;
+    const unsigned char* mflimit = n > 12 ? end - 12 : base;
+    const unsigned char* ip = base + 1;
+    const unsigned char* anchor = base;
+    unsigned char* op = (unsigned char*) dst;
+    unsigned char* oend = op + cap;
+    memset(table, 0, sizeof(uint32_t) << LZHASHBITS);
+    while (ip < mflimit) {
+        uint32_t x = io61_lzread32(ip);
+        size_t h = io61_lzhash(x);
+        const unsigned char* ref = base + table[h];
+        table[h] = ip - base;
+        if (ip - ref > 65535 || io61_lzread32(ref) != x) {
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        while (ip > anchor && ref > base && ip[-1] == ref[-1])
+            --ip, --ref;
+        size_t nlit = ip - anchor;
+        size_t mlen = 4 + io61_lzmatchlen(ip + 4, ref + 4, end - 5);
+        if ((size_t) (oend - op) < nlit + nlit / 255 + mlen / 255 + 5)
+            return 0;
+        unsigned char* token = op++;
+        *token = (nlit < 15 ? nlit : 15) << 4
+            | (mlen - 4 < 15 ? mlen - 4 : 15);
+        if (nlit >= 15)
+            op = io61_lzlength(op, nlit);
+        memcpy(op, anchor, nlit);
+        op += nlit;
+        *op++ = (ip - ref) & 0xFF;
+        *op++ = (ip - ref) >> 8;
+        if (mlen - 4 >= 15)
+            op = io61_lzlength(op, mlen - 4);
+        ip += mlen;
+        anchor = ip;
+        if (ip < mflimit)
+            table[io61_lzhash(io61_lzread32(ip - 2))] = ip - 2 - base;
+    }
+    size_t nlit = end - anchor;
+    if ((size_t) (oend - op) <= nlit + nlit / 255 + 2)
+        return 0;
+    *op++ = (nlit < 15 ? nlit : 15) << 4;
+    if (nlit >= 15)
+        op = io61_lzlength(op, nlit);
+    memcpy(op, anchor, nlit);
+    op += nlit;
+    return op - (unsigned char*) dst;
+}
+
+// io61_lzdecompress(src, n, dst, cap)
+//    Decompress the payload `src[0..n)` into `dst`, which has room for
+//    `cap` bytes. Returns the decompressed size, or -1 if the payload
+//    is malformed or does not fit. Short literal runs and matches are
+//    copied 16 bytes at a time when both buffers have the slack.
+
+static ssize_t io61_lzdecompress(const char* src, size_t n, char* dst,
+                                 size_t cap) {
+    const unsigned char* ip = (const unsigned char*) src;
+    const unsigned char* iend = ip + n;
+    unsigned char* op = (unsigned char*) dst;
+    unsigned char* oend = op + cap;
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15) {
+            unsigned b;
+            do {
+                if (ip == iend)
+                    return -1;
+                b = *ip++;
+                nlit += b;
+            } while (b == 255);
+        }
+        if (nlit > (size_t) (iend - ip) || nlit > (size_t) (oend - op))
+            return -1;
+        if (nlit <= 16 && iend - ip >= 16 && oend - op >= 16)
+            memcpy(op, ip, 16);
+        else
+            memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == iend)
+            break;
+        if (iend - ip < 2)
+            return -1;
+        size_t off = ip[0] | (size_t) ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15) {
+            unsigned b;
+            do {
+                if (ip == iend)
+                    return -1;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += 4;
+        if (off == 0 || off > (size_t) (op - (unsigned char*) dst)
+            || mlen > (size_t) (oend - op))
+            return -1;
+        const unsigned char* ref = op - off;
+        if (off >= 16 && mlen <= 16 && oend - op >= 16)
+            memcpy(op, ref, 16);
+        else if (off >= mlen)
+            memcpy(op, ref, mlen);
+        else {
+            // the match overlaps the bytes it produces
+            unsigned char* mend = op + mlen;
+            for (; off >= 8 && mend - op >= 8; op += 8, ref += 8)
+                memcpy(op, ref, 8);
+            while (op < mend)
+                *op++ = *ref++;
+            continue;
+        }
+        op += mlen;
+    }
+    return op - (unsigned char*) dst;
+}
+
+// io61_lzencode(src, n, b, out, table)
+//    Compress the block `src[0..n)` into `out`, which has room for `n`
+//    bytes, through the match finder `table`, which has 1 << LZHASHBITS
+//    entries, and fill in its block record `b`. Returns the payload's
+//    size. The payload is at `out`, unless the block would not shrink
+//    and is stored: then LZRAW is set in `b->csize` and it is `src`.
+
+size_t io61_lzencode(const char* src, size_t n, io61_lz_block* b,
+                     char* out, uint32_t* table) {
+    size_t c = io61_lzcompress(src, n, out, n, table);
+    b->usize = n;
+    b->csize = c ? c : n | LZRAW;
+    b->crc = io61_crc32c_update(0, src, n);
+    return c ? c : n;
+}
+
+// io61_lzdecode(b, payload, out, usize)
+//    Decompress block `b`, whose payload is at `payload`, into `out`,
+//    and check its size against `usize` and its checksum. Returns 0 on
+//    success and -1 if the block is corrupt.
+
+int io61_lzdecode(const io61_lz_block* b, const char* payload,
+                  char* out, size_t usize) {
+    size_t len = b->csize & ~LZRAW;
+    if (b->usize != usize)
+        return -1;
+    if (b->csize & LZRAW) {
+        if (len != usize)
+            return -1;
+        memcpy(out, payload, len);
+    } else if (io61_lzdecompress(payload, len, out, usize) != (ssize_t) usize)
+        return -1;
+    return io61_crc32c_update(0, out, usize) == b->crc ? 0 : -1;
+}
+
+
+// io61_lzframe
+//    A frame read or written a block at a time. `data` holds the block
+//    being written, or the block most recently read, which starts at
+//    uncompressed offset `upos`. A reader of a seekable file has the
+//    whole index and can seek; one of anything else reads the blocks in
+//    order.
+
+struct io61_lzframe {
+    io61_file* lower;
+    int writing;
+    uint32_t bsize;        /* most bytes per block */
+    char* data;            /* current block */
+    size_t len;            /* bytes in `data` */
+    uint64_t upos;         /* uncompressed offset of `data[0]` */
+    uint64_t pos;          /* uncompressed offset of the next byte */
+    char* payload;         /* compressed payload */
+    uint32_t* table;       /* match finder hash table */
+    io61_lz_index* index;  /* blocks written or read, or NULL */
+    size_t nindex;         /* entries at `index`, counting the end */
+    size_t indexcap;
+    uint64_t coff;         /* frame bytes written */
+    uint64_t base;         /* offset of a read frame in `lower` */
+    int eof;               /* a reader in order has seen the end */
+};
+
+static void io61_lzframe_free(io61_lzframe* z) {
+    free(z->data);
+    free(z->payload);
+    free(z->table);
+    free(z->index);
+    free(z);
+}
+
+static int io61_lzframe_addindex(io61_lzframe* z) {
+    if (z->nindex == z->indexcap) {
+        size_t cap = z->indexcap ? 2 * z->indexcap : 64;
+        io61_lz_index* x = (io61_lz_index*)
+            realloc(z->index, sizeof(io61_lz_index) * cap);
+        if (!x)
+            return -1;
+        z->index = x;
+        z->indexcap = cap;
+    }
+    z->index[z->nindex].upos = z->upos;
+    z->index[z->nindex].coff = z->coff;
+    ++z->nindex;
+    return 0;
+}
+
+// io61_lzframe_start(z)
+//    Set up `z` to write its frame, writing the header, or to read one.
+//    A reader of a seekable file reads the trailer and index, checks
+//    that they describe well-formed blocks, and reads the header from
+//    the frame's start; a reader of anything else, or of a file without
+//    a trailer, reads the header from the start. Returns 0 on success
+//    and -1 on error.
+
+static int io61_lzframe_start(io61_lzframe* z) {
+    unsigned char h[LZHEADERSIZE], tbuf[LZTRAILERSIZE];
+    io61_lz_trailer t;
+    if (z->writing) {
+        io61_lz_putheader(h, z->bsize);
+        z->coff = LZHEADERSIZE;
+        return io61_write(z->lower, (const char*) h, LZHEADERSIZE)
+            == LZHEADERSIZE ? 0 : -1;
+    }
+    ssize_t fsize = io61_filesize(z->lower);
+    if (fsize >= LZHEADERSIZE + LZRECORDSIZE + LZINDEXSIZE + LZTRAILERSIZE
+        && io61_seek(z->lower, fsize - LZTRAILERSIZE) == 0
+        && io61_read(z->lower, (char*) tbuf, LZTRAILERSIZE) == LZTRAILERSIZE
+        && io61_lz_gettrailer(tbuf, &t) == 0
+        && t.nblocks < (uint64_t) fsize / LZINDEXSIZE) {
+        z->nindex = t.nblocks + 1;
+        size_t isz = LZINDEXSIZE * z->nindex;
+        uint64_t ioff = fsize - LZTRAILERSIZE - isz;
+        z->base = ioff - t.idxoff;
+        if (ioff < t.idxoff || t.idxoff < LZHEADERSIZE
+            || !(z->index = (io61_lz_index*) malloc(isz))
+            || io61_seek(z->lower, ioff) < 0
+            || io61_read(z->lower, (char*) z->index, isz) != (ssize_t) isz)
+            return -1;
+        io61_lz_getindex((const unsigned char*) z->index, z->index,
+                         z->nindex);
+    }
+    if (fsize >= 0 && io61_seek(z->lower, z->base) < 0)
+        return -1;
+    if (io61_read(z->lower, (char*) h, LZHEADERSIZE) != LZHEADERSIZE
+        || io61_lz_getheader(h, &z->bsize) < 0
+        || (z->index && io61_lz_checkindex(z->index, &t, z->bsize) < 0))
+        return -1;
+    return 0;
+}
+
+// io61_lzframe_open(lower, writing)
+//    Return a frame written to `lower` if `writing` is nonzero, or one
+//    read from `lower` otherwise. Returns NULL on error, including when
+//    `lower` does not hold a frame; `lower` stays open.
+
+io61_lzframe* io61_lzframe_open(io61_file* lower, int writing) {
+    io61_lzframe* z = (io61_lzframe*) calloc(1, sizeof(io61_lzframe));
+    if (!z)
+        return NULL;
+    z->lower = lower;
+    z->writing = writing;
+    z->bsize = LZBLOCK;
+    if (!(z->data = (char*) malloc(LZBLOCK))
+        || !(z->payload = (char*) malloc(LZBLOCK))
+        || !(z->table = (uint32_t*) malloc(sizeof(uint32_t) << LZHASHBITS))
+        || io61_lzframe_start(z) < 0) {
+        io61_lzframe_free(z);
+        return NULL;
+    }
+    return z;
+}
+
+// io61_lzframe_emit(z)
+//    Compress and write the block being written, if it is not empty.
+
+static int io61_lzframe_emit(io61_lzframe* z) {
+    unsigned char rec[LZRECORDSIZE];
+    io61_lz_block b;
+    if (z->len == 0)
+        return 0;
+    size_t n = io61_lzencode(z->data, z->len, &b, z->payload, z->table);
+    io61_lz_putblock(rec, &b);
+    if (io61_lzframe_addindex(z) < 0
+        || io61_write(z->lower, (const char*) rec, LZRECORDSIZE)
+           != LZRECORDSIZE
+        || io61_write(z->lower, b.csize & LZRAW ? z->data : z->payload, n)
+           != (ssize_t) n)
+        return -1;
+    z->coff += LZRECORDSIZE + n;
+    z->upos += z->len;
+    z->len = 0;
+    return 0;
+}
+
+// io61_lzframe_load(z)
+//    Read and decompress the block that holds `z->pos`. Returns 1 on
+//    success, 0 at the end of the frame, and -1 on error.
+
+static int io61_lzframe_load(io61_lzframe* z) {
+    unsigned char rec[LZRECORDSIZE];
+    io61_lz_block b;
+    size_t k = 0;
+    if (z->index) {
+        size_t lo = 0, hi = z->nindex - 1;
+        if (z->pos >= z->index[hi].upos)
+            return 0;
+        while (hi - lo > 1) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (z->index[mid].upos <= z->pos)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        k = lo;
+    } else if (z->eof)
+        return 0;
+    if ((z->index && io61_seek(z->lower, z->base + z->index[k].coff) < 0)
+        || io61_read(z->lower, (char*) rec, LZRECORDSIZE) != LZRECORDSIZE) {
+        errno = EIO;
+        return -1;
+    }
+    io61_lz_getblock(rec, &b);
+    if (!z->index && b.usize == 0) {
+        z->eof = 1;
+        return 0;
+    }
+    size_t usize = z->index ? z->index[k + 1].upos - z->index[k].upos
+        : b.usize;
+    size_t n = b.csize & ~LZRAW;
+    if (usize > z->bsize || n > z->bsize
+        || io61_read(z->lower, z->payload, n) != (ssize_t) n
+        || io61_lzdecode(&b, z->payload, z->data, usize) < 0) {
+        errno = EIO;
+        return -1;
+    }
+    z->upos = z->index ? z->index[k].upos : z->upos + z->len;
+    z->len = usize;
+    return 1;
+}
+
+// io61_lzframe_read(z, buf, sz), io61_lzframe_write(z, buf, sz)
+//    Read up to `sz` bytes of `z` into `buf`, or write `buf[0..sz)` to
+//    it. Return the number of bytes, or -1 if an error occurred before
+//    any were read or written.
+
+ssize_t io61_lzframe_read(io61_lzframe* z, char* buf, size_t sz) {
+    size_t nread = 0;
+    while (nread < sz) {
+        if (z->pos < z->upos || z->pos >= z->upos + z->len) {
+            int r = io61_lzframe_load(z);
+            if (r < 0)
+                return nread ? (ssize_t) nread : -1;
+            else if (r == 0)
+                break;
+        }
+        size_t n = z->upos + z->len - z->pos;
+        if (n > sz - nread)
+            n = sz - nread;
+        memcpy(buf + nread, z->data + (z->pos - z->upos), n);
+        z->pos += n;
+        nread += n;
+    }
+    return nread;
+}
+
+ssize_t io61_lzframe_write(io61_lzframe* z, const char* buf, size_t sz) {
+    size_t nwritten = 0;
+    while (nwritten < sz) {
+        if (z->len == z->bsize && io61_lzframe_emit(z) < 0)
+            return nwritten ? (ssize_t) nwritten : -1;
+        size_t n = z->bsize - z->len;
+        if (n > sz - nwritten)
+            n = sz - nwritten;
+        memcpy(z->data + z->len, buf + nwritten, n);
+        z->len += n;
+        z->pos += n;
+        nwritten += n;
+    }
+    return nwritten;
+}
+
+// io61_lzframe_flush(z)
+//    Write the block being written, however short, and flush `lower`.
+
+int io61_lzframe_flush(io61_lzframe* z) {
+    if (!z->writing)
+        return 0;
+    else if (io61_lzframe_emit(z) < 0)
+        return -1;
+    return io61_flush(z->lower);
+}
+
+// io61_lzframe_seek(z, pos), io61_lzframe_tell(z), io61_lzframe_size(z)
+//    Move a reader to uncompressed offset `pos`, which only a reader
+//    with an index can do; return the offset of the next byte; and
+//    return the uncompressed size, or -1 if it is not known.
+
+int io61_lzframe_seek(io61_lzframe* z, size_t pos) {
+    if (z->writing || !z->index)
+        return -1;
+    z->pos = pos;
+    return 0;
+}
+
+size_t io61_lzframe_tell(io61_lzframe* z) {
+    return z->pos;
+}
+
+ssize_t io61_lzframe_size(io61_lzframe* z) {
+    if (z->writing || !z->index)
+        return -1;
+    return z->index[z->nindex - 1].upos;
+}
+
+// io61_lzframe_close(z)
+//    Finish a written frame with the last block, the end record, the
+//    index, and the trailer; then close `lower` and free `z`. Returns 0
+//    on success and -1 on error.
+
+int io61_lzframe_close(io61_lzframe* z) {
+    int r = 0;
+    if (z->writing) {
+        io61_lz_trailer t;
+        unsigned char end[LZRECORDSIZE + LZTRAILERSIZE];
+        memset(end, 0, LZRECORDSIZE);
+        if (io61_lzframe_emit(z) < 0 || io61_lzframe_addindex(z) < 0)
+            r = -1;
+        else {
+            size_t isz = LZINDEXSIZE * z->nindex;
+            t.idxoff = z->coff + LZRECORDSIZE;
+            t.nblocks = z->nindex - 1;
+            io61_lz_putindex((unsigned char*) z->index, z->index, z->nindex);
+            io61_lz_puttrailer(end + LZRECORDSIZE, &t);
+            if (io61_write(z->lower, (const char*) end, LZRECORDSIZE)
+                   != LZRECORDSIZE
+                || io61_write(z->lower, (const char*) z->index, isz)
+                   != (ssize_t) isz
+                || io61_write(z->lower, (const char*) end + LZRECORDSIZE,
+                              LZTRAILERSIZE) != LZTRAILERSIZE)
+                r = -1;
+        }
+    }
+    if (io61_close(z->lower) < 0)
+        r = -1;
+    io61_lzframe_free(z);
+    return r;
+}
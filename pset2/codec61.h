@@ -0,0 +1,99 @@
+#ifndef CODEC61_H
+#define CODEC61_H
+#include "io61.h"
+#include <sys/types.h>
+
+// codec61.h
+//    The CRC32C checksum and the compressed frame format, which every
+//    io61 version shares.
+
+uint32_t io61_crc32c_update(uint32_t crc, const void* buf, size_t sz);
+
+
+// Compressed frames, as io61_open_lz writes them. Every integer is
+// little-endian, whatever the host's byte order.
+//
+//    header    LZMAGIC, then u32 `bsize`, the most uncompressed bytes
+//              in a block, and u32 `flags`, which is 0.
+//    blocks    For each block, a block record and its payload. The
+//              record holds u32 `usize`, the block's uncompressed size;
+//              u32 `csize`, the payload's size, with LZRAW set if the
+//              payload is the block stored as is; and u32 `crc`, the
+//              CRC32C of the uncompressed bytes.
+//    end       A block record of zeros.
+//    index     An index record for each block and one for the end: u64
+//              `upos`, the uncompressed offset where it starts, and u64
+//              `coff`, the offset of its block record from the header.
+//    trailer   u64 `idxoff`, the offset of the index from the header;
+//              u64 `nblocks`, the number of blocks; and LZENDMAGIC.
+//
+// A reader of a seekable file finds every block from the trailer, so
+// it can seek; a reader of a pipe reads the blocks in order up to the
+// end record.
+//
+// A payload is a series of LZ4-style sequences: a token whose high and
+// low nibbles are a literal count and a match length less 4, extra
+// length bytes for a nibble of 15, the literals, and the match's 2-byte
+// little-endian distance back. The last sequence has literals only. A
+// block that would not shrink is stored.
+
+#define LZBLOCK 65536      /* most bytes per block */
+#define LZHASHBITS 14      /* log2 of the match finder's table size */
+#define LZMAGIC "io61lz01" /* first 8 bytes of a frame */
+#define LZENDMAGIC "io61lzix" /* last 8 bytes of one */
+#define LZRAW 0x80000000U  /* `csize` flag for a stored block */
+#define LZHEADERSIZE 16    /* bytes in each kind of record */
+#define LZRECORDSIZE 12
+#define LZINDEXSIZE 16
+#define LZTRAILERSIZE 24
+
+typedef struct io61_lz_block {
+    uint32_t usize;
+    uint32_t csize;
+    uint32_t crc;
+} io61_lz_block;
+
+typedef struct io61_lz_index {
+    uint64_t upos;
+    uint64_t coff;
+} io61_lz_index;
+
+typedef struct io61_lz_trailer {
+    uint64_t idxoff;
+    uint64_t nblocks;
+} io61_lz_trailer;
+
+void io61_lz_putheader(unsigned char* p, uint32_t bsize);
+int io61_lz_getheader(const unsigned char* p, uint32_t* bsize);
+void io61_lz_putblock(unsigned char* p, const io61_lz_block* b);
+void io61_lz_getblock(const unsigned char* p, io61_lz_block* b);
+void io61_lz_putindex(unsigned char* p, const io61_lz_index* x, size_t n);
+void io61_lz_getindex(const unsigned char* p, io61_lz_index* x, size_t n);
+void io61_lz_puttrailer(unsigned char* p, const io61_lz_trailer* t);
+int io61_lz_gettrailer(const unsigned char* p, io61_lz_trailer* t);
+int io61_lz_checkindex(const io61_lz_index* x, const io61_lz_trailer* t,
+                       uint32_t bsize);
+
+size_t io61_lzencode(const char* src, size_t n, io61_lz_block* b,
+                     char* out, uint32_t* table);
+int io61_lzdecode(const io61_lz_block* b, const char* payload,
+                  char* out, size_t usize);
+
+
+// io61_lzframe
+//    A frame read or written a block at a time through the public io61
+//    calls on the file below. The stdio and slow versions build their
+//    io61_open_lz on it.
+
+typedef struct io61_lzframe io61_lzframe;
+
+io61_lzframe* io61_lzframe_open(io61_file* lower, int writing);
+ssize_t io61_lzframe_read(io61_lzframe* z, char* buf, size_t sz);
+ssize_t io61_lzframe_write(io61_lzframe* z, const char* buf, size_t sz);
+int io61_lzframe_flush(io61_lzframe* z);
+int io61_lzframe_seek(io61_lzframe* z, size_t pos);
+size_t io61_lzframe_tell(io61_lzframe* z);
+ssize_t io61_lzframe_size(io61_lzframe* z);
+int io61_lzframe_close(io61_lzframe* z);
+
+#endif
@@ -0,0 +1,48 @@
+#include "io61.h"
+
+// Usage: ./inplace61 [-b BLOCKSIZE] FILE
+//    Applies rot13 to FILE in place, one block at a time, through a
+//    single O_RDWR io61_file: each block is read, seeked back over, and
+//    overwritten. Default BLOCKSIZE is 1024.
+
+int main(int argc, char** argv) {
+    // Parse arguments
+    size_t blocksize = 1024;
+    if (argc >= 3 && strcmp(argv[1], "-b") == 0) {
+        blocksize = strtoul(argv[2], 0, 0);
+        argc -= 2, argv += 2;
+    }
+    if (argc < 2) {
+        fprintf(stderr, "Usage: ./inplace61 [-b BLOCKSIZE] FILE\n");
+        exit(1);
+    }
+
+    // Allocate buffer, open file
+    assert(blocksize > 0);
+    char* buf = malloc(blocksize);
+
+    io61_profile_begin();
+    io61_file* f = io61_open_check(argv[1], O_RDWR);
+
+    // Transform file data
+    size_t pos = 0;
+    while (1) {
+        ssize_t amount = io61_read(f, buf, blocksize);
+        if (amount <= 0)
+            break;
+        for (ssize_t i = 0; i < amount; ++i) {
+            char c = buf[i];
+            if ((c >= 'a' && c <= 'm') || (c >= 'A' && c <= 'M'))
+                buf[i] = c + 13;
+            else if ((c >= 'n' && c <= 'z') || (c >= 'N' && c <= 'Z'))
+                buf[i] = c - 13;
+        }
+        int r = io61_seek(f, pos);
+        assert(r >= 0);
+        io61_write(f, buf, amount);
+        pos += amount;
+    }
+
+    io61_close(f);
+    io61_profile_end();
+}
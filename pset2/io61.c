@@ -1,192 +1,2775 @@
-#include "io61.h"
+#define _GNU_SOURCE 1      /* for copy_file_range and splice */
+#include "io61layer.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <limits.h>
 #include <errno.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <time.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+static void io61_freecache(io61_file* f);
+static void io61_trace(io61_file* f, int op, off_t off, size_t sz, ssize_t r);
+static int io61_writeback(io61_file* f);
+static ssize_t io61_fill(io61_file* f);
+static int io61_startasync(io61_file* f);
+static int io61_asyncflush(io61_file* f);
+static int io61_stopasync(io61_file* f);
+static void io61_unpair(io61_file* f);
 
 // io61.c
 //    YOUR CODE HERE!
-#define BUFSIZE 32768
-
-// io61_file
-//    Data structure for io61 file wrappers. Add your own stuff.
-
-struct io61_file {
-    int fd;                /* descriptor for this internal buf */
-    int cnt;               /* unread bytes in internal buf */
-    int towrite;			/* bytes in buffer that can be written in subsequent order */
-    int seeked;				/* if the file has been seeked, the buffer will not work */
-    char *bufptr;          /* next unread byte in internal buf */
-    char buf[BUFSIZE]; /* internal buffer */
+#define NSLOTS 32          /* default number of cache slots per file */
+#define SLOTSIZE 32768     /* default bytes per cache slot */
+#define MAXREADAHEAD 8     /* most slots filled by one read */
+#define MAXSTATS 16        /* files listed in the profile report */
+#define MAXIOV 64          /* most slots written by one pwritev */
+#define MAXDIRTY 32        /* most separate dirty ranges per slot */
+#define MAXCOPY (1 << 30)  /* most bytes moved by one kernel copy call */
+#define ASYNCSIZE (1 << 18) /* bytes per IO61_ASYNC buffer */
+#define DIRECTALIGN 4096   /* O_DIRECT offset, length, and memory alignment */
+#define TRACEBUF 512       /* trace records buffered before a write */
+#define POOLSIZE (64 << 20) /* default byte budget for all cache slots */
+#define PCOPYCHUNK (8 << 20) /* bytes per io61_pcopy chunk */
+#define PCOPYBUF (1 << 20) /* bytes per io61_pcopy pread and pwrite */
+#define PCOPYTHREADS 64    /* most io61_pcopy threads */
+#define PCOPYMAGIC "io61pcp1" /* first 8 bytes of a progress file */
+
+// access patterns, as detected from the offsets of cache misses
+enum { IO61_UNKNOWN, IO61_SEQUENTIAL, IO61_REVERSE, IO61_STRIDED, IO61_RANDOM };
+static const char* const io61_patterns[] = {
+    "unknown", "sequential", "reverse", "strided", "random"
+};
+
+static io61_stats* io61_allstats[MAXSTATS];
+static int io61_nstats;
+static io61_stats io61_unlisted;  /* counters of files not in allstats */
+
+// trace state; see io61_trace_begin
+static int io61_tracefd = -1;
+static int io61_nfiles;            /* files opened so far */
+static io61_trace_record io61_tracebuf[TRACEBUF];
+static int io61_ntrace;
+static unsigned io61_traceepoch;   /* bumped when the buffer empties */
+
+
+// io61_countread(st, r), io61_countwrite(st, r)
+//    Count a read or write system call that returned `r`.
+
+static inline void io61_countread(io61_stats* st, ssize_t r) {
+    ++st->reads;
+    if (r > 0)
+        st->rbytes += r;
+}
+
+static inline void io61_countwrite(io61_stats* st, ssize_t r) {
+    ++st->writes;
+    if (r > 0)
+        st->wbytes += r;
+}
+
+// io61_retry(fd, events)
+//    Return 1 if a system call on `fd` that just failed should be retried:
+//    at once after EINTR, or after EAGAIN once `fd` is ready for `events`,
+//    so a non-blocking descriptor waits in poll instead of spinning.
+
+static int io61_retry(int fd, short events) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        struct pollfd p = { .fd = fd, .events = events };
+        return poll(&p, 1, -1) >= 0 || errno == EINTR;
+    }
+    return errno == EINTR;
+}
+
+// io61_slot
+//    One cache slot: a SLOTSIZE-aligned block of the file. In a write
+//    file, only the dirty ranges of `data` hold file bytes. They are
+//    sorted, and no two overlap or touch.
+
+struct io61_slot {
+    off_t off;             /* file offset of data[0], or -1 if unused */
+    size_t len;            /* valid bytes in data */
+    int ndirty;            /* number of dirty ranges; 0 if clean */
+    struct {
+        size_t lo;         /* data[lo, hi) is not yet written */
+        size_t hi;
+    } dirty[MAXDIRTY];
+    int ref;               /* clock reference bit */
+    int next;              /* next slot in the same hash bucket, or -1 */
+    char* data;            /* allocated on first use */
+    io61_file* owner;
+    struct io61_slot* lprev;  /* neighbors in the pool's list */
+    struct io61_slot* lnext;
+};
+
+// io61_pool
+//    The byte budget shared by the cache slots of every open file. The
+//    slots of seekable files that hold data are listed most recently
+//    used first. A file that wants another slot while the pool is full
+//    takes the data of the least recently used slot of another file,
+//    writing it back first if it is dirty; if there is none it reuses
+//    one of its own slots. A file's current slot, which its cursor and
+//    io61_read_view pointers may refer to, is never taken, and neither
+//    are the single buffers of non-seekable files. So the memory used
+//    is at most the budget, or one slot per open file if that is more.
+
+typedef struct io61_pool {
+    size_t limit;          /* byte budget */
+    size_t used;           /* bytes of slot data allocated */
+    size_t peak;           /* most bytes ever allocated */
+    unsigned long long steals;   /* slots taken from other files */
+    io61_slot* head;       /* most recently used */
+    io61_slot* tail;       /* least recently used */
+} io61_pool;
+
+static io61_pool io61_thepool = { POOLSIZE, 0, 0, 0, NULL, NULL };
+
+static int io61_slotalloc(io61_file* f, io61_slot* s);
+static int io61_writeslot(io61_file* f, io61_slot* s);
+static void io61_unlink(io61_file* f, int i);
+
+// io61_async
+//    State shared with the helper thread of an IO61_ASYNC file. The two
+//    buffers pass back and forth between the caller and the thread;
+//    `owner[i]` says which side may touch buffer `i`, and each side
+//    hands a buffer over by storing the other's name there. Nothing is
+//    locked. A side that finds nothing to do sleeps until `seq`, which
+//    every handoff bumps, changes.
+//
+//    For a read file the thread fills buffers 0, 1, 0, ... in file
+//    order and the caller reads them in the same order; a buffer of
+//    length 0 or -1 ends the stream. For a write file the caller fills
+//    them and the thread writes them.
+
+enum { IO61_CALLER, IO61_WORKER };
+
+struct io61_async {
+    pthread_t thread;
+    int fd;
+    int seekable;
+    int writing;           /* nonzero if the thread writes */
+    char* data[2];
+    off_t off[2];          /* file offset of each buffer's data */
+    ssize_t len[2];        /* bytes in each buffer; -1 after an error */
+    int owner[2];          /* IO61_CALLER or IO61_WORKER */
+    int seq;               /* bumped by every handoff */
+    int stop;              /* set to make the thread exit */
+    int err;               /* first errno seen by the thread, or 0 */
+    int cur;               /* caller's buffer */
+    off_t next;            /* file offset the caller's next buffer starts at */
+    int done;              /* caller has seen the end of a read stream */
+    io61_stats* stats;     /* the file's counters; the thread keeps
+                              reads, writes, rbytes, and wbytes */
 };
 
+// io61_fdopen(fd, mode)
+//    Return a new io61_file that reads from and/or writes to the given
+//    file descriptor `fd`. `mode` is O_RDONLY for a read-only file,
+//    O_WRONLY for a write-only file, or O_RDWR for a file that is both
+//    read and written. If `mode` includes IO61_MMAP and `fd` is a
+//    nonempty regular file opened O_RDONLY, the file is read through a
+//    memory mapping rather than the cache. If `mode` includes IO61_ASYNC
+//    and `f` is not O_RDWR or mapped, a helper thread reads ahead of or
+//    writes behind the caller. If `mode` includes IO61_DIRECT and `fd`
+//    is a regular file, its data bypasses the page cache; such a file
+//    is neither mapped nor IO61_ASYNC.
+
+io61_file* io61_fdopen(int fd, int mode) {
+    assert(fd >= 0);
+    io61_file* f = (io61_file*) malloc(sizeof(io61_file));
+    f->fd = fd;
+    f->mode = mode & O_ACCMODE;
+    off_t off = lseek(fd, 0, SEEK_CUR);
+    f->seekable = off != (off_t) -1;
+    f->tag = f->end_tag = f->pos_tag = f->seekable ? off : 0;
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        st.st_mode = st.st_size = 0;
+    f->type = st.st_mode & S_IFMT;
+    f->size = S_ISREG(st.st_mode) ? st.st_size : -1;
+    f->direct = 0;
+    if ((mode & IO61_DIRECT) && f->seekable && S_ISREG(st.st_mode)) {
+        int fl = fcntl(fd, F_GETFL);
+        f->direct = fl >= 0 && fcntl(fd, F_SETFL, fl | O_DIRECT) == 0;
+    }
+    memset(&f->c, 0, sizeof(f->c));
+    f->buf = NULL;
+    f->map = NULL;
+    f->async = NULL;
+    f->slots = NULL;
+    f->buckets = NULL;
+    f->pattern = f->candidate = IO61_UNKNOWN;
+    f->streak = 0;
+    f->last_start = f->tag - SLOTSIZE;
+    f->last_pos = f->tag;
+    f->stride = 0;
+    f->readahead = 1;
+    f->layer = NULL;
+    f->err = 0;
+    f->stats = (io61_stats*) calloc(1, sizeof(io61_stats));
+    if (!f->stats || io61_setcache(f, NSLOTS, SLOTSIZE) < 0) {
+        free(f->stats);
+        free(f);
+        return NULL;
+    }
+    if ((mode & IO61_MMAP) && f->mode == O_RDONLY && f->size > 0
+        && !f->direct) {
+        void* map = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            f->map = (char*) map;
+            (void) madvise(f->map, f->size, MADV_SEQUENTIAL);
+        }
+    }
+    if ((mode & IO61_ASYNC) && !f->map && !f->direct && f->mode != O_RDWR)
+        (void) io61_startasync(f);
+    f->stats->fd = fd;
+    f->stats->mode = f->mode;
+    if (io61_nstats < MAXSTATS)
+        io61_allstats[io61_nstats++] = f->stats;
+    f->traceid = io61_nfiles++;
+    f->traceseek = -1;
+    f->tracelast = -1;
+    f->partner = f->pairedby = NULL;
+    f->delay = f->since = 0;
+    f->line = NULL;
+    f->linecap = 0;
+    io61_trace(f, IO61_TRACE_OPEN, f->pos_tag, f->size, fd);
+    return f;
+}
+
+
+// io61_setcache(f, nslots, slotsize)
+//    Give `f` a cache of `nslots` slots of `slotsize` bytes each,
+//    flushing and discarding anything cached so far. Only seekable files
+//    use more than one slot. An IO61_ASYNC file stops its thread, and an
+//    IO61_DIRECT file whose `slotsize` is not a multiple of DIRECTALIGN
+//    goes back to the page cache. A layer has no cache of its own.
+//    Returns 0 on success and -1 on failure.
+
+int io61_setcache(io61_file* f, size_t nslots, size_t slotsize) {
+    if (f->layer)
+        return -1;
+    if (f->async && io61_stopasync(f) < 0)
+        return -1;
+    if (nslots == 0 || slotsize == 0 || (f->slots && io61_flushbuf(f) < 0))
+        return -1;
+    if (!f->seekable)
+        nslots = 1;
+    if (f->direct && slotsize % DIRECTALIGN != 0) {
+        // O_DIRECT cannot fill a slot of this size
+        int fl = fcntl(f->fd, F_GETFL);
+        if (fl < 0 || fcntl(f->fd, F_SETFL, fl & ~O_DIRECT) < 0)
+            return -1;
+        f->direct = 0;
+    }
+    size_t nbuckets = 1;
+    while (nbuckets < 2 * nslots)
+        nbuckets *= 2;
+    io61_slot* slots = (io61_slot*) malloc(sizeof(io61_slot) * nslots);
+    int* buckets = (int*) malloc(sizeof(int) * nbuckets);
+    if (!slots || !buckets) {
+        free(slots);
+        free(buckets);
+        return -1;
+    }
+    for (size_t i = 0; i < nslots; ++i) {
+        slots[i].off = -1;
+        slots[i].len = 0;
+        slots[i].ndirty = 0;
+        slots[i].ref = 0;
+        slots[i].next = -1;
+        slots[i].data = NULL;
+        slots[i].owner = f;
+        slots[i].lprev = slots[i].lnext = NULL;
+    }
+    for (size_t b = 0; b < nbuckets; ++b)
+        buckets[b] = -1;
+    io61_freecache(f);
+    f->slots = slots;
+    f->buckets = buckets;
+    f->nslots = nslots;
+    f->nbuckets = nbuckets;
+    f->slotsize = slotsize;
+    f->hand = 0;
+    f->nused = 0;
+    f->last_slot = -1;
+    f->buf = NULL;
+    f->tag = f->end_tag = f->pos_tag;
+    if (f->mode == O_WRONLY && !f->seekable) {
+        if (io61_slotalloc(f, &f->slots[0]) < 0)
+            return -1;
+        f->buf = f->slots[0].data;
+    }
+    return 0;
+}
+
+
+// io61_pooltouch(s), io61_poolremove(s)
+//    Move slot `s` to the front of the pool's list, or take it off.
+
+static void io61_poolremove(io61_slot* s) {
+    io61_pool* p = &io61_thepool;
+    if (s->lprev)
+        s->lprev->lnext = s->lnext;
+    else if (p->head == s)
+        p->head = s->lnext;
+    else
+        return;            /* not listed */
+    if (s->lnext)
+        s->lnext->lprev = s->lprev;
+    else
+        p->tail = s->lprev;
+    s->lprev = s->lnext = NULL;
+}
+
+static void io61_pooltouch(io61_slot* s) {
+    io61_pool* p = &io61_thepool;
+    if (p->head == s)
+        return;
+    io61_poolremove(s);
+    s->lnext = p->head;
+    if (p->head)
+        p->head->lprev = s;
+    else
+        p->tail = s;
+    p->head = s;
+}
+
+
+// io61_poolsteal(s)
+//    Free the data of slot `s`, which belongs to another file, writing
+//    back its dirty ranges first. Returns 0 on success and -1 if the
+//    write failed; the slot then stays dirty, and the owner's next flush
+//    reports the error.
+
+static int io61_poolsteal(io61_slot* s) {
+    io61_file* o = s->owner;
+    if (s->ndirty && io61_writeslot(o, s) < 0) {
+        o->err = errno;
+        return -1;
+    }
+    int i = s - o->slots;
+    io61_unlink(o, i);
+    if (o->last_slot == i)
+        o->last_slot = -1;
+    io61_poolremove(s);
+    free(s->data);
+    s->data = NULL;
+    s->len = 0;
+    io61_thepool.used -= o->slotsize;
+    ++io61_thepool.steals;
+    return 0;
+}
+
+
+// io61_poolroom(f, need)
+//    Take least recently used slots from files other than `f` until
+//    `need` more bytes fit in the budget. Returns nonzero if they fit.
+
+static int io61_poolroom(io61_file* f, size_t need) {
+    io61_pool* p = &io61_thepool;
+    io61_slot* s = p->tail;
+    while (p->used + need > p->limit && s) {
+        io61_slot* prev = s->lprev;
+        if (s->owner != f && s->data != s->owner->buf)
+            (void) io61_poolsteal(s);
+        s = prev;
+    }
+    return p->used + need <= p->limit;
+}
+
+
+// io61_slotalloc(f, s)
+//    Allocate the data of slot `s` of `f`, aligned for O_DIRECT if `f`
+//    uses it, making room in the pool if it can. Returns 0 on success
+//    and -1 if out of memory.
+
+static int io61_slotalloc(io61_file* f, io61_slot* s) {
+    void* p;
+    (void) io61_poolroom(f, f->slotsize);
+    if (!f->direct)
+        s->data = (char*) malloc(f->slotsize);
+    else
+        s->data = posix_memalign(&p, DIRECTALIGN, f->slotsize) == 0
+            ? (char*) p : NULL;
+    if (!s->data)
+        return -1;
+    s->owner = f;
+    io61_thepool.used += f->slotsize;
+    if (io61_thepool.used > io61_thepool.peak)
+        io61_thepool.peak = io61_thepool.used;
+    if (f->seekable)
+        io61_pooltouch(s);
+    return 0;
+}
+
+
+// io61_setpool(limit)
+//    Set the byte budget shared by the caches of all io61 files to
+//    `limit`, taking slots from the least recently used files at once
+//    if the pool is over it. Returns 0 on success and -1 if `limit` is
+//    0.
+
+int io61_setpool(size_t limit) {
+    if (limit == 0)
+        return -1;
+    io61_thepool.limit = limit;
+    (void) io61_poolroom(NULL, 0);
+    return 0;
+}
+
+
+// io61_pair(inf, outf)
+//    Make `outf` the partner of `inf`, for request/response streams such
+//    as two ends of a socket: before a read of `inf` would block waiting
+//    for input, `outf`'s buffered output is flushed, since the other side
+//    may be waiting for it. Output therefore batches up while input is
+//    ready and goes out as soon as it is not, and the caller needs no
+//    flushes of its own. An `outf` partners one file at a time; pairing
+//    it again replaces the earlier pairing, and `outf == NULL` unpairs
+//    `inf`. Closing either file unpairs it. Reads an IO61_ASYNC `inf`'s
+//    thread makes do not check. Returns 0 on success and -1 if `inf` is
+//    not readable or `outf` not writable.
+
+int io61_pair(io61_file* inf, io61_file* outf) {
+    if (inf->mode == O_WRONLY || (outf && outf->mode == O_RDONLY))
+        return -1;
+    if (inf->partner)
+        inf->partner->pairedby = NULL;
+    if (outf && outf->pairedby)
+        outf->pairedby->partner = NULL;
+    inf->partner = outf;
+    if (outf)
+        outf->pairedby = inf;
+    return 0;
+}
+
+
+// io61_unpair(f)
+//    Remove `f` from any pairing, in either role.
+
+static void io61_unpair(io61_file* f) {
+    if (f->partner)
+        f->partner->pairedby = NULL;
+    if (f->pairedby)
+        f->pairedby->partner = NULL;
+    f->partner = f->pairedby = NULL;
+}
+
+
+// io61_setdelay(f, usec)
+//    Hold output buffered in a non-seekable `f` for at most `usec`
+//    microseconds, like Nagle's algorithm: small writes coalesce, and
+//    the first write after the oldest of them has waited that long
+//    flushes them all. 0 turns the timer off. Characters written while
+//    the timer is on take the io61_write path, which checks the clock.
+//    Returns 0 on success and -1 if `f` is not a non-seekable output
+//    file.
+
+int io61_setdelay(io61_file* f, unsigned long usec) {
+    if (f->seekable || f->mode == O_RDONLY || f->async)
+        return -1;
+    io61_sync(f);
+    f->delay = (long long) usec * 1000;
+    f->since = 0;
+    return 0;
+}
+
+
+// io61_now()
+//    Return the monotonic clock in nanoseconds.
+
+static long long io61_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+// io61_freecache(f)
+//    Release the memory of `f`'s cache.
+
+static void io61_freecache(io61_file* f) {
+    for (size_t i = 0; f->slots && i < f->nslots; ++i)
+        if (f->slots[i].data) {
+            io61_poolremove(&f->slots[i]);
+            free(f->slots[i].data);
+            io61_thepool.used -= f->slotsize;
+        }
+    free(f->slots);
+    free(f->buckets);
+}
+
+
+// io61_setoffset(f)
+//    Move the descriptor's file offset to `f`'s position. A seekable
+//    file is read and written at explicit offsets, so the offset stays
+//    where io61_fdopen found it until this is called; a descriptor
+//    shared with another process, like a redirected stdout, must see
+//    where `f` left off once `f` is flushed or closed. A layer moves
+//    the file below it.
+
+static void io61_setoffset(io61_file* f) {
+    while (f->layer)
+        f = f->layer->lower;
+    if (f->seekable)
+        (void) lseek(f->fd, f->pos_tag, SEEK_SET);
+}
+
+
+// io61_close(f)
+//    Close the io61_file `f`. Returns 0 on success and -1 if writing out
+//    its buffered data or closing it failed.
+
+int io61_close(io61_file* f) {
+    io61_trace(f, IO61_TRACE_CLOSE, f->pos_tag, 0, 0);
+    if (f->async)
+        io61_stopasync(f);
+    int ferr = io61_flushbuf(f) < 0 ? errno : 0;
+    io61_unpair(f);
+    if (f->map)
+        (void) munmap(f->map, f->size);
+    int r;
+    if (f->layer) {
+        r = f->layer->ops->close(f);
+        if (io61_close(f->layer->lower) < 0)
+            r = -1;
+        free(f->layer);
+    } else {
+        io61_setoffset(f);
+        // O_DIRECT belongs to the open file description, which another
+        // process may share and write unaligned
+        int fl = f->direct ? fcntl(f->fd, F_GETFL) : -1;
+        if (fl >= 0)
+            (void) fcntl(f->fd, F_SETFL, fl & ~O_DIRECT);
+        r = close(f->fd);
+    }
+    io61_freecache(f);
+    if (io61_nstats == 0 || io61_allstats[io61_nstats - 1] != f->stats) {
+        int i = 0;
+        while (i < io61_nstats && io61_allstats[i] != f->stats)
+            ++i;
+        if (i == io61_nstats) {  /* not reported, so nobody needs it */
+            io61_stats* st = f->stats;
+            io61_unlisted.hits += st->hits;
+            io61_unlisted.misses += st->misses;
+            io61_unlisted.reads += st->reads;
+            io61_unlisted.writes += st->writes;
+            io61_unlisted.rbytes += st->rbytes;
+            io61_unlisted.wbytes += st->wbytes;
+            io61_unlisted.seeks += st->seeks;
+            io61_unlisted.flushes += st->flushes;
+            io61_unlisted.copied += st->copied;
+            free(st);
+        }
+    }
+    free(f->line);
+    free(f);
+    if (ferr) {
+        errno = ferr;
+        r = -1;
+    }
+    return r;
+}
+
+
+// io61_sync(f)
+//    Fold the characters the inline io61_readc and io61_writec moved into
+//    `f`'s position, dirty ranges, and size, and empty the cursor. The
+//    write cursor only ever extends a slot's last dirty range at its end.
+
+void io61_sync(io61_file* f) {
+    if (f->c.wptr && f->layer)
+        f->layer->ops->sync(f);
+    else if (f->c.rptr) {
+        off_t pos = f->tag + (f->c.rptr - f->buf);
+        f->stats->copied += pos - f->pos_tag;
+        f->pos_tag = pos;
+    } else if (f->c.wptr) {
+        size_t off = f->c.wptr - f->buf;
+        f->stats->copied += f->tag + (off_t) off - f->pos_tag;
+        if (f->seekable && !f->async) {
+            io61_slot* s = &f->slots[f->cur];
+            if (off > s->dirty[s->ndirty - 1].hi)
+                s->dirty[s->ndirty - 1].hi = off;
+            if (off > s->len)
+                s->len = off;
+            f->end_tag = f->tag + s->len;
+        } else
+            f->end_tag = f->tag + off;
+        f->pos_tag = f->tag + off;
+        if (f->size >= 0 && f->pos_tag > f->size)
+            f->size = f->pos_tag;
+    }
+    memset(&f->c, 0, sizeof(f->c));
+}
+
+
+// io61_arm_read(f)
+//    Point the read cursor at the rest of the window, if pos_tag is
+//    inside it.
+
+static void io61_arm_read(io61_file* f) {
+    if (io61_tracefd >= 0)   /* every character must reach io61_read */
+        return;
+    if (f->buf && f->pos_tag >= f->tag && f->pos_tag < f->end_tag) {
+        f->c.rptr = f->buf + (f->pos_tag - f->tag);
+        f->c.rend = f->buf + (f->end_tag - f->tag);
+    }
+}
+
+
+// io61_arm_write(f)
+//    Point the write cursor at the room left in `buf` after pos_tag, if
+//    characters written there would simply extend what is buffered.
+
+void io61_arm_write(io61_file* f) {
+    if (f->mode == O_RDONLY || io61_tracefd >= 0 || f->delay)
+        return;
+    if (f->layer) {
+        f->layer->ops->arm_write(f);
+        return;
+    } else if (!f->buf)
+        return;
+    size_t off = f->pos_tag - f->tag;
+    if (f->async) {
+        if (!f->async->writing)
+            return;
+        f->c.wptr = f->buf + off;
+        f->c.wend = f->buf + ASYNCSIZE;
+        return;
+    } else if (f->seekable) {
+        io61_slot* s = &f->slots[f->cur];
+        if (f->pos_tag < f->tag || off >= f->slotsize || !s->ndirty
+            || off < s->dirty[s->ndirty - 1].lo
+            || off > s->dirty[s->ndirty - 1].hi || off > s->len)
+            return;
+    } else if (f->mode != O_WRONLY)
+        return;
+    f->c.wptr = f->buf + off;
+    f->c.wend = f->buf + f->slotsize;
+}
+
+
+// io61_readc_slow(f)
+//    Read a single (unsigned) character from `f` and return it. Returns EOF
+//    (which is -1) on error or end-of-file. Called by io61_readc when the
+//    read cursor is empty; arms it for the characters that follow.
+
+int io61_readc_slow(io61_file* f) {
+    unsigned char buf[1];
+    if (io61_read(f, (char*) buf, 1) != 1)
+        return EOF;
+    io61_arm_read(f);
+    return buf[0];
+}
+
+
+// io61_writec_slow(f)
+//    Write a single character `ch` to `f`. Returns 0 on success or
+//    -1 on error. Called by io61_writec when the write cursor is full;
+//    arms it for the characters that follow.
+
+int io61_writec_slow(io61_file* f, int ch) {
+    unsigned char buf[1];
+    buf[0] = ch;
+    if (io61_write(f, (const char*) buf, 1) != 1)
+        return -1;
+    io61_arm_write(f);
+    return 0;
+}
+
+
+// io61_flushbuf(f)
+//    Forces a write of any `f` buffers that contain data. This is
+//    io61_flush without the trace.
+
+int io61_flushbuf(io61_file* f) {
+    io61_sync(f);
+    if (f->layer)
+        return f->layer->ops->flush(f);
+    if (f->async)
+        return io61_asyncflush(f);
+    if (f->seekable) {
+        if (f->mode == O_RDONLY)
+            return 0;
+        int r = io61_writeback(f);
+        if (f->err) {      /* an earlier write-back of a taken slot failed */
+            errno = f->err;
+            f->err = 0;
+            r = -1;
+        }
+        return r;
+    } else if (f->mode != O_WRONLY)   /* the buffer holds only reads */
+        return 0;
+    size_t pos = 0, n = f->end_tag - f->tag;
+    if (n > 0)
+        ++f->stats->flushes;
+    while (pos < n) {
+        ssize_t r = write(f->fd, f->buf + pos, n - pos);
+        io61_countwrite(f->stats, r);
+        if (r > 0)
+            pos += r;
+        else if (r == 0 || !io61_retry(f->fd, POLLOUT))
+            return -1;
+    }
+    f->tag = f->end_tag;
+    f->since = 0;
+    return 0;
+}
+
+
+// io61_writeiov(f, iov, n, off)
+//    Write all of `iov[0..n)` to `f`'s descriptor at offset `off`, or at
+//    the file position if `off < 0`, retrying after short writes. `iov`
+//    is modified. Returns 0 on success, -1 on error.
+
+static int io61_writeiov(io61_file* f, struct iovec* iov, int n, off_t off) {
+    while (n > 0) {
+        ssize_t r = off >= 0 ? pwritev(f->fd, iov, n, off)
+            : writev(f->fd, iov, n);
+        io61_countwrite(f->stats, r);
+        if (r == 0)
+            return -1;
+        else if (r < 0) {
+            if (!io61_retry(f->fd, POLLOUT))
+                return -1;
+            continue;
+        }
+        if (off >= 0)
+            off += r;
+        while (n > 0 && (size_t) r >= iov->iov_len) {
+            r -= iov->iov_len;
+            ++iov;
+            --n;
+        }
+        if (n > 0) {
+            iov->iov_base = (char*) iov->iov_base + r;
+            iov->iov_len -= r;
+        }
+    }
+    return 0;
+}
+
+
+// io61_iovslice(iov, n, skip, len, out)
+//    Store in `out` the pieces of `iov[0..n)` that cover `len` bytes
+//    starting `skip` bytes in. Returns the number of pieces stored.
+
+static int io61_iovslice(const struct iovec* iov, int n, size_t skip,
+                         size_t len, struct iovec* out) {
+    int k = 0;
+    for (int i = 0; i < n && len > 0; ++i) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        size_t m = iov[i].iov_len - skip;
+        if (m > len)
+            m = len;
+        out[k].iov_base = (char*) iov[i].iov_base + skip;
+        out[k].iov_len = m;
+        ++k;
+        len -= m;
+        skip = 0;
+    }
+    return k;
+}
+
+
+// io61_writebuffered(f, iov, n, off)
+//    io61_writeiov with O_DIRECT turned off for the duration.
+
+static int io61_writebuffered(io61_file* f, struct iovec* iov, int n,
+                              off_t off) {
+    int fl = fcntl(f->fd, F_GETFL);
+    if (fl < 0 || fcntl(f->fd, F_SETFL, fl & ~O_DIRECT) < 0)
+        return -1;
+    int r = io61_writeiov(f, iov, n, off);
+    if (fcntl(f->fd, F_SETFL, fl) < 0)
+        r = -1;
+    return r;
+}
+
+
+// io61_writeiov_direct(f, iov, n, off)
+//    io61_writeiov for an O_DIRECT file. O_DIRECT moves only whole
+//    DIRECTALIGN blocks, so the aligned middle of the range goes to
+//    disk directly and the unaligned head and tail go through the page
+//    cache. The middle must lie in aligned memory, as slot data does.
+
+static int io61_writeiov_direct(io61_file* f, struct iovec* iov, int n,
+                                off_t off) {
+    size_t sz = 0;
+    for (int i = 0; i < n; ++i)
+        sz += iov[i].iov_len;
+    off_t lo = (off + DIRECTALIGN - 1) / DIRECTALIGN * DIRECTALIGN;
+    off_t hi = (off + (off_t) sz) / DIRECTALIGN * DIRECTALIGN;
+    if (lo >= hi)
+        return io61_writebuffered(f, iov, n, off);
+    struct iovec v[MAXIOV];
+    int k;
+    assert(n <= MAXIOV);
+    if (lo > off) {
+        k = io61_iovslice(iov, n, 0, lo - off, v);
+        if (io61_writebuffered(f, v, k, off) < 0)
+            return -1;
+    }
+    k = io61_iovslice(iov, n, lo - off, hi - lo, v);
+    if (io61_writeiov(f, v, k, lo) < 0)
+        return -1;
+    if (off + (off_t) sz > hi) {
+        k = io61_iovslice(iov, n, hi - off, off + sz - hi, v);
+        if (io61_writebuffered(f, v, k, hi) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+
+// io61_markdirty(f, s, lo, hi)
+//    Add data[lo, hi) to the dirty ranges of slot `s`, merging it with
+//    the ranges it overlaps or touches. Every byte of an O_RDWR slot is
+//    current, so its ranges always merge into one. Returns 0 on success
+//    and -1, changing nothing, if `s` has no room for another range.
+
+static int io61_markdirty(io61_file* f, io61_slot* s, size_t lo, size_t hi) {
+    if (f->mode == O_RDWR && s->ndirty) {
+        lo = lo < s->dirty[0].lo ? lo : s->dirty[0].lo;
+        hi = hi > s->dirty[s->ndirty - 1].hi ? hi : s->dirty[s->ndirty - 1].hi;
+    }
+    // ranges [i, j) overlap or touch data[lo, hi)
+    int i = 0;
+    while (i < s->ndirty && s->dirty[i].hi < lo)
+        ++i;
+    int j = i;
+    while (j < s->ndirty && s->dirty[j].lo <= hi)
+        ++j;
+    if (i == j && s->ndirty == MAXDIRTY)
+        return -1;
+    if (i < j) {
+        lo = s->dirty[i].lo < lo ? s->dirty[i].lo : lo;
+        hi = s->dirty[j - 1].hi > hi ? s->dirty[j - 1].hi : hi;
+    }
+    memmove(&s->dirty[i + 1], &s->dirty[j], sizeof(s->dirty[0]) * (s->ndirty - j));
+    s->dirty[i].lo = lo;
+    s->dirty[i].hi = hi;
+    s->ndirty += 1 - (j - i);
+    return 0;
+}
+
+
+// io61_alignrange(f, s)
+//    Widen the dirty range of O_RDWR slot `s` out to DIRECTALIGN
+//    boundaries within the bytes it holds, which are all current, so
+//    O_DIRECT can write more of it.
+
+static void io61_alignrange(io61_file* f, io61_slot* s) {
+    if (!f->direct || f->mode != O_RDWR)
+        return;
+    size_t hi = (s->dirty[0].hi + DIRECTALIGN - 1) / DIRECTALIGN * DIRECTALIGN;
+    s->dirty[0].lo -= s->dirty[0].lo % DIRECTALIGN;
+    s->dirty[0].hi = hi < s->len ? hi : s->len;
+}
+
+
+// io61_writeslot(f, s)
+//    Write out the dirty ranges of slot `s`.
+
+static int io61_writeslot(io61_file* f, io61_slot* s) {
+    io61_alignrange(f, s);
+    for (int j = 0; j < s->ndirty; ++j) {
+        struct iovec iov = { s->data + s->dirty[j].lo,
+                             s->dirty[j].hi - s->dirty[j].lo };
+        off_t off = s->off + s->dirty[j].lo;
+        int r = f->direct ? io61_writeiov_direct(f, &iov, 1, off)
+            : io61_writeiov(f, &iov, 1, off);
+        if (r < 0)
+            return -1;
+    }
+    s->ndirty = 0;
+    return 0;
+}
+
+
+static int io61_slotcmp(const void* a, const void* b) {
+    off_t x = (*(io61_slot* const*) a)->off, y = (*(io61_slot* const*) b)->off;
+    return x < y ? -1 : x > y;
+}
+
+
+// io61_writeback(f)
+//    Write out every dirty slot of `f` in file order. Dirty ranges that
+//    meet end to end, across slot boundaries, go out together in one
+//    pwritev, so a run of slots written in any order is one system call.
+
+static int io61_writeback(io61_file* f) {
+    io61_slot** dirty = (io61_slot**) malloc(sizeof(io61_slot*) * f->nslots);
+    if (!dirty)
+        return -1;
+    size_t n = 0;
+    for (size_t i = 0; i < f->nused; ++i)
+        if (f->slots[i].ndirty) {
+            io61_alignrange(f, &f->slots[i]);
+            dirty[n++] = &f->slots[i];
+        }
+    qsort(dirty, n, sizeof(io61_slot*), io61_slotcmp);
+    if (n > 0)
+        ++f->stats->flushes;
+
+    int r = 0;
+    struct iovec iov[MAXIOV];
+    int niov = 0;
+    off_t off = 0, end = 0;   /* the run in `iov` covers [off, end) */
+    size_t first = 0;         /* slots [first, i) are in or before `iov` */
+    for (size_t i = 0; i < n && r == 0; ++i) {
+        io61_slot* s = dirty[i];
+        for (int j = 0; j < s->ndirty && r == 0; ++j) {
+            off_t lo = s->off + s->dirty[j].lo;
+            if (niov > 0 && (niov == MAXIOV || lo != end)) {
+                r = f->direct ? io61_writeiov_direct(f, iov, niov, off)
+                    : io61_writeiov(f, iov, niov, off);
+                niov = 0;
+                // slots before this one are now fully written
+                for (; r == 0 && first < i; ++first)
+                    dirty[first]->ndirty = 0;
+            }
+            if (niov == 0)
+                off = lo;
+            iov[niov].iov_base = s->data + s->dirty[j].lo;
+            iov[niov].iov_len = s->dirty[j].hi - s->dirty[j].lo;
+            ++niov;
+            end = s->off + s->dirty[j].hi;
+        }
+    }
+    if (r == 0 && niov > 0)
+        r = f->direct ? io61_writeiov_direct(f, iov, niov, off)
+            : io61_writeiov(f, iov, niov, off);
+    for (; r == 0 && first < n; ++first)
+        dirty[first]->ndirty = 0;
+    free(dirty);
+    return r;
+}
+
+
+// io61_lookup(f, off)
+//    Return the index of the slot caching the block at `off`, or -1.
+
+static int io61_lookup(io61_file* f, off_t off) {
+    size_t b = (size_t) (off / f->slotsize) & (f->nbuckets - 1);
+    int i = f->buckets[b];
+    while (i >= 0 && f->slots[i].off != off)
+        i = f->slots[i].next;
+    return i;
+}
+
+
+// io61_overflows(f)
+//    Return nonzero if f's strided scan touches more blocks per pass
+//    over the file than the cache holds.
+
+static int io61_overflows(io61_file* f) {
+    if (f->pattern != IO61_STRIDED || f->size < 0)
+        return 0;
+    off_t stride = f->stride < 0 ? -f->stride : f->stride;
+    return f->size / stride > (off_t) f->nslots;
+}
+
+
+// io61_unlink(f, i)
+//    Remove slot `i` from the hash index, if it is there.
+
+static void io61_unlink(io61_file* f, int i) {
+    io61_slot* s = &f->slots[i];
+    if (s->off >= 0) {
+        int* pp = &f->buckets[(size_t) (s->off / f->slotsize) & (f->nbuckets - 1)];
+        while (*pp != i)
+            pp = &f->slots[*pp].next;
+        *pp = s->next;
+        s->off = -1;
+    }
+}
+
+
+// io61_evict(f)
+//    Choose a slot to reuse, remove it from the hash index, and return
+//    its index, or -1 if the slot was dirty and writing back the cache
+//    failed. The slot starts out referenced. Unused slots go first, as
+//    long as the pool has room for them, then the clock algorithm picks
+//    a victim among the slots in use. A strided scan larger than
+//    the cache would flush every slot under clock, so such a scan
+//    instead recycles the previous miss's slot if it has not been hit
+//    since, which keeps the rest of the cache stable. The clock hand
+//    still advances one slot every `nslots` such misses, slowly enough
+//    that blocks the scan revisits every pass stay referenced, so
+//    blocks it has moved past eventually age out.
+
+static int io61_evict(io61_file* f) {
+    int i;
+    if (f->nused < f->nslots
+        && (f->nused == 0 || io61_poolroom(f, f->slotsize)))
+        i = f->nused++;
+    else if (io61_overflows(f) && f->last_slot >= 0
+             && !f->slots[f->last_slot].ref) {
+        i = f->last_slot;
+        if (f->stats->misses % f->nslots == 0) {
+            int h = f->hand;
+            f->hand = (f->hand + 1) % f->nused;
+            if (h != i && !f->slots[h].ref)
+                i = h;
+            else
+                f->slots[h].ref = 0;
+        }
+    } else {
+        while (f->slots[f->hand].ref) {
+            f->slots[f->hand].ref = 0;
+            f->hand = (f->hand + 1) % f->nused;
+        }
+        i = f->hand;
+        f->hand = (f->hand + 1) % f->nused;
+    }
+    io61_slot* s = &f->slots[i];
+    s->ref = 1;            /* so a batch of evictions never repeats a slot */
+    // evicting one dirty slot writes back all of them, so the writes
+    // go out sorted and coalesced
+    if (s->ndirty && io61_writeback(f) < 0)
+        return -1;
+    io61_unlink(f, i);
+    return i;
+}
+
+
+// io61_insert(f, i, off)
+//    Record in the hash index that slot `i` caches the block at `off`.
+
+static void io61_insert(io61_file* f, int i, off_t off) {
+    size_t b = (size_t) (off / f->slotsize) & (f->nbuckets - 1);
+    f->slots[i].off = off;
+    f->slots[i].next = f->buckets[b];
+    f->buckets[b] = i;
+}
+
+
+// io61_observe(f, start)
+//    Classify the cache lookup at f->pos_tag, in block `start`, against
+//    the previous lookup and update f's access pattern. A pattern is
+//    adopted once two lookups in a row agree on it; sequential and
+//    reverse streams then double their readahead window, and anything
+//    else resets it.
+
+static void io61_observe(io61_file* f, off_t start) {
+    int seen;
+    if (start == f->last_start + (off_t) f->slotsize)
+        seen = IO61_SEQUENTIAL;
+    else if (start + (off_t) f->slotsize == f->last_start)
+        seen = IO61_REVERSE;
+    else if (f->pos_tag - f->last_pos == f->stride && f->stride != 0)
+        seen = IO61_STRIDED;
+    else
+        seen = IO61_RANDOM;
+    f->stride = f->pos_tag - f->last_pos;
+    f->last_pos = f->pos_tag;
+    f->last_start = start;
+
+    if (seen == f->candidate)
+        ++f->streak;
+    else {
+        f->candidate = seen;
+        f->streak = 1;
+    }
+    if (f->streak >= 2 && f->pattern != seen) {
+        f->pattern = f->stats->pattern = seen;
+        if (f->map) {
+            int advice = MADV_NORMAL;
+            if (seen == IO61_SEQUENTIAL)
+                advice = MADV_SEQUENTIAL;
+            else if (seen == IO61_STRIDED || seen == IO61_RANDOM)
+                advice = MADV_RANDOM;
+            (void) madvise(f->map, f->size, advice);
+        }
+#ifdef POSIX_FADV_SEQUENTIAL
+        // kernel readahead helps sequential streams and wastes I/O on
+        // strided and random ones; reverse streams fill backwards below
+        int advice = POSIX_FADV_NORMAL;
+        if (seen == IO61_SEQUENTIAL)
+            advice = POSIX_FADV_SEQUENTIAL;
+        else if (seen == IO61_STRIDED || seen == IO61_RANDOM)
+            advice = POSIX_FADV_RANDOM;
+        (void) posix_fadvise(f->fd, 0, 0, advice);
+#endif
+    }
+
+    size_t max = f->nslots / 2 < MAXREADAHEAD ? f->nslots / 2 : MAXREADAHEAD;
+    if (f->pattern == IO61_SEQUENTIAL || f->pattern == IO61_REVERSE)
+        f->readahead = f->readahead * 2 <= max ? f->readahead * 2 : max;
+    else
+        f->readahead = 1;
+    if (f->readahead < 1)
+        f->readahead = 1;
+}
+
+
+// io61_extend(f, s, off)
+//    In an O_RDWR file, cached writes can move end-of-file past the end
+//    of slot `s`, which caches the block at `off`. The bytes in between
+//    are a hole, so extend `s` with zeros to cover them.
+
+static void io61_extend(io61_file* f, io61_slot* s, off_t off) {
+    if (f->mode == O_RDWR && s->len < f->slotsize
+        && off + (off_t) s->len < f->size) {
+        size_t len = f->size - off < (off_t) f->slotsize
+            ? (size_t) (f->size - off) : f->slotsize;
+        memset(s->data + s->len, 0, len - s->len);
+        s->len = len;
+    }
+}
+
+
+// io61_readblocks(f, start)
+//    Read the block at `start` into a free slot, plus up to
+//    f->readahead - 1 uncached neighbors in the direction of the stream,
+//    all with one system call. Returns the slot holding `start`, or -1
+//    on error.
+
+static int io61_readblocks(io61_file* f, off_t start) {
+    off_t lo = start, hi = start + f->slotsize;
+    size_t n = 1;
+    if (f->pattern == IO61_SEQUENTIAL)
+        while (n < f->readahead && io61_lookup(f, hi) < 0) {
+            hi += f->slotsize;
+            ++n;
+        }
+    else if (f->pattern == IO61_REVERSE)
+        while (n < f->readahead && lo >= (off_t) f->slotsize
+               && io61_lookup(f, lo - f->slotsize) < 0) {
+            lo -= f->slotsize;
+            ++n;
+        }
+
+    int idx[MAXREADAHEAD];
+    struct iovec iov[MAXREADAHEAD];
+    for (size_t k = 0; k < n; ++k) {
+        if ((idx[k] = io61_evict(f)) < 0)
+            return -1;
+        size_t j = 0;
+        while (j < k && idx[j] != idx[k])
+            ++j;
+        if (j < k) {
+            // the pool holds `f` to fewer slots than the readahead
+            // wanted, and the clock came around again: read just `start`
+            idx[0] = idx[k];
+            lo = start;
+            n = 1;
+        }
+    }
+    for (size_t k = 0; k < n; ++k) {
+        io61_slot* s = &f->slots[idx[k]];
+        if (!s->data && io61_slotalloc(f, s) < 0)
+            return -1;
+        iov[k].iov_base = s->data;
+        iov[k].iov_len = f->slotsize;
+    }
+    ssize_t r;
+    do {
+        r = preadv(f->fd, iov, n, lo);
+        io61_countread(f->stats, r);
+    } while (r < 0 && io61_retry(f->fd, POLLIN)); /* interrupted by sig handler return */
+    if (r < 0)
+        return -1;
+
+    // index every slot that received data. In an O_RDWR file, the block
+    // being filled is indexed even if empty so it can be written into.
+    for (size_t k = 0; k < n; ++k) {
+        io61_slot* s = &f->slots[idx[k]];
+        off_t off = lo + k * f->slotsize;
+        size_t before = k * f->slotsize;
+        s->len = (size_t) r > before ? (size_t) r - before : 0;
+        if (s->len > f->slotsize)
+            s->len = f->slotsize;
+        s->ndirty = 0;
+        io61_extend(f, s, off);
+        if (s->len > 0 || (f->mode == O_RDWR && off == start))
+            io61_insert(f, idx[k], off);
+        io61_pooltouch(s);
+    }
+#ifdef POSIX_FADV_WILLNEED
+    // have the kernel start on the next window while we consume this
+    // one, unless the page cache is being bypassed
+    if (f->pattern == IO61_SEQUENTIAL && n == MAXREADAHEAD && !f->direct
+        && (size_t) r == n * f->slotsize)
+        (void) posix_fadvise(f->fd, hi, n * f->slotsize, POSIX_FADV_WILLNEED);
+#endif
+    return idx[(start - lo) / f->slotsize];
+}
+
+
+// io61_asyncwait(a, i, owner)
+//    Wait until buffer `i` of `a` belongs to `owner` or the thread is
+//    told to stop. `seq` is read before the check, so a handoff that
+//    lands between the check and the sleep makes the sleep return at
+//    once.
+
+static void io61_asyncwait(io61_async* a, int i, int owner) {
+    while (1) {
+        int seq = __atomic_load_n(&a->seq, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&a->owner[i], __ATOMIC_ACQUIRE) == owner
+            || __atomic_load_n(&a->stop, __ATOMIC_ACQUIRE))
+            return;
+#ifdef __linux__
+        (void) syscall(SYS_futex, &a->seq, FUTEX_WAIT_PRIVATE, seq,
+                       NULL, NULL, 0);
+#else
+        sched_yield();
+#endif
+    }
+}
+
+
+// io61_asyncwake(a)
+//    Bump `a->seq` and wake the other side if it is asleep.
+
+static void io61_asyncwake(io61_async* a) {
+    __atomic_add_fetch(&a->seq, 1, __ATOMIC_SEQ_CST);
+#ifdef __linux__
+    (void) syscall(SYS_futex, &a->seq, FUTEX_WAKE_PRIVATE, 1,
+                   NULL, NULL, 0);
+#endif
+}
+
+
+// io61_asyncpass(a, i, owner)
+//    Hand buffer `i` of `a` to `owner`.
+
+static void io61_asyncpass(io61_async* a, int i, int owner) {
+    __atomic_store_n(&a->owner[i], owner, __ATOMIC_RELEASE);
+    io61_asyncwake(a);
+}
+
+
+// io61_asyncthread(arg)
+//    Body of the helper thread: fill buffers from the file in order,
+//    or write the buffers it is handed, until told to stop. A reader
+//    exits after passing on end-of-file or an error.
+
+static void* io61_asyncthread(void* arg) {
+    io61_async* a = (io61_async*) arg;
+    off_t off = a->next;
+    for (int i = 0; ; i ^= 1) {
+        io61_asyncwait(a, i, IO61_WORKER);
+        if (__atomic_load_n(&a->stop, __ATOMIC_ACQUIRE))
+            break;
+        if (a->writing) {
+            size_t pos = 0;
+            while (pos < (size_t) a->len[i] && !a->err) {
+                ssize_t r;
+                if (a->seekable)
+                    r = pwrite(a->fd, a->data[i] + pos, a->len[i] - pos,
+                               a->off[i] + pos);
+                else
+                    r = write(a->fd, a->data[i] + pos, a->len[i] - pos);
+                io61_countwrite(a->stats, r);
+                if (r > 0)
+                    pos += r;
+                else if (r == 0)
+                    a->err = EIO;
+                else if (!io61_retry(a->fd, POLLOUT))
+                    a->err = errno;
+            }
+            io61_asyncpass(a, i, IO61_CALLER);
+        } else {
+            ssize_t r;
+            do {
+                if (a->seekable)
+                    r = pread(a->fd, a->data[i], ASYNCSIZE, off);
+                else
+                    r = read(a->fd, a->data[i], ASYNCSIZE);
+                io61_countread(a->stats, r);
+            } while (r < 0 && io61_retry(a->fd, POLLIN));
+            if (r < 0)
+                a->err = errno;
+            a->off[i] = off;
+            a->len[i] = r;
+            if (r > 0)
+                off += r;
+            io61_asyncpass(a, i, IO61_CALLER);
+            if (r <= 0)
+                break;
+        }
+    }
+    return NULL;
+}
+
+
+// io61_startasync(f)
+//    Start streaming `f` through a helper thread. Returns 0 on success
+//    and -1 on failure, which leaves `f` using the cache.
+
+static int io61_startasync(io61_file* f) {
+    io61_async* a = (io61_async*) calloc(1, sizeof(io61_async));
+    if (!a)
+        return -1;
+    a->fd = f->fd;
+    a->seekable = f->seekable;
+    a->writing = f->mode == O_WRONLY;
+    a->stats = f->stats;
+    a->data[0] = (char*) malloc(ASYNCSIZE);
+    a->data[1] = (char*) malloc(ASYNCSIZE);
+    a->owner[0] = a->owner[1] = a->writing ? IO61_CALLER : IO61_WORKER;
+    a->next = f->pos_tag;
+    if (!a->data[0] || !a->data[1]
+        || pthread_create(&a->thread, NULL, io61_asyncthread, a) != 0) {
+        free(a->data[0]);
+        free(a->data[1]);
+        free(a);
+        return -1;
+    }
+    f->async = a;
+    f->buf = a->writing ? a->data[0] : NULL;
+    f->tag = f->end_tag = f->pos_tag;
+    return 0;
+}
+
+
+// io61_asyncput(f)
+//    Hand the caller's buffer of a write file to the thread and take
+//    the other one once the thread has written it. Returns 0 on success
+//    and -1 if the thread has failed.
+
+static int io61_asyncput(io61_file* f) {
+    io61_async* a = f->async;
+    if (f->end_tag != f->tag) {
+        a->off[a->cur] = f->tag;
+        a->len[a->cur] = f->end_tag - f->tag;
+        io61_asyncpass(a, a->cur, IO61_WORKER);
+        a->cur ^= 1;
+        io61_asyncwait(a, a->cur, IO61_CALLER);
+        f->buf = a->data[a->cur];
+        f->tag = f->end_tag = f->pos_tag;
+    }
+    if (a->err) {
+        errno = a->err;
+        return -1;
+    }
+    return 0;
+}
+
+
+// io61_asyncflush(f)
+//    Wait until the thread has written everything `f` has buffered.
+//    Returns 0 on success and -1 on error.
+
+static int io61_asyncflush(io61_file* f) {
+    io61_async* a = f->async;
+    if (!a->writing)
+        return 0;
+    if (f->end_tag != f->tag)
+        ++f->stats->flushes;
+    int r = io61_asyncput(f);
+    io61_asyncwait(a, a->cur ^ 1, IO61_CALLER);
+    if (r == 0 && a->err) {
+        errno = a->err;
+        r = -1;
+    }
+    return r;
+}
+
 
-// io61_fdopen(fd, mode)
-//    Return a new io61_file that reads from and/or writes to the given
-//    file descriptor `fd`. `mode` is either O_RDONLY for a read-only file
-//    or O_WRONLY for a write-only file. You need not support read/write
-//    files.
+// io61_stopasync(f)
+//    Flush `f`, stop its thread, and return it to the cache. A read
+//    file drops what the thread read ahead, so this is only for
+//    seekable files or for files that are going away. Returns 0 on
+//    success and -1 if a write failed.
 
-io61_file* io61_fdopen(int fd, int mode) {
-    assert(fd >= 0);
-    io61_file* f = (io61_file*) malloc(sizeof(io61_file));
-    f->fd = fd;
-    f->cnt = 0;
-    f->towrite = 0;
-    f->seeked = 0;
-    f->bufptr = f->buf;
-    (void) mode;
-    return f;
+static int io61_stopasync(io61_file* f) {
+    io61_async* a = f->async;
+    io61_sync(f);
+    int r = io61_asyncflush(f);
+    __atomic_store_n(&a->stop, 1, __ATOMIC_RELEASE);
+    io61_asyncwake(a);
+    if (!a->writing)       /* it may be blocked reading a pipe */
+        pthread_cancel(a->thread);
+    pthread_join(a->thread, NULL);
+    free(a->data[0]);
+    free(a->data[1]);
+    free(a);
+    f->async = NULL;
+    f->buf = f->mode == O_WRONLY && !f->seekable ? f->slots[0].data : NULL;
+    f->tag = f->end_tag = f->pos_tag;
+    return r;
 }
 
 
-// io61_close(f)
-//    Close the io61_file `f`.
+// io61_asyncfill(f)
+//    Make `buf` the next buffer the thread read, returning the current
+//    one to it. Like io61_fill, returns the number of bytes now buffered
+//    at or after pos_tag, 0 at end-of-file, or -1 on error. If pos_tag
+//    is not where the stream continues, the thread stops and the cache
+//    takes over.
 
-int io61_close(io61_file* f) {
-    io61_flush(f);
-    int r = close(f->fd);
-    free(f);
-    return r;
+static ssize_t io61_asyncfill(io61_file* f) {
+    io61_async* a = f->async;
+    if (f->seekable && f->pos_tag != a->next) {
+        io61_stopasync(f);
+        return io61_fill(f);
+    } else if (a->done) {
+        if (a->err)
+            errno = a->err;
+        return a->err ? -1 : 0;
+    }
+    if (f->buf) {
+        io61_asyncpass(a, a->cur, IO61_WORKER);
+        a->cur ^= 1;
+    }
+    if (__atomic_load_n(&a->owner[a->cur], __ATOMIC_ACQUIRE) == IO61_CALLER)
+        ++f->stats->hits;
+    else {
+        ++f->stats->misses;
+        io61_asyncwait(a, a->cur, IO61_CALLER);
+    }
+    ssize_t n = a->len[a->cur];
+    if (n <= 0) {
+        a->done = 1;
+        f->buf = NULL;
+        f->tag = f->end_tag = f->pos_tag;
+        return io61_asyncfill(f);
+    }
+    f->buf = a->data[a->cur];
+    f->tag = a->off[a->cur];
+    f->end_tag = a->next = f->tag + n;
+    return n;
 }
 
-// reset the buffer if the file has been seeked
-void io61_resetbuffer(io61_file* f) {
-    f->cnt = 0;
-    f->towrite = 0;
-    f->bufptr = f->buf;
+
+// io61_asyncwrite(f, buf, sz)
+//    io61_write for a file streaming through its thread: fill the
+//    caller's buffer, handing it over whenever it is full.
+
+static ssize_t io61_asyncwrite(io61_file* f, const char* buf, size_t sz) {
+    size_t nwritten = 0;
+    while (nwritten < sz) {
+        if (f->end_tag - f->tag == ASYNCSIZE && io61_asyncput(f) < 0)
+            return nwritten ? (ssize_t) nwritten : -1;
+        size_t n = ASYNCSIZE - (f->end_tag - f->tag);
+        if (n > sz - nwritten)
+            n = sz - nwritten;
+        memcpy(f->buf + (f->end_tag - f->tag), buf + nwritten, n);
+        f->pos_tag += n;
+        f->end_tag += n;
+        nwritten += n;
+    }
+    f->stats->copied += nwritten;
+    if (f->size >= 0 && f->pos_tag > f->size)
+        f->size = f->pos_tag;
+    return nwritten;
 }
 
 
-// io61_readc(f)
-//    Read a single (unsigned) character from `f` and return it. Returns EOF
-//    (which is -1) on error or end-of-file.
+// io61_waitinput(f)
+//    Called before a read system call on non-seekable `f`. If that read
+//    would block and `f`'s partner has output buffered, flush it first.
 
-int io61_readc(io61_file* f) {
-	unsigned char buf[1];
-	if(io61_read(f, buf, 1) == 1)	/* use the buffer if reading in sequential order */
-		return buf[0];
-	else
-		return EOF;
+static void io61_waitinput(io61_file* f) {
+    io61_file* p = f->partner;
+    if (!p)
+        return;
+    io61_sync(p);
+    if (!p->async && !p->seekable && p->end_tag == p->tag)
+        return;
+    struct pollfd pfd = { f->fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 0) == 0)
+        (void) io61_flushbuf(p);
 }
 
 
-// io61_writec(f)
-//    Write a single character `ch` to `f`. Returns 0 on success or
-//    -1 on error.
+// io61_fill(f)
+//    Make `buf` the cache slot holding the block that contains
+//    f->pos_tag, reading it if no slot has it. For seekable files the
+//    block starts at a slotsize-aligned offset, so nearby seeks in either
+//    direction keep hitting the cache. Returns the number of bytes now
+//    buffered at or after pos_tag, 0 at end-of-file, or -1 on error.
 
-int io61_writec(io61_file* f, int ch) {
-    unsigned char buf[1];
-    buf[0] = ch;
-    if (io61_write(f, buf, 1) == 1)	/* use the buffer if writing in sequential order */
-        return 0;
-    else
-        return -1;
+static ssize_t io61_fill(io61_file* f) {
+    io61_slot* s;
+    off_t start = f->pos_tag;
+    if (f->layer)
+        return f->layer->ops->fill(f);
+    else if (f->async)
+        return io61_asyncfill(f);
+    else if (f->map) {
+        f->buf = f->map;
+        f->tag = 0;
+        f->end_tag = f->size;
+        return f->end_tag > f->pos_tag ? f->end_tag - f->pos_tag : 0;
+    } else if (f->seekable) {
+        start -= start % f->slotsize;
+        io61_observe(f, start);
+        int i = io61_lookup(f, start);
+        if (i >= 0) {
+            ++f->stats->hits;
+            f->slots[i].ref = 1;
+            io61_extend(f, &f->slots[i], start);
+            io61_pooltouch(&f->slots[i]);
+        } else {
+            ++f->stats->misses;
+            i = io61_readblocks(f, start);
+            if (i < 0)
+                return -1;
+            // in an overflowing scan a block counts as referenced only
+            // once it is hit
+            f->slots[i].ref = !io61_overflows(f);
+            f->last_slot = i;
+        }
+        f->cur = i;
+        s = &f->slots[i];
+    } else {
+        s = &f->slots[0];
+        if (!s->data && io61_slotalloc(f, s) < 0)
+            return -1;
+        io61_waitinput(f);
+        ssize_t r;
+        do {
+            r = read(f->fd, s->data, f->slotsize);
+            io61_countread(f->stats, r);
+        } while (r < 0 && io61_retry(f->fd, POLLIN)); /* interrupted by sig handler return */
+        if (r < 0)
+            return -1;
+        s->len = r;
+        ++f->stats->misses;
+    }
+    f->buf = s->data;
+    f->tag = start;
+    f->end_tag = start + s->len;
+    return f->end_tag > f->pos_tag ? f->end_tag - f->pos_tag : 0;
 }
 
 
-// io61_flush(f)
-//    Forces a write of any `f` buffers that contain data.
+// io61_readdirect(f, buf, sz)
+//    Read up to `sz` characters from `f` straight into `buf`, bypassing
+//    the cache. Returns the number read, 0 at end-of-file, or -1 on
+//    error. An O_RDWR file writes back its dirty slots first so the
+//    kernel returns their contents.
 
-int io61_flush(io61_file* f) {
-	if(f->towrite > 0)
-		write(f->fd, f->bufptr, f->towrite);	/* if in sequential mode */
-    return 0;
+static ssize_t io61_readdirect(io61_file* f, char* buf, size_t sz) {
+    if (f->mode == O_RDWR && io61_flushbuf(f) < 0)
+        return -1;
+    if (!f->seekable)
+        io61_waitinput(f);
+    ssize_t r;
+    do {
+        if (f->seekable)
+            r = pread(f->fd, buf, sz, f->pos_tag);
+        else
+            r = read(f->fd, buf, sz);
+        io61_countread(f->stats, r);
+    } while (r < 0 && io61_retry(f->fd, POLLIN)); /* interrupted by sig handler return */
+    if (r > 0)
+        f->pos_tag += r;
+    return r;
 }
 
 
-// io61_read(f, buf, sz)
+// io61_readbuf(f, buf, sz)
 //    Read up to `sz` characters from `f` into `buf`. Returns the number of
 //    characters read on success; normally this is `sz`. Returns a short
 //    count if the file ended before `sz` characters could be read. Returns
 //    -1 an error occurred before any characters were read.
+//
+//    Once the buffered window is used up, a remainder of at least a
+//    slot's worth goes straight from the kernel into `buf`, unless `f`
+//    uses O_DIRECT, which `buf` is not aligned for.
+
+ssize_t io61_readbuf(io61_file* f, char* buf, size_t sz) {
+    io61_sync(f);
+    size_t nread = 0;
+    while (nread < sz) {
+        /* refill if pos_tag is outside the buffered window */
+        if ((f->pos_tag < f->tag || f->pos_tag >= f->end_tag)
+            && !f->map && !f->async && !f->direct && !f->layer
+            && sz - nread >= f->slotsize) {
+            ssize_t r = io61_readdirect(f, buf + nread, sz - nread);
+            if (r < 0)
+                return nread ? (ssize_t) nread : -1;
+            else if (r == 0)  /* EOF */
+                break;
+            nread += r;
+            continue;
+        } else if (f->pos_tag < f->tag || f->pos_tag >= f->end_tag) {
+            ssize_t r = io61_fill(f);
+            if (r < 0)
+                return nread ? (ssize_t) nread : -1;
+            else if (r == 0)  /* EOF */
+                break;
+        }
+        /* Copy as much as the buffer holds */
+        size_t n = f->end_tag - f->pos_tag;
+        if (n > sz - nread)
+            n = sz - nread;
+        memcpy(buf + nread, f->buf + (f->pos_tag - f->tag), n);
+        f->pos_tag += n;
+        nread += n;
+        f->stats->copied += n;
+    }
+    return nread;
+}
+
+
+// io61_viewbuf(f, ptr, maxsz)
+//    Set `*ptr` to point at up to `maxsz` of the next characters from
+//    `f` without copying them, and advance past them. Returns the number
+//    of characters at `*ptr`, 0 at end-of-file, or -1 on error. They
+//    come from the mapping or from a cache slot, so they are valid only
+//    until the next operation on `f`.
+
+ssize_t io61_viewbuf(io61_file* f, const char** ptr, size_t maxsz) {
+    io61_sync(f);
+    if (f->pos_tag < f->tag || f->pos_tag >= f->end_tag) {
+        ssize_t r = io61_fill(f);
+        if (r <= 0)
+            return r;
+    }
+    size_t n = f->end_tag - f->pos_tag;
+    if (n > maxsz)
+        n = maxsz;
+    *ptr = f->buf + (f->pos_tag - f->tag);
+    f->pos_tag += n;
+    return n;
+}
+
+
+// io61_findbyte(p, byte, n)
+//    Return a pointer to the first `byte` in `p[0..n)`, or NULL. Like
+//    memchr, but inline, since most lines are short enough that the
+//    call costs more than the search: it compares 32 bytes at a time
+//    with AVX2 or 16 with SSE2, and leaves the tail to memchr.
+
+static inline const char* io61_findbyte(const char* p, int byte, size_t n) {
+#if defined(__AVX2__)
+    const __m256i pat = _mm256_set1_epi8((char) byte);
+    for (; n >= 32; p += 32, n -= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*) p);
+        unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pat));
+        if (m)
+            return p + __builtin_ctz(m);
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i pat16 = _mm_set1_epi8((char) byte);
+    for (; n >= 16; p += 16, n -= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) p);
+        unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, pat16));
+        if (m)
+            return p + __builtin_ctz(m);
+    }
+#endif
+    return n ? (const char*) memchr(p, byte, n) : NULL;
+}
+
+
+// io61_linebuf(f, byte, ptr, len)
+//    Read characters from `f` through the next `byte`, or to end-of-file,
+//    set `*ptr` to point at them and `*len` to their number, and return
+//    that number: 0 at end-of-file, -1 on error. A line inside the
+//    buffered window is returned in place. One that spans refills is
+//    gathered into `f->line`, which grows as needed. Either way it is
+//    valid only until the next operation on `f`.
+
+static ssize_t io61_linebuf(io61_file* f, int byte, const char** ptr,
+                            size_t* len) {
+    io61_sync(f);
+    *len = 0;
+    if (f->pos_tag < f->tag || f->pos_tag >= f->end_tag) {
+        ssize_t r = io61_fill(f);
+        if (r <= 0)
+            return r;
+    }
+    const char* p = f->buf + (f->pos_tag - f->tag);
+    size_t n = f->end_tag - f->pos_tag;
+    const char* q = io61_findbyte(p, byte, n);
+    if (q) {
+        *ptr = p;
+        *len = q + 1 - p;
+        f->pos_tag += *len;
+        return *len;
+    }
+    size_t used = 0;
+    while (1) {
+        size_t take = q ? (size_t) (q + 1 - p) : n;
+        if (used + take > f->linecap) {
+            size_t cap = f->linecap ? f->linecap : 256;
+            while (cap < used + take)
+                cap *= 2;
+            char* line = (char*) realloc(f->line, cap);
+            if (!line)
+                return -1;
+            f->line = line;
+            f->linecap = cap;
+        }
+        memcpy(f->line + used, p, take);
+        f->stats->copied += take;
+        used += take;
+        f->pos_tag += take;
+        if (q)
+            break;
+        ssize_t r = io61_fill(f);
+        if (r < 0)
+            return -1;
+        else if (r == 0)  /* EOF ends the line */
+            break;
+        p = f->buf + (f->pos_tag - f->tag);
+        n = r;
+        q = io61_findbyte(p, byte, n);
+    }
+    *ptr = f->line;
+    *len = used;
+    return used;
+}
+
+
+// io61_scanbuf(f, byte)
+//    Skip the characters of `f` through the next `byte`, or to
+//    end-of-file, without copying them. Returns the number skipped, 0 at
+//    end-of-file, or -1 if an error occurred before any were skipped.
+
+static ssize_t io61_scanbuf(io61_file* f, int byte) {
+    io61_sync(f);
+    size_t nskipped = 0;
+    while (1) {
+        if (f->pos_tag < f->tag || f->pos_tag >= f->end_tag) {
+            ssize_t r = io61_fill(f);
+            if (r < 0)
+                return nskipped ? (ssize_t) nskipped : -1;
+            else if (r == 0)  /* EOF */
+                return nskipped;
+        }
+        const char* p = f->buf + (f->pos_tag - f->tag);
+        size_t n = f->end_tag - f->pos_tag;
+        const char* q = io61_findbyte(p, byte, n);
+        if (q)
+            n = q + 1 - p;
+        f->pos_tag += n;
+        nskipped += n;
+        if (q)
+            return nskipped;
+    }
+}
 
-ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
 
-    int cnt;
+// io61_wfill(f)
+//    Make `buf` the write-back slot for the block that contains
+//    f->pos_tag in a seekable file, taking a new slot if no slot has it.
+//    Returns 0 on success and -1 on error.
 
-    while (f->cnt <= 0 || f->seeked) {  /* refill if buf is empty or file position updated */
-	f->cnt = read(f->fd, f->buf, BUFSIZE);
-	if (f->cnt < 0) {
-	    if (errno != EINTR) /* interrupted by sig handler return */
-		return -1;
-	}
-	else if (f->cnt == 0)  /* EOF */
-	    return 0;
-	else {
-	    f->bufptr = f->buf; /* reset buffer ptr */
-	    f->seeked = 0;
-	}
+static int io61_wfill(io61_file* f) {
+    off_t start = f->pos_tag - f->pos_tag % f->slotsize;
+    int i = io61_lookup(f, start);
+    if (i >= 0) {
+        ++f->stats->hits;
+        f->slots[i].ref = 1;
+        io61_extend(f, &f->slots[i], start);
+        io61_pooltouch(&f->slots[i]);
+    } else if (f->mode == O_RDWR) {
+        ++f->stats->misses;
+        if ((i = io61_readblocks(f, start)) < 0)
+            return -1;
+    } else {
+        ++f->stats->misses;
+        if ((i = io61_evict(f)) < 0)
+            return -1;
+        io61_slot* s = &f->slots[i];
+        if (!s->data && io61_slotalloc(f, s) < 0)
+            return -1;
+        s->len = f->slotsize;
+        s->ndirty = 0;
+        io61_insert(f, i, start);
+        io61_pooltouch(s);
     }
+    f->cur = i;
+    f->buf = f->slots[i].data;
+    f->tag = start;
+    f->end_tag = start + f->slots[i].len;
+    return 0;
+}
 
-    /* Copy min(sz, f->cnt) bytes from internal buf to user buf */
-    cnt = (f->cnt < sz)?f->cnt:sz;
-    memcpy(buf, f->bufptr, cnt);
-    f->bufptr += cnt;
-    f->cnt -= cnt;
-    return cnt;
+
+// io61_writevdirect(f, iov, n, sz)
+//    Write the `sz` characters of `iov[0..n)` to `f` straight from
+//    `iov`, with one system call where possible, after what `f` has
+//    buffered. Buffered bytes that end at the file position go out in
+//    the same call. Cached blocks the write covers are forgotten. An
+//    unseekable O_RDWR file, like a socket, buffers only reads, and its
+//    writes leave the read position and buffered input alone.
+//    Returns `sz` on success or -1 on error.
+
+static ssize_t io61_writevdirect(io61_file* f, const struct iovec* iov,
+                                 int n, size_t sz) {
+    struct iovec v[MAXIOV + 1];
+    int k = 0;
+    off_t off = -1;
+    assert(n <= MAXIOV);
+    if (f->seekable) {
+        io61_slot* s = f->buf ? &f->slots[f->cur] : NULL;
+        off = f->pos_tag;
+        if (s && s->ndirty
+            && s->off + (off_t) s->dirty[s->ndirty - 1].hi == f->pos_tag) {
+            --s->ndirty;
+            v[k].iov_base = s->data + s->dirty[s->ndirty].lo;
+            v[k].iov_len = s->dirty[s->ndirty].hi - s->dirty[s->ndirty].lo;
+            off = s->off + s->dirty[s->ndirty].lo;
+            ++k;
+        }
+        if (io61_flushbuf(f) < 0) {
+            if (k) {
+                size_t lo = (char*) v[0].iov_base - s->data;
+                (void) io61_markdirty(f, s, lo, lo + v[0].iov_len);
+            }
+            return -1;
+        }
+        off_t lo = f->pos_tag, hi = f->pos_tag + sz;
+        for (size_t i = 0; i < f->nused; ++i)
+            if (f->slots[i].off >= 0 && f->slots[i].off < hi
+                && f->slots[i].off + (off_t) f->slotsize > lo)
+                io61_unlink(f, i);
+        f->buf = NULL;
+    } else if (f->mode == O_WRONLY && f->end_tag != f->tag) {
+        v[k].iov_base = f->buf;
+        v[k].iov_len = f->end_tag - f->tag;
+        ++k;
+    }
+    memcpy(&v[k], iov, sizeof(struct iovec) * n);
+    if (io61_writeiov(f, v, k + n, off) < 0)
+        return -1;
+    else if (!f->seekable && f->mode == O_RDWR)
+        return sz;
+    f->pos_tag += sz;
+    f->tag = f->end_tag = f->pos_tag;
+    f->since = 0;
+    if (f->size >= 0 && f->pos_tag > f->size)
+        f->size = f->pos_tag;
+    return sz;
 }
 
 
-// io61_write(f, buf, sz)
+// io61_writebuf(f, buf, sz)
 //    Write `sz` characters from `buf` to `f`. Returns the number of
 //    characters written on success; normally this is `sz`. Returns -1 if
 //    an error occurred before any characters were written.
+//
+//    A write of at least a slot's worth goes straight from `buf` to the
+//    kernel, along with what is buffered. A non-seekable O_RDWR file
+//    always writes through. An IO61_ASYNC file copies everything into
+//    its thread's buffers, and an IO61_DIRECT file into its cache.
 
-ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
-	int cnt;
-	if(f->seeked) { /* buffer content would be outdated */
-		io61_resetbuffer(f);
-		f->seeked = 0;
-		return write(f->fd, buf, sz);
-	}
-	if(f->bufptr + f->towrite + sz > f->buf + BUFSIZE){ /* if the buffer will be full */
-		while (f->cnt <= 0) {
-			f->cnt = write(f->fd, f->bufptr, f->towrite);
-			if (f->cnt < 0) {
-	   			if (errno != EINTR)
-					return -1;
-			}
-			else if (f->cnt == 0)
-	  	 		return 0;
-			else 
-	  	 	f->bufptr += f->cnt; 
-		}
-		f->towrite -= f->cnt;
-		cnt = f->cnt;
-		f->cnt = 0;
-	}
-	if(f->towrite <= 0){ /* resets buffer once it becomes empty */
-		f->bufptr = f->buf;
-	}
-	if(f->bufptr + f->towrite + sz <= f->buf + BUFSIZE){ /* when data can still fit */
-		if(sizeof(buf) > 0){
-			if(memcpy(f->bufptr + f->towrite, buf, sz)){
-				f->towrite += sz;
-				cnt = sz;
-			}
-			else
-				return -1;
-		}
-		else
-			return -1;
-	}
-	return cnt;
-}
-
-
-// io61_seek(f, pos)
+ssize_t io61_writebuf(io61_file* f, const char* buf, size_t sz) {
+    size_t nwritten = 0;
+    io61_sync(f);
+    if (f->layer)
+        return f->layer->ops->write(f, buf, sz);
+    else if (f->async)
+        return io61_asyncwrite(f, buf, sz);
+    if ((sz >= f->slotsize && !f->direct)
+        || (!f->seekable && f->mode == O_RDWR)) {
+        struct iovec iov = { (char*) buf, sz };
+        return io61_writevdirect(f, &iov, 1, sz);
+    }
+    while (nwritten < sz && f->seekable) {
+        if ((!f->buf || f->pos_tag < f->tag
+             || f->pos_tag >= f->tag + (off_t) f->slotsize)
+            && io61_wfill(f) < 0)
+            return nwritten ? (ssize_t) nwritten : -1;
+        io61_slot* s = &f->slots[f->cur];
+        size_t off = f->pos_tag - f->tag;
+        size_t n = f->slotsize - off;
+        if (n > sz - nwritten)
+            n = sz - nwritten;
+        if (f->mode == O_RDWR) {
+            // writing past end-of-file leaves a hole of zeros
+            if (off > s->len)
+                memset(s->data + s->len, 0, off - s->len);
+            if (off + n > s->len)
+                s->len = off + n;
+        }
+        // the bytes between two dirty ranges are unknown, so a slot
+        // with no room for another range writes out the ones it has
+        if (io61_markdirty(f, s, off, off + n) < 0
+            && (io61_writeslot(f, s) < 0
+                || io61_markdirty(f, s, off, off + n) < 0))
+            return nwritten ? (ssize_t) nwritten : -1;
+        memcpy(s->data + off, buf + nwritten, n);
+        f->stats->copied += n;
+        f->end_tag = f->tag + s->len;
+        f->pos_tag += n;
+        nwritten += n;
+        if (f->size >= 0 && f->pos_tag > f->size)
+            f->size = f->pos_tag;
+    }
+    while (nwritten < sz) {
+        if ((size_t) (f->end_tag - f->tag) == f->slotsize && io61_flushbuf(f) < 0)
+            return nwritten ? (ssize_t) nwritten : -1;
+        /* Copy as much as fits into the buffer */
+        size_t n = f->slotsize - (f->end_tag - f->tag);
+        if (n > sz - nwritten)
+            n = sz - nwritten;
+        memcpy(f->buf + (f->pos_tag - f->tag), buf + nwritten, n);
+        f->stats->copied += n;
+        f->pos_tag += n;
+        f->end_tag += n;
+        nwritten += n;
+    }
+    if (f->delay && f->end_tag != f->tag) {
+        long long now = io61_now();
+        if (!f->since)
+            f->since = now;
+        else if (now - f->since >= f->delay)
+            (void) io61_flushbuf(f);
+    }
+    return nwritten;
+}
+
+
+// io61_readvbuf(f, iov, iovcnt)
+//    Read from `f` into the `iovcnt` buffers of `iov` in order. Returns
+//    the total number of characters read, which is short only at
+//    end-of-file, or -1 if an error occurred before any were read.
+//
+//    The buffered window is copied out first. If at least a slot's
+//    worth remains, the rest goes straight into the buffers with one
+//    system call.
+
+static ssize_t io61_readvbuf(io61_file* f, const struct iovec* iov,
+                             int iovcnt) {
+    io61_sync(f);
+    size_t nread = 0;
+    int i = 0;
+    size_t ioff = 0;
+    // drain the window
+    while (i < iovcnt && f->pos_tag >= f->tag && f->pos_tag < f->end_tag) {
+        size_t n = f->end_tag - f->pos_tag;
+        if (n > iov[i].iov_len - ioff)
+            n = iov[i].iov_len - ioff;
+        memcpy((char*) iov[i].iov_base + ioff,
+               f->buf + (f->pos_tag - f->tag), n);
+        f->stats->copied += n;
+        f->pos_tag += n;
+        nread += n;
+        if ((ioff += n) == iov[i].iov_len) {
+            ++i;
+            ioff = 0;
+        }
+    }
+    size_t rest = 0;
+    for (int j = i; j < iovcnt; ++j)
+        rest += iov[j].iov_len;
+    rest -= ioff;
+    if (rest >= f->slotsize && !f->map && !f->async && !f->direct
+        && !f->layer && iovcnt - i <= MAXIOV) {
+        struct iovec v[MAXIOV];
+        memcpy(v, &iov[i], sizeof(struct iovec) * (iovcnt - i));
+        v[0].iov_base = (char*) v[0].iov_base + ioff;
+        v[0].iov_len -= ioff;
+        if (f->mode == O_RDWR && io61_flushbuf(f) < 0)
+            return nread ? (ssize_t) nread : -1;
+        if (!f->seekable)
+            io61_waitinput(f);
+        ssize_t r;
+        do {
+            if (f->seekable)
+                r = preadv(f->fd, v, iovcnt - i, f->pos_tag);
+            else
+                r = readv(f->fd, v, iovcnt - i);
+            io61_countread(f->stats, r);
+        } while (r < 0 && io61_retry(f->fd, POLLIN));
+        if (r < 0)
+            return nread ? (ssize_t) nread : -1;
+        f->pos_tag += r;
+        nread += r;
+        if ((size_t) r == rest || r == 0)
+            return nread;
+        // short read: step past what arrived and finish below
+        while ((size_t) r >= iov[i].iov_len - ioff) {
+            r -= iov[i].iov_len - ioff;
+            ++i;
+            ioff = 0;
+        }
+        ioff += r;
+    }
+    for (; i < iovcnt; ++i, ioff = 0) {
+        size_t want = iov[i].iov_len - ioff;
+        ssize_t r = io61_readbuf(f, (char*) iov[i].iov_base + ioff, want);
+        if (r < 0)
+            return nread ? (ssize_t) nread : -1;
+        nread += r;
+        if ((size_t) r < want)
+            break;
+    }
+    return nread;
+}
+
+
+// io61_writevbuf(f, iov, iovcnt)
+//    Write the `iovcnt` buffers of `iov` to `f` in order. Returns the
+//    total number of characters written on success, or -1 if an error
+//    occurred before any were written.
+//
+//    Small writes are gathered into the buffer. At least a slot's
+//    worth goes to the kernel in one system call, with what is
+//    buffered in front of it.
+
+ssize_t io61_writevbuf(io61_file* f, const struct iovec* iov, int iovcnt) {
+    io61_sync(f);
+    size_t sz = 0;
+    for (int i = 0; i < iovcnt; ++i)
+        sz += iov[i].iov_len;
+    if (((sz >= f->slotsize && !f->direct)
+         || (!f->seekable && f->mode == O_RDWR))
+        && iovcnt <= MAXIOV && !f->async && !f->layer)
+        return io61_writevdirect(f, iov, iovcnt, sz);
+    size_t nwritten = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        ssize_t r = io61_writebuf(f, (const char*) iov[i].iov_base,
+                               iov[i].iov_len);
+        if (r < 0)
+            return nwritten ? (ssize_t) nwritten : -1;
+        nwritten += r;
+    }
+    return nwritten;
+}
+
+
+// io61_invalidate(f)
+//    Forget every block cached for `f`, which must have been flushed.
+//    Needed after data reaches the file behind the cache's back.
+
+static void io61_invalidate(io61_file* f) {
+    if (!f->seekable || f->map)
+        return;
+    for (size_t i = 0; i < f->nused; ++i) {
+        f->slots[i].off = -1;
+        f->slots[i].len = 0;
+        f->slots[i].next = -1;
+    }
+    for (size_t b = 0; b < f->nbuckets; ++b)
+        f->buckets[b] = -1;
+    f->last_slot = -1;
+    f->buf = NULL;
+    f->tag = f->end_tag = f->pos_tag;
+}
+
+
+#ifdef __linux__
+enum { IO61_COPY_NONE, IO61_COPY_RANGE, IO61_COPY_SPLICE, IO61_COPY_SENDFILE };
+
+// io61_copymethod(inf, outf)
+//    Return the system call that can copy from `inf` to `outf` inside
+//    the kernel, if any.
+
+static int io61_copymethod(io61_file* inf, io61_file* outf) {
+    if (S_ISREG(inf->type) && S_ISREG(outf->type))
+        return IO61_COPY_RANGE;
+    else if (S_ISFIFO(inf->type) || S_ISFIFO(outf->type))
+        return IO61_COPY_SPLICE;
+    else if (S_ISREG(inf->type))
+        return IO61_COPY_SENDFILE;
+    else
+        return IO61_COPY_NONE;
+}
+#endif
+
+
+// io61_copybuf(inf, outf, sz)
+//    Copy up to `sz` characters from `inf` to `outf`, as io61_read and
+//    io61_write would. Returns the number of characters copied, which is
+//    less than `sz` only at end-of-file or after an error, or -1 if an
+//    error occurred before any characters were copied.
+//
+//    Characters `inf` has already buffered are written out first. The
+//    rest move inside the kernel where the files allow it:
+//    copy_file_range between regular files, splice to or from a pipe,
+//    and sendfile from a regular file to anything else. Otherwise they
+//    are copied through `inf`'s buffer.
+
+static ssize_t io61_copybuf(io61_file* inf, io61_file* outf, size_t sz) {
+    size_t ncopied = 0;
+    io61_sync(inf);
+    io61_sync(outf);
+    if (inf->mode != O_WRONLY && !inf->map
+        && inf->pos_tag >= inf->tag && inf->pos_tag < inf->end_tag) {
+        size_t n = inf->end_tag - inf->pos_tag;
+        if (n > sz)
+            n = sz;
+        ssize_t w = io61_writebuf(outf, inf->buf + (inf->pos_tag - inf->tag), n);
+        if (w <= 0)
+            return -1;
+        inf->pos_tag += w;
+        ncopied += w;
+    }
+
+#ifdef __linux__
+    // the kernel must see `inf`'s cached writes and `outf`'s buffered
+    // output, and it leaves `outf`'s cached blocks stale
+    int method = IO61_COPY_NONE;
+    if (ncopied < sz && !inf->async && !outf->async
+        && !inf->direct && !outf->direct && !inf->layer && !outf->layer
+        && io61_flushbuf(inf) == 0 && io61_flushbuf(outf) == 0) {
+        io61_invalidate(outf);
+        method = io61_copymethod(inf, outf);
+    }
+    size_t nkernel = 0;
+    while (ncopied < sz && method != IO61_COPY_NONE) {
+        size_t n = sz - ncopied < MAXCOPY ? sz - ncopied : MAXCOPY;
+        loff_t inoff = inf->pos_tag, outoff = outf->pos_tag;
+        ssize_t r;
+        if (method == IO61_COPY_RANGE)
+            r = copy_file_range(inf->fd, &inoff, outf->fd, &outoff, n, 0);
+        else if (method == IO61_COPY_SPLICE)
+            r = splice(inf->fd, inf->seekable ? &inoff : NULL,
+                       outf->fd, outf->seekable ? &outoff : NULL,
+                       n, SPLICE_F_MOVE);
+        else {
+            off_t off = inf->pos_tag;
+            r = sendfile(outf->fd, inf->fd, &off, n);
+        }
+        io61_countread(inf->stats, r);
+        io61_countwrite(outf->stats, r);
+        if (r == 0)
+            return ncopied;
+        else if (r > 0) {
+            inf->pos_tag += r;
+            outf->pos_tag += r;
+            outf->tag = outf->end_tag = outf->pos_tag;
+            if (outf->size >= 0 && outf->pos_tag > outf->size)
+                outf->size = outf->pos_tag;
+            ncopied += r;
+            nkernel += r;
+        } else if (errno == EINTR)
+            continue;
+        else if (errno == EAGAIN)
+            method = IO61_COPY_NONE;   /* the loop below waits in poll */
+        else if (nkernel == 0 && (errno == EINVAL || errno == ENOSYS
+                                  || errno == EXDEV || errno == EOPNOTSUPP))
+            method = IO61_COPY_NONE;   /* not between these files */
+        else
+            return ncopied ? (ssize_t) ncopied : -1;
+    }
+#endif
+
+    while (ncopied < sz) {
+        const char* data;
+        ssize_t r = io61_viewbuf(inf, &data, sz - ncopied);
+        if (r <= 0)
+            return ncopied || r == 0 ? (ssize_t) ncopied : -1;
+        ssize_t w = io61_writebuf(outf, data, r);
+        if (w > 0)
+            ncopied += w;
+        if (w < r)
+            return ncopied ? (ssize_t) ncopied : -1;
+    }
+    return ncopied;
+}
+
+
+// io61_pcopy_state
+//    A parallel copy in progress. Chunk `k` covers input offsets
+//    [max(lo, base + k * PCOPYCHUNK), min(hi, base + (k + 1) * PCOPYCHUNK)),
+//    so chunks other than the first and last are PCOPYCHUNK-aligned.
+//    `done` has a bit per chunk, mirrored in the progress file if there
+//    is one.
+
+typedef struct io61_pcopy_header {
+    char magic[8];         /* PCOPYMAGIC */
+    uint64_t inoff;        /* input offset of the range */
+    uint64_t outoff;       /* output offset of the range */
+    uint64_t len;          /* bytes in the range */
+    uint64_t chunk;        /* PCOPYCHUNK when the file was written */
+} io61_pcopy_header;
+
+typedef struct io61_pcopy_state {
+    int infd;
+    int outfd;
+    off_t lo;              /* input range [lo, hi) */
+    off_t hi;
+    off_t delta;           /* output offset minus input offset */
+    off_t base;            /* lo rounded down to a chunk boundary */
+    size_t nchunks;
+    size_t next;           /* next chunk to claim */
+    int error;             /* errno of the first failure, or 0 */
+    unsigned char* done;
+    int progressfd;        /* progress file, or -1 */
+    pthread_mutex_t lock;  /* protects `done` and the progress file */
+    unsigned long long reads[PCOPYTHREADS];   /* per-thread counts */
+    unsigned long long writes[PCOPYTHREADS];
+} io61_pcopy_state;
+
+typedef struct io61_pcopy_worker {
+    io61_pcopy_state* p;
+    int id;
+} io61_pcopy_worker;
+
+
+// io61_pcopychunk(p, k, buf, id)
+//    Copy chunk `k` through `buf`. Returns 0 on success or an errno.
+
+static int io61_pcopychunk(io61_pcopy_state* p, size_t k, char* buf, int id) {
+    off_t off = p->base + (off_t) k * PCOPYCHUNK;
+    off_t end = off + PCOPYCHUNK < p->hi ? off + PCOPYCHUNK : p->hi;
+    if (off < p->lo)
+        off = p->lo;
+    while (off < end) {
+        size_t n = end - off < PCOPYBUF ? end - off : PCOPYBUF;
+        ssize_t r = pread(p->infd, buf, n, off);
+        ++p->reads[id];
+        if (r < 0 && errno == EINTR)
+            continue;
+        else if (r <= 0)   /* the input shrank under us */
+            return r < 0 ? errno : EIO;
+        for (ssize_t w = 0; w < r; ) {
+            ssize_t x = pwrite(p->outfd, buf + w, r - w, off + w + p->delta);
+            ++p->writes[id];
+            if (x > 0)
+                w += x;
+            else if (x == 0)
+                return EIO;
+            else if (errno != EINTR)
+                return errno;
+        }
+        off += r;
+    }
+    return 0;
+}
+
+
+// io61_pcopythread(arg)
+//    Claim chunks and copy them until none are left or a copy fails.
+
+static void* io61_pcopythread(void* arg) {
+    io61_pcopy_worker* wk = (io61_pcopy_worker*) arg;
+    io61_pcopy_state* p = wk->p;
+    char* buf = (char*) malloc(PCOPYBUF);
+    if (!buf) {
+        __atomic_store_n(&p->error, ENOMEM, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    while (!__atomic_load_n(&p->error, __ATOMIC_RELAXED)) {
+        size_t k = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED);
+        if (k >= p->nchunks)
+            break;
+        // other threads set other bits of the same byte under the lock
+        pthread_mutex_lock(&p->lock);
+        int copied = p->done[k / 8] & (1 << (k % 8));
+        pthread_mutex_unlock(&p->lock);
+        if (copied)        /* by an earlier run */
+            continue;
+        int err = io61_pcopychunk(p, k, buf, wk->id);
+        if (err) {
+            __atomic_store_n(&p->error, err, __ATOMIC_RELAXED);
+            break;
+        }
+        pthread_mutex_lock(&p->lock);
+        p->done[k / 8] |= 1 << (k % 8);
+        if (p->progressfd >= 0)
+            (void) pwrite(p->progressfd, &p->done[k / 8], 1,
+                          sizeof(io61_pcopy_header) + k / 8);
+        pthread_mutex_unlock(&p->lock);
+    }
+    free(buf);
+    return NULL;
+}
+
+
+// io61_pcopyprogress(p, filename, hdr)
+//    Open the progress file `filename` for the copy `hdr` describes. If
+//    it records the same copy, load which chunks are done; otherwise
+//    start it afresh. Returns 0 on success and -1 on error.
+
+static int io61_pcopyprogress(io61_pcopy_state* p, const char* filename,
+                              const io61_pcopy_header* hdr) {
+    size_t nbytes = (p->nchunks + 7) / 8;
+    p->progressfd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (p->progressfd < 0)
+        return -1;
+    io61_pcopy_header old;
+    if (pread(p->progressfd, &old, sizeof(old), 0) == (ssize_t) sizeof(old)
+        && memcmp(&old, hdr, sizeof(old)) == 0
+        && pread(p->progressfd, p->done, nbytes, sizeof(old))
+           == (ssize_t) nbytes)
+        return 0;
+    memset(p->done, 0, nbytes);
+    if (ftruncate(p->progressfd, 0) < 0
+        || pwrite(p->progressfd, hdr, sizeof(*hdr), 0) != (ssize_t) sizeof(*hdr)
+        || pwrite(p->progressfd, p->done, nbytes, sizeof(*hdr))
+           != (ssize_t) nbytes)
+        return -1;
+    return 0;
+}
+
+
+// io61_pcopybuf(inf, outf, sz, nthreads, progress)
+//    Copy up to `sz` characters from `inf` to `outf` with `nthreads`
+//    threads. Returns the number of characters copied, or -1 on error.
+//
+//    Between regular files, the range from `inf`'s position to the
+//    lesser of `sz` and its end is split into chunks. `outf` is first
+//    extended to hold the result, with ftruncate, and its blocks
+//    reserved with fallocate. The threads then claim chunks in turn and
+//    move each with pread and pwrite. If `progress` names a file, it
+//    records the chunks that are done, so a copy that failed or was
+//    killed can be run again and pick up where it stopped; the file is
+//    removed once the copy completes. A failed copy leaves both
+//    positions unchanged, since the chunks copied need not be a prefix.
+//
+//    Other files, including pipes and IO61_ASYNC or IO61_DIRECT files,
+//    are copied in order by io61_copy's method.
+
+static ssize_t io61_pcopybuf(io61_file* inf, io61_file* outf, size_t sz,
+                             int nthreads, const char* progress) {
+    io61_sync(inf);
+    io61_sync(outf);
+    if (!S_ISREG(inf->type) || !S_ISREG(outf->type)
+        || !inf->seekable || !outf->seekable
+        || inf->async || outf->async || inf->direct || outf->direct
+        || inf->mode == O_WRONLY || outf->mode == O_RDONLY)
+        return io61_copybuf(inf, outf, sz);
+    if (nthreads < 1)
+        nthreads = 1;
+    else if (nthreads > PCOPYTHREADS)
+        nthreads = PCOPYTHREADS;
+
+    // the kernel must see `inf`'s cached writes and `outf`'s buffered
+    // output, and the copy leaves `outf`'s cached blocks stale
+    struct stat st;
+    if (io61_flushbuf(inf) < 0 || io61_flushbuf(outf) < 0
+        || fstat(inf->fd, &st) < 0)
+        return -1;
+    io61_invalidate(outf);
+    off_t lo = inf->pos_tag;
+    size_t len = st.st_size > lo ? (size_t) (st.st_size - lo) : 0;
+    if (len > sz)
+        len = sz;
+    if (len == 0)
+        return 0;
+
+    io61_pcopy_state p;
+    memset(&p, 0, sizeof(p));
+    p.infd = inf->fd;
+    p.outfd = outf->fd;
+    p.lo = lo;
+    p.hi = lo + len;
+    p.delta = outf->pos_tag - lo;
+    p.base = lo - lo % PCOPYCHUNK;
+    p.nchunks = (p.hi - p.base + PCOPYCHUNK - 1) / PCOPYCHUNK;
+    p.progressfd = -1;
+    p.done = (unsigned char*) calloc((p.nchunks + 7) / 8, 1);
+    if (!p.done)
+        return -1;
+    io61_pcopy_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, PCOPYMAGIC, sizeof(hdr.magic));
+    hdr.inoff = lo;
+    hdr.outoff = outf->pos_tag;
+    hdr.len = len;
+    hdr.chunk = PCOPYCHUNK;
+    if (progress && io61_pcopyprogress(&p, progress, &hdr) < 0) {
+        free(p.done);
+        return -1;
+    }
+
+    // size the output up front, so the threads' writes land in
+    // allocated blocks and never extend the file
+    off_t outend = outf->pos_tag + (off_t) len;
+    if (fstat(outf->fd, &st) == 0 && st.st_size < outend
+        && ftruncate(outf->fd, outend) < 0)
+        p.error = errno;
+#ifdef __linux__
+    if (!p.error)
+        (void) fallocate(outf->fd, 0, outf->pos_tag, len);
+#endif
+
+    pthread_mutex_init(&p.lock, NULL);
+    pthread_t threads[PCOPYTHREADS];
+    io61_pcopy_worker workers[PCOPYTHREADS];
+    int nstarted = 0;
+    for (int i = 0; i < nthreads && !p.error; ++i) {
+        workers[i].p = &p;
+        workers[i].id = i;
+        if (i > 0 && pthread_create(&threads[i], NULL, io61_pcopythread,
+                                    &workers[i]) != 0)
+            break;
+        ++nstarted;
+    }
+    if (nstarted > 0)
+        io61_pcopythread(&workers[0]);   /* the caller is thread 0 */
+    for (int i = 1; i < nstarted; ++i)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&p.lock);
+
+    for (int i = 0; i < nstarted; ++i) {
+        inf->stats->reads += p.reads[i];
+        outf->stats->writes += p.writes[i];
+    }
+    free(p.done);
+    if (p.progressfd >= 0)
+        close(p.progressfd);
+    if (p.error) {
+        errno = p.error;
+        return -1;
+    }
+    inf->stats->rbytes += len;
+    outf->stats->wbytes += len;
+    if (progress)
+        (void) unlink(progress);
+    inf->pos_tag += len;
+    outf->pos_tag += len;
+    outf->tag = outf->end_tag = outf->pos_tag;
+    if (outf->size >= 0 && outf->pos_tag > outf->size)
+        outf->size = outf->pos_tag;
+    return len;
+}
+
+
+// io61_seekbuf(f, pos)
 //    Change the file pointer for file `f` to `pos` bytes into the file.
 //    Returns 0 on success and -1 on failure.
+//
+//    No system call is made: reads refill from the new position only if
+//    it falls outside the buffered window, and writes go to whichever
+//    write-back slot covers `pos`. An IO61_ASYNC write file that moves
+//    stops its thread first. A layer moves its lower file. This is
+//    io61_seek without the trace.
 
-int io61_seek(io61_file* f, size_t pos) {
-    off_t r = lseek(f->fd, (off_t) pos, SEEK_SET);
-    if (r == (off_t) pos){
-    	f->seeked = 1;	/* notifies read() and write() if the file pointer changed */
+int io61_seekbuf(io61_file* f, size_t pos) {
+    if (!f->seekable)
+        return -1;
+    io61_sync(f);
+    if (f->layer && f->layer->ops->seek(f, pos) < 0)
+        return -1;
+    ++f->stats->seeks;
+    if (f->async && f->async->writing && (off_t) pos != f->pos_tag
+        && io61_stopasync(f) < 0)
+        return -1;
+    off_t start = (off_t) pos - (off_t) (pos % f->slotsize);
+    f->pos_tag = pos;
+    // a mapping never misses, so it watches seeks across blocks to
+    // choose its madvise hints
+    if (f->map && start != f->last_start)
+        io61_observe(f, start);
+    // a read-only file can only mean to read next
+    if (f->mode == O_RDONLY)
+        io61_arm_read(f);
+    return 0;
+}
+
+
+// io61_layeropen(lower, ops, priv)
+//    Return a new io61_file that is a layer over `lower` with operations
+//    `ops` and private state `priv`. Its window starts out empty at
+//    `lower`'s position.
+
+io61_file* io61_layeropen(io61_file* lower, const io61_layerops* ops,
+                          void* priv) {
+    io61_file* f = (io61_file*) calloc(1, sizeof(io61_file));
+    if (!f || !(f->stats = (io61_stats*) calloc(1, sizeof(io61_stats)))
+        || !(f->layer = (io61_layer*) malloc(sizeof(io61_layer)))) {
+        if (f)
+            free(f->stats);
+        free(f);
+        return NULL;
+    }
+    io61_sync(lower);
+    f->fd = -1;
+    f->mode = lower->mode;
+    f->seekable = lower->seekable;
+    f->size = -1;
+    f->tag = f->end_tag = f->pos_tag = lower->pos_tag;
+    f->slotsize = lower->slotsize;
+    f->cur = f->last_slot = -1;
+    f->pattern = f->candidate = IO61_UNKNOWN;
+    f->traceseek = -1;
+    f->tracelast = -1;
+    f->layer->ops = ops;
+    f->layer->lower = lower;
+    f->layer->priv = priv;
+    f->stats->fd = -1;
+    f->stats->mode = f->mode;
+    f->traceid = io61_nfiles++;
+    io61_trace(f, IO61_TRACE_OPEN, f->pos_tag, -1, -1);
+    return f;
+}
+
+
+// io61_trace_begin(filename)
+//    Start recording every io61 operation in `filename`, replacing any
+//    trace already open. The file holds IO61_TRACE_MAGIC followed by
+//    io61_trace_record structures; io61sim replays it. While a trace is
+//    open, io61_readc and io61_writec always go out of line, so each
+//    character is recorded. A forked child does not trace. Returns 0 on
+//    success and -1 on failure.
+
+static void io61_traceexit(void) {
+    (void) io61_trace_end();
+}
+
+static void io61_tracechild(void) {
+    io61_tracefd = -1;
+    io61_ntrace = 0;
+}
+
+int io61_trace_begin(const char* filename) {
+    static int registered;
+    if (io61_trace_end() < 0)
+        return -1;
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return -1;
+    if (write(fd, IO61_TRACE_MAGIC, 8) != 8) {
+        close(fd);
+        return -1;
+    }
+    if (!registered) {
+        atexit(io61_traceexit);
+        pthread_atfork(NULL, NULL, io61_tracechild);
+        registered = 1;
+    }
+    io61_tracefd = fd;
+    return 0;
+}
+
+
+// io61_traceflush()
+//    Write the buffered trace records. Returns 0 on success and -1 on
+//    failure, which closes the trace.
+
+static int io61_traceflush(void) {
+    size_t pos = 0, n = io61_ntrace * sizeof(io61_trace_record);
+    while (pos < n) {
+        ssize_t r = write(io61_tracefd, (char*) io61_tracebuf + pos, n - pos);
+        if (r > 0)
+            pos += r;
+        else if (r == 0 || !io61_retry(io61_tracefd, POLLOUT)) {
+            close(io61_tracefd);
+            io61_tracefd = -1;
+            io61_ntrace = 0;
+            return -1;
+        }
+    }
+    io61_ntrace = 0;
+    ++io61_traceepoch;
+    return 0;
+}
+
+
+// io61_trace_end()
+//    Write out and close the trace, if one is open. Returns 0 on
+//    success and -1 on failure.
+
+int io61_trace_end(void) {
+    if (io61_tracefd < 0)
         return 0;
+    int r = io61_traceflush();
+    if (io61_tracefd >= 0 && close(io61_tracefd) < 0)
+        r = -1;
+    io61_tracefd = -1;
+    return r;
+}
+
+
+// io61_traceadd(f, op, flags, off, sz, r)
+//    Append a new record to the trace buffer.
+
+static void io61_traceadd(io61_file* f, int op, int flags, off_t off,
+                          size_t sz, ssize_t r) {
+    if (io61_ntrace == TRACEBUF && io61_traceflush() < 0)
+        return;
+    f->tracelast = io61_ntrace;
+    f->traceepoch = io61_traceepoch;
+    io61_trace_record* t = &io61_tracebuf[io61_ntrace++];
+    t->op = op;
+    t->flags = flags;
+    t->file = f->traceid;
+    t->count = 1;
+    t->off = off;
+    t->size = (ssize_t) sz;
+    t->stride = 0;
+    t->result = r;
+}
+
+
+// io61_trace(f, op, off, sz, r)
+//    Record, if a trace is open, that operation `op` on `f` at offset
+//    `off` for `sz` bytes returned `r`. A read or write of the same size
+//    as `f`'s previous record, which continues that record's stride
+//    after calls that all completed, extends it; so records of
+//    different files may be out of order, but each file's are in order.
+//    A seek waits for the next operation on `f`: if that is a read or
+//    write at the seek's target, it is marked IO61_TRACE_SEEKED instead,
+//    so a strided scan stays one record.
+
+static void io61_trace(io61_file* f, int op, off_t off, size_t sz, ssize_t r) {
+    if (io61_tracefd < 0)
+        return;
+    int flags = 0;
+    int rw = op == IO61_TRACE_READ || op == IO61_TRACE_WRITE;
+    if (f->traceseek >= 0) {
+        if (rw && off == f->traceseek)
+            flags = IO61_TRACE_SEEKED;
+        else
+            io61_traceadd(f, IO61_TRACE_SEEK, 0, f->traceseek, 0, 0);
+        f->traceseek = -1;
+    }
+    if (op == IO61_TRACE_SEEK) {
+        f->traceseek = off;
+        return;
+    } else if (op == IO61_TRACE_OPEN)
+        flags = f->mode | (f->seekable ? IO61_TRACE_SEEKABLE : 0);
+    io61_trace_record* t = NULL;
+    if (f->tracelast >= 0 && f->traceepoch == io61_traceepoch)
+        t = &io61_tracebuf[f->tracelast];
+    if (rw && t && t->op == op && t->flags == flags
+        && t->size == (ssize_t) sz && t->result == t->size
+        && t->count < UINT32_MAX) {
+        int64_t stride = t->count == 1 ? off - t->off : t->stride;
+        if (off == t->off + t->count * stride) {
+            t->stride = stride;
+            ++t->count;
+            t->result = r;
+            return;
         }
-    else
+    }
+    io61_traceadd(f, op, flags, off, sz, r);
+}
+
+
+// io61_read, io61_read_view, io61_write, io61_readv, io61_writev,
+// io61_copy, io61_flush
+//    The traced entry points of the functions above. Internal calls go
+//    to the untraced versions, so each call is recorded once.
+//    io61_flush also moves the descriptor's offset to `f`'s position.
+
+ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
+    if (io61_tracefd < 0)
+        return io61_readbuf(f, buf, sz);
+    io61_sync(f);
+    off_t off = f->pos_tag;
+    ssize_t r = io61_readbuf(f, buf, sz);
+    io61_trace(f, IO61_TRACE_READ, off, sz, r);
+    return r;
+}
+
+ssize_t io61_read_view(io61_file* f, const char** ptr, size_t maxsz) {
+    if (io61_tracefd < 0)
+        return io61_viewbuf(f, ptr, maxsz);
+    io61_sync(f);
+    off_t off = f->pos_tag;
+    ssize_t r = io61_viewbuf(f, ptr, maxsz);
+    io61_trace(f, IO61_TRACE_READ, off, maxsz, r);
+    return r;
+}
+
+ssize_t io61_readline(io61_file* f, const char** ptr, size_t* len) {
+    if (io61_tracefd < 0)
+        return io61_linebuf(f, '\n', ptr, len);
+    io61_sync(f);
+    off_t off = f->pos_tag;
+    ssize_t r = io61_linebuf(f, '\n', ptr, len);
+    io61_trace(f, IO61_TRACE_READ, off, r > 0 ? r : 0, r);
+    return r;
+}
+
+ssize_t io61_scan_until(io61_file* f, int byte) {
+    if (io61_tracefd < 0)
+        return io61_scanbuf(f, byte);
+    io61_sync(f);
+    off_t off = f->pos_tag;
+    ssize_t r = io61_scanbuf(f, byte);
+    io61_trace(f, IO61_TRACE_READ, off, r > 0 ? r : 0, r);
+    return r;
+}
+
+ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
+    if (io61_tracefd < 0)
+        return io61_writebuf(f, buf, sz);
+    io61_sync(f);
+    off_t off = f->pos_tag;
+    ssize_t r = io61_writebuf(f, buf, sz);
+    io61_trace(f, IO61_TRACE_WRITE, off, sz, r);
+    return r;
+}
+
+ssize_t io61_readv(io61_file* f, const struct iovec* iov, int iovcnt) {
+    if (io61_tracefd < 0)
+        return io61_readvbuf(f, iov, iovcnt);
+    io61_sync(f);
+    off_t off = f->pos_tag;
+    size_t sz = 0;
+    for (int i = 0; i < iovcnt; ++i)
+        sz += iov[i].iov_len;
+    ssize_t r = io61_readvbuf(f, iov, iovcnt);
+    io61_trace(f, IO61_TRACE_READ, off, sz, r);
+    return r;
+}
+
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt) {
+    if (io61_tracefd < 0)
+        return io61_writevbuf(f, iov, iovcnt);
+    io61_sync(f);
+    off_t off = f->pos_tag;
+    size_t sz = 0;
+    for (int i = 0; i < iovcnt; ++i)
+        sz += iov[i].iov_len;
+    ssize_t r = io61_writevbuf(f, iov, iovcnt);
+    io61_trace(f, IO61_TRACE_WRITE, off, sz, r);
+    return r;
+}
+
+ssize_t io61_copy(io61_file* inf, io61_file* outf, size_t sz) {
+    if (io61_tracefd < 0)
+        return io61_copybuf(inf, outf, sz);
+    io61_sync(inf);
+    io61_sync(outf);
+    off_t inoff = inf->pos_tag, outoff = outf->pos_tag;
+    ssize_t r = io61_copybuf(inf, outf, sz);
+    io61_trace(inf, IO61_TRACE_READ, inoff, sz, r);
+    io61_trace(outf, IO61_TRACE_WRITE, outoff, sz, r);
+    return r;
+}
+
+ssize_t io61_pcopy(io61_file* inf, io61_file* outf, size_t sz,
+                   int nthreads, const char* progress) {
+    if (io61_tracefd < 0)
+        return io61_pcopybuf(inf, outf, sz, nthreads, progress);
+    io61_sync(inf);
+    io61_sync(outf);
+    off_t inoff = inf->pos_tag, outoff = outf->pos_tag;
+    ssize_t r = io61_pcopybuf(inf, outf, sz, nthreads, progress);
+    io61_trace(inf, IO61_TRACE_READ, inoff, sz, r);
+    io61_trace(outf, IO61_TRACE_WRITE, outoff, sz, r);
+    return r;
+}
+
+int io61_seek(io61_file* f, size_t pos) {
+    if (!f->seekable)
         return -1;
+    io61_sync(f);
+    io61_trace(f, IO61_TRACE_SEEK, pos, 0, 0);
+    return io61_seekbuf(f, pos);
+}
+
+int io61_flush(io61_file* f) {
+    io61_trace(f, IO61_TRACE_FLUSH, f->pos_tag, 0, 0);
+    int r = io61_flushbuf(f);
+    io61_setoffset(f);
+    return r;
 }
 
 
@@ -201,8 +2784,8 @@ int io61_seek(io61_file* f, size_t pos) {
 io61_file* io61_open_check(const char* filename, int mode) {
     int fd;
     if (filename)
-        fd = open(filename, mode);
-    else if (mode == O_RDONLY)
+        fd = open(filename, mode & ~IO61_FLAGS);
+    else if ((mode & O_ACCMODE) == O_RDONLY)
         fd = STDIN_FILENO;
     else
         fd = STDOUT_FILENO;
@@ -216,13 +2799,61 @@ io61_file* io61_open_check(const char* filename, int mode) {
 
 // io61_filesize(f)
 //    Return the number of bytes in `f`. Returns -1 if `f` is not a seekable
-//    file (for instance, if it is a pipe).
+//    file (for instance, if it is a pipe). A layer knows its size only
+//    if it can seek.
 
 ssize_t io61_filesize(io61_file* f) {
     struct stat s;
+    if (f->layer)
+        return f->seekable ? f->size : -1;
     int r = fstat(f->fd, &s);
     if (r >= 0 && S_ISREG(s.st_mode) && s.st_size <= SSIZE_MAX)
         return s.st_size;
     else
         return -1;
 }
+
+
+// io61_profile_stats(buf, sz)
+//    Format io61's per-file counters, their totals as "io_" members,
+//    and the pool's peak size and steals, into `buf` as extra JSON
+//    members for the io61_profile_end report. Returns the number of characters written, which is less
+//    than `sz`. A process that opened no io61 files writes nothing: a
+//    program like pipeexchange61 does its I/O in forked children, and
+//    zero counts would misreport it.
+
+size_t io61_profile_stats(char* buf, size_t sz) {
+    size_t len = 0;
+    if (sz == 0 || io61_nfiles == 0)
+        return 0;
+    io61_stats t = io61_unlisted;
+    len += snprintf(buf + len, sz - len, ", \"files\":[");
+    for (int i = 0; i < io61_nstats && len < sz; ++i) {
+        io61_stats* st = io61_allstats[i];
+        unsigned long long lookups = st->hits + st->misses;
+        len += snprintf(buf + len, sz - len,
+                        "%s{\"fd\":%d, \"mode\":\"%s\", \"pattern\":\"%s\", \"hits\":%llu, \"misses\":%llu, \"hitrate\":%.4f, \"reads\":%llu, \"writes\":%llu, \"rbytes\":%llu, \"wbytes\":%llu, \"seeks\":%llu, \"flushes\":%llu, \"copied\":%llu}",
+                        i ? ", " : "", st->fd,
+                        st->mode == O_RDONLY ? "r" : st->mode == O_WRONLY ? "w" : "rw",
+                        io61_patterns[st->pattern], st->hits, st->misses,
+                        lookups ? (double) st->hits / lookups : 0.0,
+                        st->reads, st->writes, st->rbytes, st->wbytes,
+                        st->seeks, st->flushes, st->copied);
+        t.hits += st->hits;
+        t.misses += st->misses;
+        t.reads += st->reads;
+        t.writes += st->writes;
+        t.rbytes += st->rbytes;
+        t.wbytes += st->wbytes;
+        t.seeks += st->seeks;
+        t.flushes += st->flushes;
+        t.copied += st->copied;
+    }
+    if (len < sz)
+        len += snprintf(buf + len, sz - len,
+                        "], \"io_reads\":%llu, \"io_writes\":%llu, \"io_rbytes\":%llu, \"io_wbytes\":%llu, \"io_hits\":%llu, \"io_misses\":%llu, \"io_seeks\":%llu, \"io_flushes\":%llu, \"io_copied\":%llu, \"pool_peak\":%zu, \"pool_steals\":%llu",
+                        t.reads, t.writes, t.rbytes, t.wbytes, t.hits,
+                        t.misses, t.seeks, t.flushes, t.copied,
+                        io61_thepool.peak, io61_thepool.steals);
+    return len < sz ? len : sz - 1;
+}
@@ -6,26 +6,110 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <stdint.h>
+#include <sys/uio.h>
 
 typedef struct io61_file io61_file;
 
+// Flags that may be OR'd into the mode passed to io61_fdopen and
+// io61_open_check. They occupy bits the kernel's open flags leave free.
+#define IO61_MMAP 0x10000000      /* map a seekable regular read file */
+#define IO61_ASYNC 0x20000000     /* read ahead/write behind in a thread */
+#define IO61_DIRECT 0x40000000    /* bypass the page cache with O_DIRECT */
+#define IO61_FLAGS 0x7F000000     /* all io61-specific mode bits */
+
 io61_file* io61_fdopen(int fd, int mode);
 io61_file* io61_open_check(const char* filename, int mode);
 int io61_close(io61_file* f);
 
+int io61_setcache(io61_file* f, size_t nslots, size_t slotsize);
+int io61_setpool(size_t limit);
+int io61_pair(io61_file* inf, io61_file* outf);
+int io61_setdelay(io61_file* f, unsigned long usec);
+
 ssize_t io61_filesize(io61_file* f);
 
 int io61_seek(io61_file* f, size_t pos);
 
-int io61_readc(io61_file* f);
-int io61_writec(io61_file* f, int ch);
+// Every io61_file begins with an io61_cursor, so io61_readc and
+// io61_writec can work inline, in the style of getc_unlocked.
+// [rptr, rend) holds characters ready to read and [wptr, wend) room
+// ready to write. Either range may be empty, which sends the call to
+// the out-of-line version.
+typedef struct io61_cursor {
+    const char* rptr;
+    const char* rend;
+    char* wptr;
+    char* wend;
+} io61_cursor;
+
+int io61_readc_slow(io61_file* f);
+int io61_writec_slow(io61_file* f, int ch);
+
+static inline int io61_readc(io61_file* f) {
+    io61_cursor* c = (io61_cursor*) f;
+    if (c->rptr < c->rend)
+        return (unsigned char) *c->rptr++;
+    return io61_readc_slow(f);
+}
+
+static inline int io61_writec(io61_file* f, int ch) {
+    io61_cursor* c = (io61_cursor*) f;
+    if (c->wptr < c->wend) {
+        *c->wptr++ = ch;
+        return 0;
+    }
+    return io61_writec_slow(f, ch);
+}
 
 ssize_t io61_read(io61_file* f, char* buf, size_t sz);
+ssize_t io61_read_view(io61_file* f, const char** ptr, size_t maxsz);
+ssize_t io61_readline(io61_file* f, const char** ptr, size_t* len);
+ssize_t io61_scan_until(io61_file* f, int byte);
 ssize_t io61_write(io61_file* f, const char* buf, size_t sz);
+ssize_t io61_readv(io61_file* f, const struct iovec* iov, int iovcnt);
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt);
+ssize_t io61_copy(io61_file* inf, io61_file* outf, size_t sz);
+ssize_t io61_pcopy(io61_file* inf, io61_file* outf, size_t sz,
+                   int nthreads, const char* progress);
 
 int io61_flush(io61_file* f);
 
+// Layers. A layer is an io61_file that reads or writes another one and
+// transforms the bytes in between; closing it closes the file below.
+io61_file* io61_open_crc32c(io61_file* lower);
+uint32_t io61_crc32c(io61_file* f);
+io61_file* io61_open_lz(io61_file* lower);
+
+// Tracing. While a trace is open, each io61 call appends an
+// io61_trace_record to it; runs of same-sized calls at a constant
+// stride share one record.
+#define IO61_TRACE_MAGIC "io61trc1"   /* first 8 bytes of a trace */
+enum {
+    IO61_TRACE_OPEN = 1, IO61_TRACE_CLOSE, IO61_TRACE_READ,
+    IO61_TRACE_WRITE, IO61_TRACE_SEEK, IO61_TRACE_FLUSH
+};
+#define IO61_TRACE_SEEKABLE 4     /* OPEN flags: file is seekable */
+#define IO61_TRACE_SEEKED 1       /* READ, WRITE flags: each call followed
+                                     an io61_seek to its offset */
+
+typedef struct io61_trace_record {
+    uint8_t op;            /* IO61_TRACE_OPEN, ... */
+    uint8_t flags;         /* OPEN: access mode | IO61_TRACE_SEEKABLE */
+    uint16_t file;         /* file number, in order of opening */
+    uint32_t count;        /* consecutive calls this record stands for */
+    int64_t off;           /* file position at the first call */
+    int64_t size;          /* bytes asked for per call; OPEN: file size,
+                              or -1 if not a regular file */
+    int64_t stride;        /* offset from one call to the next */
+    int64_t result;        /* return value of the last call */
+} io61_trace_record;
+
+int io61_trace_begin(const char* filename);
+int io61_trace_end(void);
+
 void io61_profile_begin(void);
 void io61_profile_end(void);
+size_t io61_profile_stats(char* buf, size_t sz);
 
 #endif
@@ -0,0 +1,566 @@
+#include "io61layer.h"
+#include "codec61.h"
+#include <sys/types.h>
+#include <errno.h>
+#include <pthread.h>
+
+// io61layer.c
+//    Layers over io61 files: CRC32C checksums and block compression.
+#define LZBATCH 16         /* decompressed blocks a reader keeps */
+
+
+// The CRC32C layer passes bytes through unchanged and checksums them
+// on the way, without copying them: reads hand out views of `lower`'s
+// cache, and writes go to `lower` from the caller's buffer or, for
+// io61_writec, into room lent from `lower`'s write cursor.
+
+typedef struct io61_crcstate {
+    uint32_t crc;          /* CRC32C of the bytes passed through */
+    char* wmark;           /* start of the bytes the lent cursor wrote */
+} io61_crcstate;
+
+static ssize_t io61_crcfill(io61_file* f) {
+    io61_crcstate* st = (io61_crcstate*) f->layer->priv;
+    const char* data;
+    ssize_t r = io61_viewbuf(f->layer->lower, &data, (size_t) -1);
+    if (r <= 0)
+        return r;
+    st->crc = io61_crc32c_update(st->crc, data, r);
+    f->buf = (char*) data;
+    f->end_tag = f->layer->lower->pos_tag;
+    f->tag = f->end_tag - r;
+    return f->end_tag - f->pos_tag;
+}
+
+static ssize_t io61_crcwrite(io61_file* f, const char* buf, size_t sz) {
+    io61_crcstate* st = (io61_crcstate*) f->layer->priv;
+    ssize_t r = io61_writebuf(f->layer->lower, buf, sz);
+    if (r > 0) {
+        st->crc = io61_crc32c_update(st->crc, buf, r);
+        f->pos_tag += r;
+        f->tag = f->end_tag = f->pos_tag;
+        if (f->size >= 0 && f->pos_tag > f->size)
+            f->size = f->pos_tag;
+    }
+    return r;
+}
+
+static int io61_crcflush(io61_file* f) {
+    return f->mode == O_RDONLY ? 0 : io61_flushbuf(f->layer->lower);
+}
+
+static int io61_crcseek(io61_file* f, off_t pos) {
+    f->buf = NULL;
+    f->tag = f->end_tag = pos;
+    return io61_seekbuf(f->layer->lower, pos);
+}
+
+static void io61_crcarm(io61_file* f) {
+    io61_crcstate* st = (io61_crcstate*) f->layer->priv;
+    io61_arm_write(f->layer->lower);
+    if (f->layer->lower->c.wptr) {
+        f->c.wptr = st->wmark = f->layer->lower->c.wptr;
+        f->c.wend = f->layer->lower->c.wend;
+    }
+}
+
+static void io61_crcsync(io61_file* f) {
+    io61_crcstate* st = (io61_crcstate*) f->layer->priv;
+    size_t n = f->c.wptr - st->wmark;
+    st->crc = io61_crc32c_update(st->crc, st->wmark, n);
+    f->layer->lower->c.wptr = f->c.wptr;
+    f->pos_tag += n;
+    f->tag = f->end_tag = f->pos_tag;
+    if (f->size >= 0 && f->pos_tag > f->size)
+        f->size = f->pos_tag;
+}
+
+static int io61_crcclose(io61_file* f) {
+    free(f->layer->priv);
+    return 0;
+}
+
+static const io61_layerops io61_crcops = {
+    io61_crcfill, io61_crcwrite, io61_crcflush, io61_crcseek,
+    io61_crcarm, io61_crcsync, io61_crcclose
+};
+
+
+// io61_open_crc32c(lower)
+//    Return a layer over `lower`, which must be read-only or write-only,
+//    that checksums the bytes read or written through it. Its size is
+//    `lower`'s. Closing the layer closes `lower`. Returns NULL on error.
+
+io61_file* io61_open_crc32c(io61_file* lower) {
+    io61_crcstate* st;
+    if (lower->mode == O_RDWR
+        || !(st = (io61_crcstate*) calloc(1, sizeof(io61_crcstate))))
+        return NULL;
+    io61_file* f = io61_layeropen(lower, &io61_crcops, st);
+    if (!f)
+        free(st);
+    else if (f->seekable)
+        f->size = io61_filesize(lower);
+    return f;
+}
+
+
+// io61_crc32c(f)
+//    Return the CRC32C of the bytes that have passed through the
+//    CRC32C layer `f`, in the order they passed. For a read layer they
+//    include bytes buffered but not yet read.
+
+uint32_t io61_crc32c(io61_file* f) {
+    assert(f->layer && f->layer->ops == &io61_crcops);
+    io61_sync(f);
+    return ((io61_crcstate*) f->layer->priv)->crc;
+}
+
+
+// The compression layer writes and reads the frames described in
+// codec61.h.
+//
+// io61_lzstate
+//    A compressing or decompressing layer. A write layer's window is
+//    the block being filled, `data[0]`, which io61_lzemit compresses
+//    into `out` and writes after its block record. A read layer of a
+//    seekable file has the whole index, and `data` is a cache of
+//    decompressed blocks: `data[i]` holds block `blk[i]`, and the
+//    least recently `used` is replaced first. One of a pipe reads each
+//    block into `data[0]` in turn.
+
+typedef struct io61_lzstate {
+    size_t bsize;          /* most bytes per block */
+    io61_lz_index* index;  /* entries written or read, or NULL */
+    size_t nindex;         /* entries at `index`, counting the end */
+    size_t indexcap;
+    uint64_t coff;         /* frame bytes written */
+    uint32_t* table;       /* match finder hash table */
+    char* out;             /* payload being written */
+    off_t base;            /* offset of the frame in `lower` */
+    char* in;              /* blocks being read, with their headers */
+    size_t incap;
+    char* data[LZBATCH];   /* decompressed blocks */
+    size_t blk[LZBATCH];   /* block in each of `data`, or SIZE_MAX */
+    unsigned long long used[LZBATCH];  /* `clock` when last used */
+    unsigned long long clock;
+    int dest[LZBATCH];     /* `data` each block of a batch goes to */
+    size_t next;           /* block after the one read last, or
+                              SIZE_MAX before the first read */
+    int eof;               /* a pipe reader has seen the empty block */
+    int nthreads;          /* threads that decompress, with the caller */
+} io61_lzstate;
+
+typedef struct io61_lz_job {
+    io61_lzstate* st;
+    size_t k;              /* decompress blocks k + id, k + id + stride, */
+    size_t n;              /* ..., below k + n */
+    int id;
+    int stride;
+    int err;               /* nonzero if a block was corrupt */
+    int started;           /* nonzero if `thread` runs this job */
+    pthread_t thread;
+} io61_lz_job;
+
+static void io61_lzfree(io61_lzstate* st) {
+    free(st->index);
+    free(st->table);
+    free(st->out);
+    free(st->in);
+    for (int i = 0; i < LZBATCH; ++i)
+        free(st->data[i]);
+    free(st);
+}
+
+static int io61_lzaddindex(io61_lzstate* st, off_t upos) {
+    if (st->nindex == st->indexcap) {
+        size_t cap = st->indexcap ? 2 * st->indexcap : 64;
+        io61_lz_index* x = (io61_lz_index*)
+            realloc(st->index, sizeof(io61_lz_index) * cap);
+        if (!x)
+            return -1;
+        st->index = x;
+        st->indexcap = cap;
+    }
+    st->index[st->nindex].upos = upos;
+    st->index[st->nindex].coff = st->coff;
+    ++st->nindex;
+    return 0;
+}
+
+static void* io61_lzthread(void* arg) {
+    io61_lz_job* j = (io61_lz_job*) arg;
+    io61_lzstate* st = j->st;
+    for (size_t i = j->id; i < j->n; i += j->stride) {
+        const io61_lz_index* x = &st->index[j->k + i];
+        const char* p = st->in + (x->coff - st->index[j->k].coff);
+        io61_lz_block b;
+        io61_lz_getblock((const unsigned char*) p, &b);
+        if (x[1].coff - x->coff != LZRECORDSIZE + (b.csize & ~LZRAW)
+            || io61_lzdecode(&b, p + LZRECORDSIZE, st->data[st->dest[i]],
+                             x[1].upos - x->upos) < 0)
+            j->err = 1;
+    }
+    return NULL;
+}
+
+// io61_lzbatch(f, k, n)
+//    Read blocks [k, k + n) of read layer `f` with one read of `lower`
+//    and decompress them into the least recently used of `data`,
+//    spreading them across up to `nthreads` threads. Returns 0 on
+//    success and -1 on error.
+
+static int io61_lzbatch(io61_file* f, size_t k, size_t n) {
+    io61_lzstate* st = (io61_lzstate*) f->layer->priv;
+    const io61_lz_index* x = st->index;
+    size_t len = x[k + n].coff - x[k].coff;
+    for (size_t j = 0; j < n; ++j) {
+        int v = 0;
+        for (int i = 1; i < LZBATCH; ++i)
+            if (st->used[i] < st->used[v])
+                v = i;
+        st->dest[j] = v;
+        st->blk[v] = SIZE_MAX;
+        st->used[v] = ++st->clock;
+    }
+    if (io61_seekbuf(f->layer->lower, st->base + x[k].coff) < 0
+        || io61_readbuf(f->layer->lower, st->in, len) != (ssize_t) len) {
+        errno = EIO;
+        return -1;
+    }
+    io61_lz_job jobs[LZBATCH];
+    int nt = st->nthreads < (int) n ? st->nthreads : (int) n;
+    for (int t = 0; t < nt; ++t) {
+        jobs[t].st = st;
+        jobs[t].k = k;
+        jobs[t].n = n;
+        jobs[t].id = t;
+        jobs[t].stride = nt;
+        jobs[t].err = 0;
+        jobs[t].started = t > 0
+            && pthread_create(&jobs[t].thread, NULL, io61_lzthread,
+                              &jobs[t]) == 0;
+        if (t > 0 && !jobs[t].started)
+            io61_lzthread(&jobs[t]);
+    }
+    io61_lzthread(&jobs[0]);
+    int err = 0;
+    for (int t = 0; t < nt; ++t) {
+        if (jobs[t].started)
+            pthread_join(jobs[t].thread, NULL);
+        err |= jobs[t].err;
+    }
+    if (err) {
+        errno = EIO;
+        return -1;
+    }
+    ++f->stats->misses;
+    for (size_t j = 0; j < n; ++j)
+        st->blk[st->dest[j]] = k + j;
+    return 0;
+}
+
+// io61_lzfill(f)
+//    Point the window at the decompressed block that holds pos_tag. A
+//    reader that moves on to the block after the one it read last
+//    misses with LZBATCH / 2 blocks to decompress; one that seeks
+//    elsewhere gets just the block.
+
+static ssize_t io61_lzfill(io61_file* f) {
+    io61_lzstate* st = (io61_lzstate*) f->layer->priv;
+    if (!st->index) {
+        unsigned char rec[LZRECORDSIZE];
+        io61_lz_block b;
+        if (st->eof)
+            return 0;
+        if (io61_readbuf(f->layer->lower, (char*) rec, LZRECORDSIZE)
+            != LZRECORDSIZE) {
+            errno = EIO;
+            return -1;
+        }
+        io61_lz_getblock(rec, &b);
+        if (b.usize > st->bsize || (b.csize & ~LZRAW) > st->incap) {
+            errno = EIO;
+            return -1;
+        } else if (b.usize == 0) {
+            st->eof = 1;
+            return 0;
+        }
+        size_t len = b.csize & ~LZRAW;
+        if (io61_readbuf(f->layer->lower, st->in, len) != (ssize_t) len
+            || io61_lzdecode(&b, st->in, st->data[0], b.usize) < 0) {
+            errno = EIO;
+            return -1;
+        }
+        ++f->stats->misses;
+        f->buf = st->data[0];
+        f->tag = f->end_tag;
+        f->end_tag = f->tag + b.usize;
+        return f->end_tag - f->pos_tag;
+    }
+
+    size_t nblocks = st->nindex - 1;
+    if (f->pos_tag >= (off_t) st->index[nblocks].upos)
+        return 0;
+    size_t lo = 0, hi = nblocks;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if ((off_t) st->index[mid].upos <= f->pos_tag)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    int i = 0;
+    while (i < LZBATCH && st->blk[i] != lo)
+        ++i;
+    if (i == LZBATCH) {
+        size_t n = lo == st->next ? LZBATCH / 2 : 1;
+        if (n > nblocks - lo)
+            n = nblocks - lo;
+        if (io61_lzbatch(f, lo, n) < 0)
+            return -1;
+        i = st->dest[0];
+    } else {
+        ++f->stats->hits;
+        st->used[i] = ++st->clock;
+    }
+    st->next = lo + 1;
+    f->buf = st->data[i];
+    f->tag = st->index[lo].upos;
+    f->end_tag = st->index[lo + 1].upos;
+    return f->end_tag - f->pos_tag;
+}
+
+// io61_lzemit(f)
+//    Compress the block in a write layer's window and write it, after
+//    its block record, to `lower`. Returns 0 on success and -1 on
+//    error.
+
+static int io61_lzemit(io61_file* f) {
+    io61_lzstate* st = (io61_lzstate*) f->layer->priv;
+    size_t n = f->end_tag - f->tag;
+    if (n == 0)
+        return 0;
+    io61_lz_block b;
+    unsigned char rec[LZRECORDSIZE];
+    size_t len = io61_lzencode(f->buf, n, &b, st->out, st->table);
+    io61_lz_putblock(rec, &b);
+    struct iovec iov[2] = {
+        { rec, LZRECORDSIZE }, { b.csize & LZRAW ? f->buf : st->out, len }
+    };
+    if (io61_lzaddindex(st, f->tag) < 0
+        || io61_writevbuf(f->layer->lower, iov, 2)
+           != (ssize_t) (LZRECORDSIZE + len))
+        return -1;
+    st->coff += LZRECORDSIZE + len;
+    ++f->stats->flushes;
+    f->tag = f->end_tag;
+    return 0;
+}
+
+// io61_lzwrite(f, buf, sz)
+//    Append `buf[0..sz)` to the block in the window, emitting each
+//    block as it fills.
+
+static ssize_t io61_lzwrite(io61_file* f, const char* buf, size_t sz) {
+    size_t nwritten = 0;
+    if (f->mode == O_RDONLY)
+        return -1;
+    while (nwritten < sz) {
+        if ((size_t) (f->end_tag - f->tag) == f->slotsize
+            && io61_lzemit(f) < 0)
+            return nwritten ? (ssize_t) nwritten : -1;
+        size_t n = f->slotsize - (f->end_tag - f->tag);
+        if (n > sz - nwritten)
+            n = sz - nwritten;
+        memcpy(f->buf + (f->end_tag - f->tag), buf + nwritten, n);
+        f->stats->copied += n;
+        f->end_tag += n;
+        nwritten += n;
+    }
+    f->pos_tag = f->end_tag;
+    return nwritten;
+}
+
+static int io61_lzflush(io61_file* f) {
+    if (f->mode == O_RDONLY)
+        return 0;
+    else if (io61_lzemit(f) < 0)
+        return -1;
+    return io61_flushbuf(f->layer->lower);
+}
+
+// io61_lzseek(f, pos)
+//    Only a read layer of a seekable file can seek, and io61_lzfill
+//    finds the block for any pos_tag, so there is nothing to do.
+
+static int io61_lzseek(io61_file* f, off_t pos) {
+    (void) f, (void) pos;
+    return 0;
+}
+
+// io61_lzarm(f), io61_lzsync(f)
+//    Lend the caller the rest of a write layer's block as its write
+//    cursor, and take back what it wrote there.
+
+static void io61_lzarm(io61_file* f) {
+    f->c.wptr = f->buf + (f->end_tag - f->tag);
+    f->c.wend = f->buf + f->slotsize;
+}
+
+static void io61_lzsync(io61_file* f) {
+    size_t n = f->c.wptr - (f->buf + (f->end_tag - f->tag));
+    f->stats->copied += n;
+    f->end_tag += n;
+    f->pos_tag = f->end_tag;
+}
+
+// io61_lzclose(f)
+//    Finish a write layer's frame with the empty block, the index, and
+//    the trailer, and free the layer's state.
+
+static int io61_lzclose(io61_file* f) {
+    io61_lzstate* st = (io61_lzstate*) f->layer->priv;
+    int r = 0;
+    if (f->mode != O_RDONLY) {
+        unsigned char end[LZRECORDSIZE], tbuf[LZTRAILERSIZE];
+        io61_lz_trailer t;
+        if (io61_lzaddindex(st, f->end_tag) < 0)
+            r = -1;
+        else {
+            t.idxoff = st->coff + LZRECORDSIZE;
+            t.nblocks = st->nindex - 1;
+            memset(end, 0, LZRECORDSIZE);
+            io61_lz_putindex((unsigned char*) st->index, st->index,
+                             st->nindex);
+            io61_lz_puttrailer(tbuf, &t);
+            struct iovec iov[3] = {
+                { end, LZRECORDSIZE },
+                { st->index, LZINDEXSIZE * st->nindex },
+                { tbuf, LZTRAILERSIZE }
+            };
+            size_t sz = iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+            if (io61_writevbuf(f->layer->lower, iov, 3) != (ssize_t) sz)
+                r = -1;
+        }
+    }
+    io61_lzfree(st);
+    return r;
+}
+
+static const io61_layerops io61_lzops = {
+    io61_lzfill, io61_lzwrite, io61_lzflush, io61_lzseek,
+    io61_lzarm, io61_lzsync, io61_lzclose
+};
+
+// io61_lzstartwrite(lower, st), io61_lzstartread(lower, st)
+//    Set up `st` to write a frame to `lower`, writing its header, or to
+//    read one from `lower`. A reader of a seekable file reads the
+//    trailer and index, checks that they describe well-formed blocks,
+//    and reads the header from the frame's start; a reader of anything
+//    else reads the header where `lower` is. Return 0 on success and -1
+//    on error.
+
+static int io61_lzstartwrite(io61_file* lower, io61_lzstate* st) {
+    unsigned char h[LZHEADERSIZE];
+    st->bsize = LZBLOCK;
+    io61_lz_putheader(h, st->bsize);
+    st->coff = LZHEADERSIZE;
+    if (!(st->data[0] = (char*) malloc(st->bsize))
+        || !(st->out = (char*) malloc(st->bsize))
+        || !(st->table = (uint32_t*) malloc(sizeof(uint32_t) << LZHASHBITS))
+        || io61_writebuf(lower, (const char*) h, LZHEADERSIZE)
+           != LZHEADERSIZE)
+        return -1;
+    return 0;
+}
+
+static int io61_lzstartread(io61_file* lower, io61_lzstate* st) {
+    unsigned char h[LZHEADERSIZE], tbuf[LZTRAILERSIZE];
+    io61_lz_trailer t;
+    uint32_t bsize;
+    off_t start = lower->pos_tag;
+    ssize_t fsize = lower->seekable ? io61_filesize(lower) : -1;
+    if (fsize >= LZHEADERSIZE + LZRECORDSIZE + LZINDEXSIZE + LZTRAILERSIZE
+        && io61_seekbuf(lower, fsize - LZTRAILERSIZE) == 0
+        && io61_readbuf(lower, (char*) tbuf, LZTRAILERSIZE) == LZTRAILERSIZE
+        && io61_lz_gettrailer(tbuf, &t) == 0
+        && t.nblocks < (uint64_t) fsize / LZINDEXSIZE) {
+        st->nindex = t.nblocks + 1;
+        size_t isz = LZINDEXSIZE * st->nindex;
+        off_t ioff = fsize - LZTRAILERSIZE - isz;
+        st->base = ioff - (off_t) t.idxoff;
+        if (ioff < LZHEADERSIZE || st->base < 0
+            || !(st->index = (io61_lz_index*) malloc(isz))
+            || io61_seekbuf(lower, ioff) < 0
+            || io61_readbuf(lower, (char*) st->index, isz) != (ssize_t) isz)
+            return -1;
+        io61_lz_getindex((const unsigned char*) st->index, st->index,
+                         st->nindex);
+        start = st->base;
+    }
+    if (io61_seekbuf(lower, start) < 0 && lower->seekable)
+        return -1;
+    if (io61_readbuf(lower, (char*) h, LZHEADERSIZE) != LZHEADERSIZE
+        || io61_lz_getheader(h, &bsize) < 0
+        || (st->index && io61_lz_checkindex(st->index, &t, bsize) < 0))
+        return -1;
+    st->bsize = bsize;
+
+    int nbuf = 1;
+    if (st->index) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        st->nthreads = ncpu < 1 ? 1 : ncpu > LZBATCH / 2 ? LZBATCH / 2 : ncpu;
+        nbuf = LZBATCH;
+        for (int i = 0; i < LZBATCH; ++i)
+            st->blk[i] = SIZE_MAX;
+        st->next = SIZE_MAX;
+    }
+    st->incap = nbuf * (LZRECORDSIZE + st->bsize);
+    if (!(st->in = (char*) malloc(st->incap)))
+        return -1;
+    for (int i = 0; i < nbuf; ++i)
+        if (!(st->data[i] = (char*) malloc(st->bsize)))
+            return -1;
+    return 0;
+}
+
+
+// io61_open_lz(lower)
+//    Return a layer that compresses what is written through it into
+//    `lower`, if `lower` is write-only, or decompresses what `lower`
+//    holds, if it is read-only. A read layer over a seekable file can
+//    seek, knows its size, caches LZBATCH decompressed blocks, and
+//    decompresses runs of blocks on separate threads; over a pipe it
+//    reads the blocks in order. Each block's checksum is checked as it
+//    is read. Closing a write layer finishes the frame, and closing
+//    either closes `lower`. Returns NULL on error, including when
+//    `lower` does not hold a frame.
+
+io61_file* io61_open_lz(io61_file* lower) {
+    io61_lzstate* st = (io61_lzstate*) calloc(1, sizeof(io61_lzstate));
+    if (!st)
+        return NULL;
+    int r = -1;
+    if (lower->mode == O_WRONLY)
+        r = io61_lzstartwrite(lower, st);
+    else if (lower->mode == O_RDONLY)
+        r = io61_lzstartread(lower, st);
+    io61_file* f = r == 0 ? io61_layeropen(lower, &io61_lzops, st) : NULL;
+    if (!f) {
+        io61_lzfree(st);
+        return NULL;
+    }
+    f->tag = f->end_tag = f->pos_tag = 0;
+    f->slotsize = st->bsize;
+    if (f->mode == O_WRONLY) {
+        // writes fill data[0] like a pipe's buffer
+        f->seekable = 0;
+        f->buf = st->data[0];
+    } else {
+        f->seekable = st->index != NULL;
+        if (st->index)
+            f->size = st->index[st->nindex - 1].upos;
+    }
+    return f;
+}
@@ -0,0 +1,173 @@
+#ifndef IO61LAYER_H
+#define IO61LAYER_H
+#include "io61.h"
+#include <sys/types.h>
+
+// io61layer.h
+//    The io61_file structure and the parts of io61.c that the layers in
+//    io61layer.c build on.
+
+// io61_stats
+//    Per-file counters. They outlive the file so io61_profile_end can
+//    report on files that are already closed.
+
+typedef struct io61_stats {
+    int fd;
+    int mode;
+    int pattern;           /* last detected access pattern */
+    unsigned long long hits;     /* block lookups served from the cache */
+    unsigned long long misses;   /* block lookups that read the file */
+    unsigned long long reads;    /* read system calls, kernel copies included */
+    unsigned long long writes;   /* write system calls, kernel copies included */
+    unsigned long long rbytes;   /* bytes those reads returned */
+    unsigned long long wbytes;   /* bytes those writes took */
+    unsigned long long seeks;    /* io61_seek calls */
+    unsigned long long flushes;  /* flushes that had buffered data to write */
+    unsigned long long copied;   /* bytes memcpy'd to or from the caller */
+} io61_stats;
+
+typedef struct io61_slot io61_slot;
+typedef struct io61_async io61_async;
+typedef struct io61_layer io61_layer;
+
+// io61_file
+//    Data structure for io61 file wrappers. Add your own stuff.
+//
+//    The current buffer `buf` caches the file bytes at offsets
+//    [tag, end_tag). For a read file, pos_tag may point anywhere; a read
+//    inside the window is served from `buf`, and a read outside it
+//    switches `buf` to the cache slot holding the slotsize-aligned block
+//    containing pos_tag, filling a slot chosen by the clock algorithm if
+//    no slot holds it. `buckets` maps block numbers to slots. A read
+//    file opened with IO61_MMAP instead maps the whole file, and its
+//    window is the mapping.
+//
+//    A seekable write file uses the same cache as a write-back cache:
+//    writes go to the slot `cur` for the block containing pos_tag, and
+//    each slot remembers up to MAXDIRTY ranges of it that are dirty.
+//    Dirty slots are written in offset order, in runs, when the cache
+//    runs out of slots or `f` is flushed. A seekable O_RDWR file reads
+//    each block before writing into it, so every slot holds the file's
+//    current contents: reads see cached writes, and a slot's one dirty
+//    range may span bytes that were never written. For a non-seekable write file, `buf` is slot 0 and
+//    holds bytes not yet written, and pos_tag == end_tag; a non-seekable
+//    O_RDWR file buffers only its reads.
+//
+//    The cursor `c` lets the inline io61_readc and io61_writec move
+//    through `buf` without updating pos_tag or the dirty ranges.
+//    io61_sync folds what they did back in, and every other operation
+//    calls it first.
+//
+//    A file opened with IO61_ASYNC streams through the two buffers of
+//    `async` instead of the cache while it is read or written in order;
+//    `buf` is the caller's buffer and behaves like the append buffer of
+//    a non-seekable write file. A seek that breaks the order stops the
+//    thread and returns the file to the cache.
+//
+//    A file opened with IO61_DIRECT sets O_DIRECT on a regular file's
+//    descriptor, so its data bypasses the page cache. Slots are then
+//    DIRECTALIGN-aligned in memory, reads fetch whole slots, and every
+//    transfer goes through the cache: the caller's buffers are not
+//    aligned.
+//
+//    A layer (see io61_layer) has no descriptor: it reads or writes the
+//    io61_file below it, and its window holds the transformed bytes.
+
+struct io61_file {
+    io61_cursor c;         /* inline readc/writec state; must be first */
+    int fd;                /* descriptor for this internal buf */
+    int mode;              /* O_RDONLY, O_WRONLY, or O_RDWR */
+    int seekable;          /* nonzero if fd supports pread/pwrite */
+    int direct;            /* nonzero if fd has O_DIRECT set */
+    mode_t type;           /* file type bits of st_mode */
+    off_t size;            /* file size including cached writes, or -1
+                              if not a regular file */
+    off_t tag;             /* file offset of buf[0] */
+    off_t end_tag;         /* file offset one past the last valid byte */
+    off_t pos_tag;         /* file offset of the next byte to read or write */
+    char* buf;             /* data of the current slot */
+    char* map;             /* whole-file mapping, or NULL */
+    size_t slotsize;       /* bytes per slot */
+    size_t nslots;         /* number of slots */
+    size_t nbuckets;       /* power of two >= 2 * nslots */
+    size_t hand;           /* clock hand: next eviction candidate */
+    size_t nused;          /* slots [0, nused) have been used */
+    io61_slot* slots;
+    int* buckets;          /* first slot in each hash bucket, or -1 */
+    int cur;               /* slot holding buf in a seekable file */
+    int pattern;           /* detected access pattern */
+    int candidate;         /* pattern seen on the latest misses */
+    int streak;            /* consecutive misses that saw `candidate` */
+    off_t last_start;      /* block of the previous cache lookup */
+    off_t last_pos;        /* file position of the previous cache lookup */
+    off_t stride;          /* distance between the last two lookups */
+    int last_slot;         /* slot filled by the previous miss, or -1 */
+    size_t readahead;      /* slots to fill per miss */
+    io61_stats* stats;
+    int err;               /* errno of a failed write-back of a slot
+                              another file took, or 0; reported by the
+                              next flush */
+    io61_async* async;     /* IO61_ASYNC state, or NULL */
+    int traceid;           /* file number in the trace */
+    off_t traceseek;       /* target of a seek not yet traced, or -1 */
+    int tracelast;         /* this file's latest record in the trace
+                              buffer, or -1 */
+    unsigned traceepoch;   /* value of io61_traceepoch when set */
+    io61_file* partner;    /* output flushed before a read of this file
+                              blocks, or NULL; see io61_pair */
+    io61_file* pairedby;   /* file whose partner this is, or NULL */
+    long long delay;       /* ns buffered output may wait, or 0 */
+    long long since;       /* when the oldest buffered output was
+                              written, in ns, or 0 */
+    char* line;            /* io61_readline scratch for lines that span
+                              refills, or NULL */
+    size_t linecap;        /* bytes allocated at `line` */
+    io61_layer* layer;     /* layer state, or NULL */
+};
+
+
+// io61_layer
+//    A layer: an io61_file that reads or writes another one, `lower`,
+//    and transforms the bytes in between. `ops` says how, and `priv`
+//    points at the layer's own state. A layer owns `lower` and closes
+//    it. It is either read or written, never both.
+//
+//    `fill` stands in for io61_fill: it points the window
+//    [tag, end_tag) at `buf` at transformed bytes that include pos_tag.
+//    `write` takes each write, and `flush` passes everything written so
+//    far on to `lower`. `seek` prepares for a new pos_tag. `arm_write`
+//    may point the write cursor at room for the caller, and `sync` then
+//    folds what was written there back in. `close` finishes the layer's
+//    output and frees `priv`; io61_close then closes `lower`.
+
+typedef struct io61_layerops {
+    ssize_t (*fill)(io61_file* f);
+    ssize_t (*write)(io61_file* f, const char* buf, size_t sz);
+    int (*flush)(io61_file* f);
+    int (*seek)(io61_file* f, off_t pos);
+    void (*arm_write)(io61_file* f);
+    void (*sync)(io61_file* f);
+    int (*close)(io61_file* f);
+} io61_layerops;
+
+struct io61_layer {
+    const io61_layerops* ops;
+    io61_file* lower;      /* file this layer reads or writes */
+    void* priv;            /* state private to the layer */
+};
+
+io61_file* io61_layeropen(io61_file* lower, const io61_layerops* ops,
+                          void* priv);
+
+// The io61 operations without their trace records. A layer applies
+// them to `lower`, so a trace shows only what its caller did.
+void io61_sync(io61_file* f);
+void io61_arm_write(io61_file* f);
+int io61_flushbuf(io61_file* f);
+int io61_seekbuf(io61_file* f, size_t pos);
+ssize_t io61_readbuf(io61_file* f, char* buf, size_t sz);
+ssize_t io61_viewbuf(io61_file* f, const char** ptr, size_t maxsz);
+ssize_t io61_writebuf(io61_file* f, const char* buf, size_t sz);
+ssize_t io61_writevbuf(io61_file* f, const struct iovec* iov, int iovcnt);
+
+#endif
@@ -0,0 +1,557 @@
+#include "io61.h"
+#include <errno.h>
+
+// Usage: ./io61sim [-p POLICIES] [-n NSLOTS] [-b SLOTSIZE] [-r MAXREADAHEAD]
+//                  [-v] TRACE...
+//    Replays io61 traces, as recorded by setting IO61_TRACE, against
+//    cache policies and reports how often each would hit and the read
+//    and write system calls it would make. POLICIES is a
+//    comma-separated list of:
+//
+//      single  one buffer of SLOTSIZE bytes, like the handout io61
+//      lru     NSLOTS slots, least recently used evicted
+//      arc     NSLOTS slots, Adaptive Replacement Cache
+//      seqra   lru, plus readahead of up to MAXREADAHEAD slots in one
+//              read when misses are sequential
+//
+//    The default is all four, with 32 slots of 32768 bytes and
+//    readahead of up to 8 slots. Each file has a cache of its own; a
+//    non-seekable file has a single slot. Writes are buffered with a
+//    dirty range, so only an O_RDWR file reads a block before writing
+//    into it. A dirty range is written when its block is evicted or
+//    flushed, one system call per run of adjacent ranges, or, in a
+//    file that is not O_RDWR, when a write to its block cannot join
+//    it. Repeated lookups of the
+//    block looked up last count as hits without touching the policy.
+//    With -v, every file is reported as well as the totals.
+
+enum { POL_SINGLE, POL_LRU, POL_ARC, POL_SEQRA, NPOLICIES };
+static const char* const policy_names[] = { "single", "lru", "arc", "seqra" };
+
+enum { L_T1, L_T2, L_B1, L_B2, NLISTS };   /* ARC lists; lru uses T1 */
+#define MAXFILES 65536
+#define MAXRUN 64          /* most blocks written by one system call */
+
+typedef struct sim_entry {
+    int64_t block;
+    int list;              /* L_T1, ..., or -1 if free */
+    size_t dlo, dhi;       /* dirty byte range, empty if dlo == dhi */
+    int prev, next;        /* neighbors in the list, MRU first */
+    int hnext;             /* next entry in the same hash bucket */
+} sim_entry;
+
+typedef struct sim_counters {
+    unsigned long long lookups;
+    unsigned long long hits;
+    unsigned long long reads;      /* read system calls */
+    unsigned long long writes;     /* write system calls */
+    unsigned long long rbytes;
+    unsigned long long wbytes;
+    unsigned long long seeks;
+} sim_counters;
+
+typedef struct sim_file {
+    int open;
+    int policy;
+    int mode;
+    int seekable;
+    int64_t size;          /* file size, or -1 if unknown */
+    size_t cap;            /* resident slots */
+    sim_entry* e;          /* 2 * cap entries */
+    int* buckets;
+    size_t nbuckets;
+    int head[NLISTS], tail[NLISTS];
+    size_t len[NLISTS];
+    int freelist;
+    size_t p;              /* ARC target size of T1 */
+    int64_t lastblock;     /* block of the previous lookup, or -1 */
+    int64_t lastmiss;      /* last block of the previous read miss */
+    size_t ra;             /* seqra readahead, in slots */
+    sim_counters n;
+} sim_file;
+
+static size_t nslots = 32;
+static size_t slotsize = 32768;
+static size_t maxreadahead = 8;
+
+
+// list_remove(f, i), list_push(f, i, l)
+//    Unlink entry `i` from its list; put it at the MRU end of list `l`.
+
+static void list_remove(sim_file* f, int i) {
+    sim_entry* x = &f->e[i];
+    if (x->prev >= 0)
+        f->e[x->prev].next = x->next;
+    else
+        f->head[x->list] = x->next;
+    if (x->next >= 0)
+        f->e[x->next].prev = x->prev;
+    else
+        f->tail[x->list] = x->prev;
+    --f->len[x->list];
+    x->list = -1;
+}
+
+static void list_push(sim_file* f, int i, int l) {
+    sim_entry* x = &f->e[i];
+    x->list = l;
+    x->prev = -1;
+    x->next = f->head[l];
+    if (f->head[l] >= 0)
+        f->e[f->head[l]].prev = i;
+    else
+        f->tail[l] = i;
+    f->head[l] = i;
+    ++f->len[l];
+}
+
+
+// hash_find(f, block), hash_insert(f, i), hash_remove(f, i)
+//    Maintain the table from block numbers to entries.
+
+static size_t hash_bucket(sim_file* f, int64_t block) {
+    return (size_t) (block * 0x9E3779B97F4A7C15ULL >> 17) & (f->nbuckets - 1);
+}
+
+static int hash_find(sim_file* f, int64_t block) {
+    int i = f->buckets[hash_bucket(f, block)];
+    while (i >= 0 && f->e[i].block != block)
+        i = f->e[i].hnext;
+    return i;
+}
+
+static void hash_insert(sim_file* f, int i) {
+    size_t b = hash_bucket(f, f->e[i].block);
+    f->e[i].hnext = f->buckets[b];
+    f->buckets[b] = i;
+}
+
+static void hash_remove(sim_file* f, int i) {
+    int* pp = &f->buckets[hash_bucket(f, f->e[i].block)];
+    while (*pp != i)
+        pp = &f->e[*pp].hnext;
+    *pp = f->e[i].hnext;
+}
+
+
+// file_init(f, policy, mode, seekable, size)
+//    Set up an empty cache for a newly opened file.
+
+static void file_init(sim_file* f, int policy, int mode, int seekable,
+                      int64_t size) {
+    memset(f, 0, sizeof(*f));
+    f->open = 1;
+    f->policy = policy;
+    f->mode = mode;
+    f->seekable = seekable;
+    f->size = size;
+    f->cap = policy == POL_SINGLE || !seekable ? 1 : nslots;
+    f->nbuckets = 1;
+    while (f->nbuckets < 4 * f->cap)
+        f->nbuckets *= 2;
+    f->e = (sim_entry*) malloc(sizeof(sim_entry) * 2 * f->cap);
+    f->buckets = (int*) malloc(sizeof(int) * f->nbuckets);
+    assert(f->e && f->buckets);
+    for (size_t b = 0; b < f->nbuckets; ++b)
+        f->buckets[b] = -1;
+    for (size_t i = 0; i < 2 * f->cap; ++i) {
+        f->e[i].list = -1;
+        f->e[i].next = i + 1 < 2 * f->cap ? (int) i + 1 : -1;
+    }
+    f->freelist = 0;
+    for (int l = 0; l < NLISTS; ++l)
+        f->head[l] = f->tail[l] = -1;
+    f->lastblock = f->lastmiss = -2;
+    f->ra = 1;
+}
+
+
+// block_bytes(f, block)
+//    Return how many bytes of `block` lie inside `f`.
+
+static size_t block_bytes(sim_file* f, int64_t block) {
+    int64_t start = block * (int64_t) slotsize;
+    if (f->size < 0 || start + (int64_t) slotsize <= f->size)
+        return slotsize;
+    return f->size > start ? f->size - start : 0;
+}
+
+
+// writeback(f, v, n)
+//    Count the writes that store the dirty ranges of entries `v[0..n)`,
+//    which are in block order, and clean them.
+
+static void writeback(sim_file* f, sim_entry** v, size_t n) {
+    for (size_t i = 0; i < n; ) {
+        size_t j = i + 1;
+        while (j < n && j - i < MAXRUN && v[j]->block == v[j - 1]->block + 1
+               && v[j - 1]->dhi == slotsize && v[j]->dlo == 0)
+            ++j;
+        ++f->n.writes;
+        for (size_t k = i; k < j; ++k) {
+            f->n.wbytes += v[k]->dhi - v[k]->dlo;
+            v[k]->dlo = v[k]->dhi = 0;
+        }
+        i = j;
+    }
+}
+
+
+// mark_dirty(f, i, lo, hi)
+//    Add bytes [lo, hi) of entry `i`'s block to its dirty range.
+
+static void mark_dirty(sim_file* f, int i, size_t lo, size_t hi) {
+    sim_entry* x = &f->e[i];
+    if (x->dlo != x->dhi && f->mode != O_RDWR && (lo > x->dhi || hi < x->dlo))
+        writeback(f, &x, 1);
+    if (x->dlo == x->dhi) {
+        x->dlo = lo;
+        x->dhi = hi;
+    } else {
+        x->dlo = lo < x->dlo ? lo : x->dlo;
+        x->dhi = hi > x->dhi ? hi : x->dhi;
+    }
+}
+
+
+// evict(f, i, ghost)
+//    Drop resident entry `i`, writing it first if dirty. Under ARC it
+//    moves to ghost list `ghost`; otherwise `ghost` is -1 and the entry
+//    is freed.
+
+static void evict(sim_file* f, int i, int ghost) {
+    if (f->e[i].dlo != f->e[i].dhi) {
+        sim_entry* x = &f->e[i];
+        writeback(f, &x, 1);
+    }
+    list_remove(f, i);
+    if (ghost >= 0)
+        list_push(f, i, ghost);
+    else {
+        hash_remove(f, i);
+        f->e[i].next = f->freelist;
+        f->freelist = i;
+    }
+}
+
+static void discard(sim_file* f, int i) {
+    list_remove(f, i);
+    hash_remove(f, i);
+    f->e[i].next = f->freelist;
+    f->freelist = i;
+}
+
+
+// arc_replace(f, in_b2)
+//    ARC's REPLACE step: evict from T1 or T2 to make room.
+
+static void arc_replace(sim_file* f, int in_b2) {
+    if (f->len[L_T1] + f->len[L_T2] < f->cap)
+        return;
+    if (f->len[L_T1] > 0
+        && (f->len[L_T1] > f->p || (in_b2 && f->len[L_T1] == f->p)))
+        evict(f, f->tail[L_T1], L_B1);
+    else
+        evict(f, f->tail[L_T2], L_B2);
+}
+
+
+// cache_insert(f, block)
+//    Make `block`, which is not resident, resident, evicting as the
+//    policy chooses. Returns its entry.
+
+static int cache_insert(sim_file* f, int64_t block) {
+    int i = hash_find(f, block);
+    if (f->policy != POL_ARC) {
+        if (f->len[L_T1] == f->cap)
+            evict(f, f->tail[L_T1], -1);
+    } else if (i >= 0 && f->e[i].list == L_B1) {
+        size_t d = f->len[L_B2] > f->len[L_B1] ? f->len[L_B2] / f->len[L_B1] : 1;
+        f->p = f->p + d < f->cap ? f->p + d : f->cap;
+        arc_replace(f, 0);
+        list_remove(f, i);
+        list_push(f, i, L_T2);
+        return i;
+    } else if (i >= 0 && f->e[i].list == L_B2) {
+        size_t d = f->len[L_B1] > f->len[L_B2] ? f->len[L_B1] / f->len[L_B2] : 1;
+        f->p = f->p > d ? f->p - d : 0;
+        arc_replace(f, 1);
+        list_remove(f, i);
+        list_push(f, i, L_T2);
+        return i;
+    } else if (f->len[L_T1] + f->len[L_B1] >= f->cap) {
+        if (f->len[L_T1] < f->cap) {
+            discard(f, f->tail[L_B1]);
+            arc_replace(f, 0);
+        } else
+            evict(f, f->tail[L_T1], -1);
+    } else {
+        size_t total = f->len[L_T1] + f->len[L_T2] + f->len[L_B1] + f->len[L_B2];
+        if (total >= f->cap) {
+            if (total >= 2 * f->cap)
+                discard(f, f->tail[L_B2]);
+            arc_replace(f, 0);
+        }
+    }
+    i = f->freelist;
+    assert(i >= 0);
+    f->freelist = f->e[i].next;
+    f->e[i].block = block;
+    f->e[i].dlo = f->e[i].dhi = 0;
+    hash_insert(f, i);
+    list_push(f, i, L_T1);
+    return i;
+}
+
+
+// cache_hit(f, block)
+//    Return `block`'s entry if it is resident, moving it as the policy
+//    does on a hit; otherwise return -1.
+
+static int cache_hit(sim_file* f, int64_t block) {
+    int i = hash_find(f, block);
+    if (i < 0 || (f->e[i].list != L_T1 && f->e[i].list != L_T2))
+        return -1;
+    list_remove(f, i);
+    list_push(f, i, f->policy == POL_ARC ? L_T2 : L_T1);
+    return i;
+}
+
+
+// lookup(f, block, lo, hi, writing)
+//    Look up `block` to read or write its bytes [lo, hi), counting the
+//    system calls a miss makes.
+
+static void lookup(sim_file* f, int64_t block, size_t lo, size_t hi,
+                   int writing) {
+    ++f->n.lookups;
+    int i;
+    if (block == f->lastblock) {
+        ++f->n.hits;
+        if (writing && (i = hash_find(f, block)) >= 0)
+            mark_dirty(f, i, lo, hi);
+        return;
+    }
+    f->lastblock = block;
+    if ((i = cache_hit(f, block)) >= 0) {
+        ++f->n.hits;
+        if (writing)
+            mark_dirty(f, i, lo, hi);
+        return;
+    }
+    size_t have = block_bytes(f, block);
+    if (writing) {
+        if (f->mode == O_RDWR && have > 0) {
+            ++f->n.reads;
+            f->n.rbytes += have;
+        }
+        i = cache_insert(f, block);
+        mark_dirty(f, i, lo, hi);
+        return;
+    }
+    // a read miss; at end of file it only learns that
+    ++f->n.reads;
+    if (have == 0)
+        return;
+    size_t n = 1;
+    if (f->policy == POL_SEQRA) {
+        if (block != f->lastmiss + 1)
+            f->ra = 1;
+        else if ((f->ra *= 2) > maxreadahead)
+            f->ra = maxreadahead;
+        if (f->ra > f->cap)
+            f->ra = f->cap;
+        while (n < f->ra && block_bytes(f, block + n) > 0
+               && hash_find(f, block + n) < 0)
+            ++n;
+    }
+    for (size_t k = 0; k < n; ++k) {
+        f->n.rbytes += block_bytes(f, block + k);
+        cache_insert(f, block + k);
+    }
+    // the requested block must stay most recent
+    if (n > 1)
+        cache_hit(f, block);
+    f->lastmiss = block + n - 1;
+}
+
+
+// flush(f)
+//    Write every dirty block of `f`.
+
+static void flush(sim_file* f) {
+    sim_entry** v = (sim_entry**) malloc(sizeof(sim_entry*) * f->cap);
+    size_t n = 0;
+    for (int l = L_T1; l <= L_T2; ++l)
+        for (int i = f->head[l]; i >= 0; i = f->e[i].next)
+            if (f->e[i].dlo != f->e[i].dhi)
+                v[n++] = &f->e[i];
+    // sort; there are few
+    for (size_t a = 1; a < n; ++a)
+        for (size_t b = a; b > 0 && v[b - 1]->block > v[b]->block; --b) {
+            sim_entry* t = v[b];
+            v[b] = v[b - 1];
+            v[b - 1] = t;
+        }
+    writeback(f, v, n);
+    free(v);
+}
+
+
+// replay(f, t)
+//    Apply the reads or writes of record `t` to `f`.
+
+static void replay(sim_file* f, const io61_trace_record* t) {
+    int writing = t->op == IO61_TRACE_WRITE;
+    if (t->flags & IO61_TRACE_SEEKED)
+        f->n.seeks += t->count;
+    for (uint32_t c = 0; c < t->count; ++c) {
+        int64_t off = t->off + (int64_t) c * t->stride;
+        int64_t len = t->size;
+        if (c + 1 == t->count && t->result >= 0 && t->result < len)
+            len = t->result;
+        if (len > 0 && writing && f->size >= 0 && off + len > f->size)
+            f->size = off + len;
+        int64_t b = off / (int64_t) slotsize;
+        int64_t e = (off + (len > 0 ? len : 1) - 1) / (int64_t) slotsize;
+        for (; b <= e; ++b) {
+            int64_t start = b * (int64_t) slotsize;
+            int64_t lo = off > start ? off - start : 0;
+            int64_t hi = off + len - start;
+            if (hi > (int64_t) slotsize)
+                hi = slotsize;
+            lookup(f, b, lo, hi > lo ? hi : lo, writing);
+        }
+    }
+}
+
+
+// simulate(filename, policies, verbose)
+//    Replay the trace in `filename` against each policy in the
+//    `policies` mask and print the results.
+
+static int simulate(const char* filename, int policies, int verbose) {
+    FILE* in = fopen(filename, "rb");
+    char magic[8];
+    if (!in || fread(magic, 1, 8, in) != 8
+        || memcmp(magic, IO61_TRACE_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s: %s\n", filename,
+                in ? "not an io61 trace" : strerror(errno));
+        if (in)
+            fclose(in);
+        return -1;
+    }
+
+    sim_file* files[NPOLICIES];
+    for (int p = 0; p < NPOLICIES; ++p)
+        files[p] = (sim_file*) calloc(MAXFILES, sizeof(sim_file));
+    int nfiles = 0;
+    unsigned long long nrecords = 0;
+    io61_trace_record t;
+    while (fread(&t, sizeof(t), 1, in) == 1) {
+        ++nrecords;
+        if (t.file >= nfiles)
+            nfiles = t.file + 1;
+        for (int p = 0; p < NPOLICIES; ++p) {
+            if (!(policies & (1 << p)))
+                continue;
+            sim_file* f = &files[p][t.file];
+            if (t.op == IO61_TRACE_OPEN || !f->e)
+                // a file opened before the trace began has unknown size
+                file_init(f, p,
+                          t.op == IO61_TRACE_OPEN ? t.flags & O_ACCMODE : O_RDWR,
+                          t.op == IO61_TRACE_OPEN ? !!(t.flags & IO61_TRACE_SEEKABLE) : 1,
+                          t.op == IO61_TRACE_OPEN ? t.size : -1);
+            if (t.op == IO61_TRACE_READ || t.op == IO61_TRACE_WRITE)
+                replay(f, &t);
+            else if (t.op == IO61_TRACE_SEEK)
+                ++f->n.seeks;
+            else if (t.op == IO61_TRACE_FLUSH)
+                flush(f);
+            else if (t.op == IO61_TRACE_CLOSE) {
+                flush(f);
+                f->open = 0;
+            }
+        }
+    }
+    fclose(in);
+
+    printf("%s: %llu records, %d files\n", filename, nrecords, nfiles);
+    printf("%-8s %5s %12s %12s %8s %10s %10s %12s %12s\n", "policy", "file",
+           "lookups", "hits", "hitrate", "reads", "writes", "rbytes", "wbytes");
+    for (int p = 0; p < NPOLICIES; ++p) {
+        if (!(policies & (1 << p)))
+            continue;
+        sim_counters sum;
+        memset(&sum, 0, sizeof(sum));
+        for (int i = 0; i < nfiles; ++i) {
+            sim_file* f = &files[p][i];
+            if (!f->e)
+                continue;
+            if (f->open)
+                flush(f);
+            if (verbose)
+                printf("%-8s %5d %12llu %12llu %8.4f %10llu %10llu %12llu %12llu\n",
+                       policy_names[p], i, f->n.lookups, f->n.hits,
+                       f->n.lookups ? (double) f->n.hits / f->n.lookups : 0.0,
+                       f->n.reads, f->n.writes, f->n.rbytes, f->n.wbytes);
+            sum.lookups += f->n.lookups;
+            sum.hits += f->n.hits;
+            sum.reads += f->n.reads;
+            sum.writes += f->n.writes;
+            sum.rbytes += f->n.rbytes;
+            sum.wbytes += f->n.wbytes;
+            free(f->e);
+            free(f->buckets);
+        }
+        printf("%-8s %5s %12llu %12llu %8.4f %10llu %10llu %12llu %12llu\n",
+               policy_names[p], "all", sum.lookups, sum.hits,
+               sum.lookups ? (double) sum.hits / sum.lookups : 0.0,
+               sum.reads, sum.writes, sum.rbytes, sum.wbytes);
+    }
+    for (int p = 0; p < NPOLICIES; ++p)
+        free(files[p]);
+    return 0;
+}
+
+
+int main(int argc, char** argv) {
+    int policies = (1 << NPOLICIES) - 1, verbose = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "p:n:b:r:v")) != -1)
+        switch (opt) {
+        case 'p':
+            policies = 0;
+            for (char* s = strtok(optarg, ","); s; s = strtok(NULL, ",")) {
+                int p = 0;
+                while (p < NPOLICIES && strcmp(s, policy_names[p]) != 0)
+                    ++p;
+                if (p == NPOLICIES) {
+                    fprintf(stderr, "io61sim: unknown policy %s\n", s);
+                    exit(1);
+                }
+                policies |= 1 << p;
+            }
+            break;
+        case 'n': nslots = strtoul(optarg, 0, 0); break;
+        case 'b': slotsize = strtoul(optarg, 0, 0); break;
+        case 'r': maxreadahead = strtoul(optarg, 0, 0); break;
+        case 'v': verbose = 1; break;
+        default:
+            goto usage;
+        }
+    if (optind == argc || nslots == 0 || slotsize == 0 || maxreadahead == 0) {
+    usage:
+        fprintf(stderr, "Usage: ./io61sim [-p POLICIES] [-n NSLOTS] [-b SLOTSIZE] [-r MAXREADAHEAD]\n"
+                "                 [-v] TRACE...\n");
+        exit(1);
+    }
+    int status = 0;
+    for (int i = optind; i < argc; ++i) {
+        if (i > optind)
+            printf("\n");
+        if (simulate(argv[i], policies, verbose) < 0)
+            status = 1;
+    }
+    return status;
+}
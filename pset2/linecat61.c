@@ -0,0 +1,69 @@
+#include "io61.h"
+
+// Usage: ./linecat61 [-c] [-l] [FILE]
+//    Copies the input FILE to standard output one line at a time, with
+//    io61_readline. With -c, each line is instead gathered with
+//    io61_readc into a buffer, the way a hand-written line reader does.
+//    With -l, prints only the number of lines, counted by skipping from
+//    newline to newline with io61_scan_until.
+
+int main(int argc, char** argv) {
+    // Parse arguments
+    int bychar = 0, count = 0;
+    while (argc >= 2) {
+        if (strcmp(argv[1], "-c") == 0) {
+            bychar = 1;
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-l") == 0) {
+            count = 1;
+            --argc, ++argv;
+        } else
+            break;
+    }
+
+    // Allocate buffer, open files
+    size_t bufsize = 256;
+    char* buf = malloc(bufsize);
+
+    const char* in_filename = argc >= 2 ? argv[1] : NULL;
+    io61_profile_begin();
+    io61_file* inf = io61_open_check(in_filename, O_RDONLY);
+    io61_file* outf = io61_fdopen(STDOUT_FILENO, O_WRONLY);
+
+    // Copy or count lines
+    size_t nlines = 0;
+    while (count) {
+        if (io61_scan_until(inf, '\n') <= 0)
+            break;
+        ++nlines;
+    }
+    while (!count && !bychar) {
+        const char* line;
+        size_t len;
+        if (io61_readline(inf, &line, &len) <= 0)
+            break;
+        io61_write(outf, line, len);
+    }
+    while (!count && bychar) {
+        size_t len = 0;
+        int ch = 0;
+        while (ch != '\n' && (ch = io61_readc(inf)) != EOF) {
+            if (len == bufsize) {
+                bufsize *= 2;
+                buf = realloc(buf, bufsize);
+            }
+            buf[len++] = ch;
+        }
+        if (len == 0)
+            break;
+        io61_write(outf, buf, len);
+    }
+    if (count) {
+        int n = snprintf(buf, bufsize, "%zu\n", nlines);
+        io61_write(outf, buf, n);
+    }
+
+    io61_close(inf);
+    io61_close(outf);
+    io61_profile_end();
+}
@@ -4,6 +4,26 @@
 #include <time.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <sys/uio.h>
+
+// Usage: ./pipeexchange61 [-i] [-s] [-v] [-d USEC] [-n ROUNDS]
+//    A requester and a responder process exchange batches of messages
+//    over a pair of sockets, ROUNDS times over (default 1). Normally
+//    each side flushes by hand: the requester after each batch, the
+//    responder after each reply. With -i, each side instead pairs its
+//    output with its input (io61_pair), so output is flushed only when
+//    a read would block; if the io61 version cannot pair, the hand
+//    flushes stay. With -d, output files also get a coalescing timer
+//    of USEC microseconds (io61_setdelay). With -s, each side reads and
+//    writes one O_RDWR socket through a single io61 file. With -v,
+//    messages are written with io61_writev, as an id and a body. The
+//    run takes at most 5 seconds.
+
+static int interactive = 0;
+static int shared = 0;
+static int vectored = 0;
+static unsigned long delay = 0;
+static int rounds = 1;
 
 struct message_set {
     int request_batch;
@@ -49,9 +69,46 @@ static size_t max_message_size(void) {
     return sz;
 }
 
+// send_message(outf, buf, sz)
+//    Write one message of size `sz` from `buf`.
+
+static void send_message(io61_file* outf, char* buf, size_t sz) {
+    ssize_t r;
+    if (vectored) {
+        struct iovec iov[2] = {
+            { buf, sizeof(size_t) },
+            { buf + sizeof(size_t), sz - sizeof(size_t) }
+        };
+        r = io61_writev(outf, iov, 2);
+    } else
+        r = io61_write(outf, buf, sz);
+    assert((size_t) r == sz);
+}
+
+// finish(outf, inf)
+//    Close one side's files.
+
+static void finish(io61_file* outf, io61_file* inf) {
+    if (inf != outf)
+        io61_close(inf);
+    io61_close(outf);
+    exit(0);
+}
+
+// setup(outf, inf)
+//    Apply the -i and -d options to one side's files. Returns 1 if the
+//    side must flush by hand.
+
+static int setup(io61_file* outf, io61_file* inf) {
+    if (delay)
+        (void) io61_setdelay(outf, delay);
+    return !interactive || io61_pair(inf, outf) < 0;
+}
+
 void requester(io61_file* outf, io61_file* inf) {
     size_t nmessages = sizeof(messages) / sizeof(messages[0]);
     size_t maxsz = max_message_size();
+    int flush = setup(outf, inf);
 
     char* buf = malloc(maxsz);
     memset(buf, 0, maxsz);
@@ -60,17 +117,19 @@ void requester(io61_file* outf, io61_file* inf) {
     size_t responseid = 0;
     size_t id;
 
-    for (size_t mindex = 0; mindex < nmessages; ++mindex) {
+    for (size_t k = 0; k < rounds * nmessages; ++k) {
+        size_t mindex = k % nmessages;
         const struct message_set* m = &messages[mindex];
         printf("requester: phase %zd/%zd\n", mindex, nmessages);
         for (int i = 0; i < m->request_batch; ++i) {
             memcpy(buf, &requestid, sizeof(size_t));
             ++requestid;
-            ssize_t r = io61_write(outf, buf, m->request_size);
-            assert((size_t) r == m->request_size);
+            send_message(outf, buf, m->request_size);
+        }
+        if (flush) {
+            int x = io61_flush(outf);
+            assert(x >= 0);
         }
-        int x = io61_flush(outf);
-        assert(x >= 0);
         for (int i = 0; i < m->request_batch; ++i) {
             ssize_t r = io61_read(inf, buf, m->response_size);
             assert((size_t) r == m->response_size);
@@ -81,9 +140,7 @@ void requester(io61_file* outf, io61_file* inf) {
     }
 
     printf("requester: done!\n");
-    io61_close(inf);
-    io61_close(outf);
-    exit(0);
+    finish(outf, inf);
 }
 
 void responder(io61_file* outf, io61_file* inf) {
@@ -91,38 +148,69 @@ void responder(io61_file* outf, io61_file* inf) {
     size_t maxsz = max_message_size();
     char* buf = malloc(maxsz);
     memset(buf, 0, maxsz);
+    int flush = setup(outf, inf);
 
-    for (size_t mindex = 0; mindex < nmessages; ++mindex) {
-        const struct message_set* m = &messages[mindex];
+    for (size_t k = 0; k < rounds * nmessages; ++k) {
+        const struct message_set* m = &messages[k % nmessages];
         for (int i = 0; i < m->request_batch; ++i) {
             ssize_t r = io61_read(inf, buf, m->request_size);
             assert((size_t) r == m->request_size);
-            r = io61_write(outf, buf, m->response_size);
-            assert((size_t) r == m->response_size);
-            int x = io61_flush(outf);
-            assert(x >= 0);
+            send_message(outf, buf, m->response_size);
+            if (flush) {
+                int x = io61_flush(outf);
+                assert(x >= 0);
+            }
         }
     }
 
-    io61_close(inf);
-    io61_close(outf);
-    exit(0);
+    finish(outf, inf);
 }
 
 int main(int argc, char** argv) {
-    (void) argc, (void) argv;
+    // Parse arguments
+    while (argc >= 2) {
+        if (strcmp(argv[1], "-i") == 0) {
+            interactive = 1;
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-s") == 0) {
+            shared = 1;
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-v") == 0) {
+            vectored = 1;
+            --argc, ++argv;
+        } else if (argc >= 3 && strcmp(argv[1], "-d") == 0) {
+            delay = strtoul(argv[2], 0, 0);
+            argc -= 2, argv += 2;
+        } else if (argc >= 3 && strcmp(argv[1], "-n") == 0) {
+            rounds = strtol(argv[2], 0, 0);
+            argc -= 2, argv += 2;
+        } else
+            break;
+    }
+    assert(rounds > 0);
 
-    // create a connected socket pair for communicating between processes
+    // create connected socket pairs for communicating between processes;
+    // a batch of large requests and replies needs more room in flight
+    // than a pipe holds
     int request_fds[2], response_fds[2];
-    int r1 = pipe(request_fds), r2 = pipe(response_fds);
+    int r1 = socketpair(AF_UNIX, SOCK_STREAM, 0, request_fds),
+        r2 = socketpair(AF_UNIX, SOCK_STREAM, 0, response_fds);
     if (r1 < 0 || r2 < 0) {
-        perror("pipe");
+        perror("socketpair");
         exit(1);
     }
+    fflush(stdout);
+    io61_profile_begin();
 
     // fork two children
     pid_t p1 = fork();
-    if (p1 == 0) {
+    if (p1 == 0 && shared) {
+        close(request_fds[0]);
+        close(response_fds[0]);
+        close(response_fds[1]);
+        io61_file* f = io61_fdopen(request_fds[1], O_RDWR);
+        requester(f, f);
+    } else if (p1 == 0) {
         close(request_fds[0]);
         close(response_fds[1]);
         requester(io61_fdopen(request_fds[1], O_WRONLY),
@@ -133,7 +221,13 @@ int main(int argc, char** argv) {
     }
 
     pid_t p2 = fork();
-    if (p2 == 0) {
+    if (p2 == 0 && shared) {
+        close(request_fds[1]);
+        close(response_fds[0]);
+        close(response_fds[1]);
+        io61_file* f = io61_fdopen(request_fds[0], O_RDWR);
+        responder(f, f);
+    } else if (p2 == 0) {
         close(request_fds[1]);
         close(response_fds[0]);
         responder(io61_fdopen(response_fds[1], O_WRONLY),
@@ -143,18 +237,32 @@ int main(int argc, char** argv) {
         exit(1);
     }
 
+    close(request_fds[0]);
+    close(request_fds[1]);
+    close(response_fds[0]);
+    close(response_fds[1]);
+
     time_t start_time = time(0);
+    int ok = 1;
     while ((p1 > 0 || p2 > 0) && time(0) < start_time + 5) {
         int status;
-        if (p1 > 0 && waitpid(p1, &status, WNOHANG) == p1)
+        if (p1 > 0 && waitpid(p1, &status, WNOHANG) == p1) {
             p1 = -1;            /* child1 has died */
-        if (p2 > 0 && waitpid(p2, &status, WNOHANG) == p2)
+            ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        }
+        if (p2 > 0 && waitpid(p2, &status, WNOHANG) == p2) {
             p2 = -1;            /* child2 has died */
+            ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        }
+        if (p1 > 0 || p2 > 0)
+            usleep(100);
     }
 
     if (p1 > 0)
         kill(p1, SIGKILL);
     if (p2 > 0)
         kill(p2, SIGKILL);
-    exit(p1 < 0 && p2 < 0 ? 0 : 1);
+    if (p1 < 0 && p2 < 0 && ok)
+        io61_profile_end();
+    exit(p1 < 0 && p2 < 0 && ok ? 0 : 1);
 }
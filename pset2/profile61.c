@@ -2,15 +2,82 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <errno.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
 
 // profile61.c
 //    These profile functions measure how much time and memory are used
 //    by your code. The io61_profile_end() function prints a simple
 //    report to standard error.
+//
+//    If the IO61_TRACE environment variable names a file,
+//    io61_profile_begin() also starts an io61 trace there, and
+//    io61_profile_end() closes it.
+//
+//    On Linux they also count hardware and software events with
+//    perf_event_open. A counter the kernel refuses, for instance
+//    because of perf_event_paranoid or a virtual machine without a PMU,
+//    is left out of the report.
 
 static struct timeval tv_begin;
 
+#ifdef __linux__
+static const struct {
+    const char* name;
+    unsigned type;
+    unsigned long long config;
+} perf_counters[] = {
+    { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "llc_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    { "ctxswitches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    { "pagefaults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS }
+};
+#define NPERF (sizeof(perf_counters) / sizeof(perf_counters[0]))
+static int perf_fds[NPERF];
+
+// perf_open(i)
+//    Open counter `i` for this process, disabled. Counts kernel work
+//    too if allowed. Returns a file descriptor or -1.
+
+static int perf_open(size_t i) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perf_counters[i].type;
+    attr.config = perf_counters[i].config;
+    attr.disabled = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+        | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0) {
+        attr.exclude_kernel = attr.exclude_hv = 1;
+        fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    // keep clear of the descriptors the test programs use
+    if (fd >= 0 && fd < 101) {
+        int nfd = fcntl(fd, F_DUPFD_CLOEXEC, 101);
+        close(fd);
+        fd = nfd;
+    }
+    return fd;
+}
+#endif
+
 void io61_profile_begin(void) {
+#ifdef __linux__
+    for (size_t i = 0; i < NPERF; ++i)
+        perf_fds[i] = perf_open(i);
+    for (size_t i = 0; i < NPERF; ++i)
+        if (perf_fds[i] >= 0)
+            ioctl(perf_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    const char* trace = getenv("IO61_TRACE");
+    if (trace && *trace && io61_trace_begin(trace) < 0)
+        fprintf(stderr, "IO61_TRACE %s: %s\n", trace, strerror(errno));
     int r = gettimeofday(&tv_begin, 0);
     assert(r >= 0);
 }
@@ -19,8 +86,14 @@ void io61_profile_end(void) {
     struct timeval tv_end;
     struct rusage usage, cusage;
 
+#ifdef __linux__
+    for (size_t i = 0; i < NPERF; ++i)
+        if (perf_fds[i] >= 0)
+            ioctl(perf_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+#endif
     int r = gettimeofday(&tv_end, 0);
     assert(r >= 0);
+    (void) io61_trace_end();
     r = getrusage(RUSAGE_SELF, &usage);
     assert(r >= 0);
     r = getrusage(RUSAGE_CHILDREN, &cusage);
@@ -30,12 +103,33 @@ void io61_profile_end(void) {
     timeradd(&usage.ru_utime, &cusage.ru_utime, &usage.ru_utime);
     timeradd(&usage.ru_stime, &cusage.ru_stime, &usage.ru_stime);
 
-    char buf[1000];
-    int len = sprintf(buf, "{\"time\":%ld.%06ld, \"utime\":%ld.%06ld, \"stime\":%ld.%06ld, \"maxrss\":%ld}\n",
+    char buf[8192];
+    int len = sprintf(buf, "{\"time\":%ld.%06ld, \"utime\":%ld.%06ld, \"stime\":%ld.%06ld, \"maxrss\":%ld",
                       tv_end.tv_sec, (long) tv_end.tv_usec,
                       usage.ru_utime.tv_sec, (long) usage.ru_utime.tv_usec,
                       usage.ru_stime.tv_sec, (long) usage.ru_stime.tv_usec,
                       usage.ru_maxrss + cusage.ru_maxrss);
+#ifdef __linux__
+    for (size_t i = 0; i < NPERF; ++i) {
+        // value, time enabled, time running; scale up if the kernel
+        // multiplexed the counter
+        unsigned long long v[3];
+        if (perf_fds[i] < 0)
+            continue;
+        if (read(perf_fds[i], v, sizeof(v)) == (ssize_t) sizeof(v)
+            && v[2] > 0) {
+            if (v[2] < v[1])
+                v[0] = (unsigned long long) ((double) v[0] * v[1] / v[2]);
+            len += sprintf(buf + len, ", \"%s\":%llu",
+                           perf_counters[i].name, v[0]);
+        }
+        close(perf_fds[i]);
+        perf_fds[i] = -1;
+    }
+#endif
+    // append the io61 implementation's own counters, if it keeps any
+    len += io61_profile_stats(buf + len, sizeof(buf) - len - 2);
+    len += sprintf(buf + len, "}\n");
 
     // Print the report to file descriptor 100 if it's available. Our
     // `check.pl` test harness uses this file descriptor.
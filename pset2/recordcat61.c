@@ -0,0 +1,75 @@
+#include "io61.h"
+
+// Usage: ./recordcat61 [-b RECORDSIZE] [-v] [FILE]
+//    Copies the input FILE to standard output as records of RECORDSIZE
+//    characters, each preceded by a header line giving its length in
+//    hex. Default RECORDSIZE is 64. Each record is read into two
+//    separate halves. With -v, the halves are read with one io61_readv
+//    and the header and halves are written with one io61_writev;
+//    otherwise each piece is read and written on its own.
+
+int main(int argc, char** argv) {
+    // Parse arguments
+    size_t recordsize = 64;
+    int vectored = 0;
+    while (argc >= 2) {
+        if (argc >= 3 && strcmp(argv[1], "-b") == 0) {
+            recordsize = strtoul(argv[2], 0, 0);
+            argc -= 2, argv += 2;
+        } else if (strcmp(argv[1], "-v") == 0) {
+            vectored = 1;
+            --argc, ++argv;
+        } else
+            break;
+    }
+
+    // Allocate buffers, open files
+    assert(recordsize > 0);
+    size_t half = recordsize / 2;
+    char* first = malloc(half ? half : 1);
+    char* second = malloc(recordsize - half);
+    char header[32];
+
+    const char* in_filename = argc >= 2 ? argv[1] : NULL;
+    io61_profile_begin();
+    io61_file* inf = io61_open_check(in_filename, O_RDONLY);
+    io61_file* outf = io61_fdopen(STDOUT_FILENO, O_WRONLY);
+
+    // Copy records
+    while (1) {
+        ssize_t amount;
+        if (vectored) {
+            struct iovec iov[2] = {
+                { first, half }, { second, recordsize - half }
+            };
+            amount = io61_readv(inf, iov, 2);
+        } else {
+            amount = io61_read(inf, first, half);
+            if (amount == (ssize_t) half) {
+                ssize_t r = io61_read(inf, second, recordsize - half);
+                if (r > 0)
+                    amount += r;
+            }
+        }
+        if (amount <= 0)
+            break;
+
+        size_t n1 = (size_t) amount < half ? (size_t) amount : half;
+        size_t hlen = snprintf(header, sizeof(header), "%08zx\n",
+                               (size_t) amount);
+        if (vectored) {
+            struct iovec iov[3] = {
+                { header, hlen }, { first, n1 }, { second, amount - n1 }
+            };
+            io61_writev(outf, iov, 3);
+        } else {
+            io61_write(outf, header, hlen);
+            io61_write(outf, first, n1);
+            io61_write(outf, second, amount - n1);
+        }
+    }
+
+    io61_close(inf);
+    io61_close(outf);
+    io61_profile_end();
+}
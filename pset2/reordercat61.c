@@ -1,13 +1,15 @@
 #include "io61.h"
 
-// Usage: ./reordercat61 [-b BLOCKSIZE] [-S SEED] [FILE]
+// Usage: ./reordercat61 [-b BLOCKSIZE] [-S SEED] [-Z] [FILE]
 //    Copies the input FILE to standard output in blocks. The blocks
 //    are transferred in random order, but the resulting output file
-//    should be the same as the input. Default BLOCKSIZE is 4096.
+//    should be the same as the input. Default BLOCKSIZE is 4096. With
+//    -Z, FILE is a compressed frame, read through io61_open_lz.
 
 int main(int argc, char** argv) {
     // Parse arguments
     size_t blocksize = 4096;
+    int lz = 0;
     srandom(83419);
     while (argc >= 3) {
         if (strcmp(argv[1], "-b") == 0) {
@@ -16,6 +18,9 @@ int main(int argc, char** argv) {
         } else if (strcmp(argv[1], "-S") == 0) {
             srandom(strtoul(argv[2], 0, 0));
             argc -= 2, argv += 2;
+        } else if (strcmp(argv[1], "-Z") == 0) {
+            lz = 1;
+            --argc, ++argv;
         } else
             break;
     }
@@ -27,6 +32,10 @@ int main(int argc, char** argv) {
     const char* in_filename = argc >= 2 ? argv[1] : NULL;
     io61_profile_begin();
     io61_file* inf = io61_open_check(in_filename, O_RDONLY);
+    if (lz && !(inf = io61_open_lz(inf))) {
+        fprintf(stderr, "reordercat61: input is not a compressed frame\n");
+        exit(1);
+    }
 
     size_t inf_size = io61_filesize(inf);
     if ((ssize_t) inf_size < 0) {
@@ -1,4 +1,5 @@
 #include "io61.h"
+#include "codec61.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <limits.h>
@@ -12,21 +13,34 @@
 //    Data structure for io61 file wrappers.
 
 struct io61_file {
+    io61_cursor c;         /* always empty: readc and writec go out of line */
     int fd;
+    int mode;
+    char view[4096];       /* holds bytes returned by io61_read_view */
+    char* line;            /* holds the line returned by io61_readline */
+    size_t linecap;        /* bytes allocated at `line` */
+    io61_file* lower;      /* file a CRC32C layer reads or writes, or NULL */
+    uint32_t crc;          /* CRC32C of the bytes passed through */
+    io61_lzframe* lz;      /* compression layer's frame, or NULL */
 };
 
 
 // io61_fdopen(fd, mode)
 //    Return a new io61_file that reads from and/or writes to the given
-//    file descriptor `fd`. `mode` is either O_RDONLY for a read-only file
-//    or O_WRONLY for a write-only file. You need not support read/write
-//    files.
+//    file descriptor `fd`. `mode` is O_RDONLY for a read-only file,
+//    O_WRONLY for a write-only file, or O_RDWR for a file that is both
+//    read and written.
 
 io61_file* io61_fdopen(int fd, int mode) {
     assert(fd >= 0);
     io61_file* f = (io61_file*) malloc(sizeof(io61_file));
+    memset(&f->c, 0, sizeof(f->c));
     f->fd = fd;
-    (void) mode;
+    f->line = NULL;
+    f->linecap = 0;
+    f->mode = mode & O_ACCMODE;
+    f->lower = NULL;
+    f->lz = NULL;
     return f;
 }
 
@@ -35,33 +49,88 @@ io61_file* io61_fdopen(int fd, int mode) {
 //    Close the io61_file `f`.
 
 int io61_close(io61_file* f) {
-    int r = close(f->fd);
+    int r;
+    if (f->lz)
+        r = io61_lzframe_close(f->lz);
+    else
+        r = f->lower ? io61_close(f->lower) : close(f->fd);
+    free(f->line);
     free(f);
     return r;
 }
 
 
-// io61_readc(f)
+// io61_setcache(f, nslots, slotsize)
+//    This version has no cache, so this does nothing.
+
+int io61_setcache(io61_file* f, size_t nslots, size_t slotsize) {
+    (void) f, (void) nslots, (void) slotsize;
+    return 0;
+}
+
+
+// io61_setpool(limit)
+//    This version has no shared pool.
+
+int io61_setpool(size_t limit) {
+    return limit == 0 ? -1 : 0;
+}
+
+
+// io61_pair(inf, outf)
+//    This version buffers no output, so nothing waits for a read.
+
+int io61_pair(io61_file* inf, io61_file* outf) {
+    (void) inf, (void) outf;
+    return 0;
+}
+
+
+// io61_setdelay(f, usec)
+//    This version buffers no output, so nothing waits.
+
+int io61_setdelay(io61_file* f, unsigned long usec) {
+    (void) f, (void) usec;
+    return 0;
+}
+
+
+// io61_readc_slow(f)
 //    Read a single (unsigned) character from `f` and return it. Returns EOF
-//    (which is -1) on error or end-of-file.
+//    (which is -1) on error or end-of-file. Called by io61_readc.
 
-int io61_readc(io61_file* f) {
+int io61_readc_slow(io61_file* f) {
     unsigned char buf[1];
-    if (read(f->fd, buf, 1) == 1)
+    if (f->lz)
+        return io61_lzframe_read(f->lz, (char*) buf, 1) == 1 ? buf[0] : EOF;
+    else if (f->lower) {
+        int ch = io61_readc(f->lower);
+        buf[0] = ch;
+        if (ch != EOF)
+            f->crc = io61_crc32c_update(f->crc, buf, 1);
+        return ch;
+    } else if (read(f->fd, buf, 1) == 1)
         return buf[0];
     else
         return EOF;
 }
 
 
-// io61_writec(f)
+// io61_writec_slow(f)
 //    Write a single character `ch` to `f`. Returns 0 on success or
-//    -1 on error.
+//    -1 on error. Called by io61_writec.
 
-int io61_writec(io61_file* f, int ch) {
+int io61_writec_slow(io61_file* f, int ch) {
     unsigned char buf[1];
     buf[0] = ch;
-    if (write(f->fd, buf, 1) == 1)
+    if (f->lz)
+        return io61_lzframe_write(f->lz, (char*) buf, 1) == 1 ? 0 : -1;
+    else if (f->lower) {
+        if (io61_writec(f->lower, ch) < 0)
+            return -1;
+        f->crc = io61_crc32c_update(f->crc, buf, 1);
+        return 0;
+    } else if (write(f->fd, buf, 1) == 1)
         return 0;
     else
         return -1;
@@ -72,8 +141,7 @@ int io61_writec(io61_file* f, int ch) {
 //    Forces a write of any `f` buffers that contain data.
 
 int io61_flush(io61_file* f) {
-    (void) f;
-    return 0;
+    return f->lz ? io61_lzframe_flush(f->lz) : 0;
 }
 
 
@@ -99,6 +167,61 @@ ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
 }
 
 
+// io61_read_view(f, ptr, maxsz)
+//    Read up to `maxsz` characters from `f` and set `*ptr` to point at
+//    them. This version has no buffer to point into, so it copies them
+//    into `f->view`, which holds them until the next call.
+
+ssize_t io61_read_view(io61_file* f, const char** ptr, size_t maxsz) {
+    if (maxsz > sizeof(f->view))
+        maxsz = sizeof(f->view);
+    *ptr = f->view;
+    return io61_read(f, f->view, maxsz);
+}
+
+
+// io61_readline(f, ptr, len)
+//    Read characters from `f` through the next newline, or to
+//    end-of-file, into `f->line`, and set `*ptr` and `*len` to them.
+//    Returns their number, 0 at end-of-file, or -1 on error.
+
+ssize_t io61_readline(io61_file* f, const char** ptr, size_t* len) {
+    size_t n = 0;
+    int ch;
+    while ((ch = io61_readc(f)) != EOF) {
+        if (n == f->linecap) {
+            size_t cap = f->linecap ? 2 * f->linecap : 256;
+            char* line = (char*) realloc(f->line, cap);
+            if (!line)
+                return -1;
+            f->line = line;
+            f->linecap = cap;
+        }
+        f->line[n++] = ch;
+        if (ch == '\n')
+            break;
+    }
+    *ptr = f->line;
+    *len = n;
+    return n;
+}
+
+
+// io61_scan_until(f, byte)
+//    Skip the characters of `f` through the next `byte`, or to
+//    end-of-file. Returns the number skipped, 0 at end-of-file.
+
+ssize_t io61_scan_until(io61_file* f, int byte) {
+    size_t n = 0;
+    int ch;
+    while ((ch = io61_readc(f)) != EOF) {
+        ++n;
+        if (ch == (unsigned char) byte)
+            break;
+    }
+    return n;
+}
+
 // io61_write(f, buf, sz)
 //    Write `sz` characters from `buf` to `f`. Returns the number of
 //    characters written on success; normally this is `sz`. Returns -1 if
@@ -118,11 +241,135 @@ ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
 }
 
 
+// io61_readv(f, iov, iovcnt)
+//    Read from `f` into the `iovcnt` buffers of `iov` in order. Returns
+//    the total number read, short only at end-of-file, or -1 if an
+//    error occurred before any were read.
+
+ssize_t io61_readv(io61_file* f, const struct iovec* iov, int iovcnt) {
+    size_t nread = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        ssize_t r = io61_read(f, (char*) iov[i].iov_base, iov[i].iov_len);
+        if (r < 0)
+            return nread ? (ssize_t) nread : -1;
+        nread += r;
+        if ((size_t) r < iov[i].iov_len)
+            break;
+    }
+    return nread;
+}
+
+
+// io61_writev(f, iov, iovcnt)
+//    Write the `iovcnt` buffers of `iov` to `f` in order. Returns the
+//    total number written, or -1 if an error occurred before any were
+//    written.
+
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt) {
+    size_t nwritten = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        ssize_t r = io61_write(f, (const char*) iov[i].iov_base,
+                               iov[i].iov_len);
+        if (r < 0)
+            return nwritten ? (ssize_t) nwritten : -1;
+        nwritten += r;
+        if ((size_t) r < iov[i].iov_len)
+            break;
+    }
+    return nwritten;
+}
+
+
+// io61_copy(inf, outf, sz)
+//    Copy up to `sz` characters from `inf` to `outf`. Returns the number
+//    of characters copied, or -1 if an error occurred before any were.
+//    This version always copies through a buffer.
+
+ssize_t io61_copy(io61_file* inf, io61_file* outf, size_t sz) {
+    char buf[BUFSIZ];
+    size_t ncopied = 0;
+    while (ncopied < sz) {
+        size_t n = sz - ncopied < sizeof(buf) ? sz - ncopied : sizeof(buf);
+        ssize_t r = io61_read(inf, buf, n);
+        if (r <= 0)
+            return ncopied || r == 0 ? (ssize_t) ncopied : -1;
+        ssize_t w = io61_write(outf, buf, r);
+        if (w > 0)
+            ncopied += w;
+        if (w < r)
+            return ncopied ? (ssize_t) ncopied : -1;
+    }
+    return ncopied;
+}
+
+
+// io61_pcopy(inf, outf, sz, nthreads, progress)
+//    This version copies in order on one thread, with io61_copy, and
+//    keeps no progress file.
+
+ssize_t io61_pcopy(io61_file* inf, io61_file* outf, size_t sz,
+                   int nthreads, const char* progress) {
+    (void) nthreads, (void) progress;
+    return io61_copy(inf, outf, sz);
+}
+
+// io61_open_crc32c(lower)
+//    Return a layer over `lower` that checksums the bytes read or
+//    written through it. Closing the layer closes `lower`.
+
+io61_file* io61_open_crc32c(io61_file* lower) {
+    io61_file* f = (io61_file*) calloc(1, sizeof(io61_file));
+    if (f) {
+        f->fd = -1;
+        f->mode = lower->mode;
+        f->lower = lower;
+    }
+    return f;
+}
+
+
+// io61_crc32c(f)
+//    Return the CRC32C of the bytes that have passed through the
+//    CRC32C layer `f`.
+
+uint32_t io61_crc32c(io61_file* f) {
+    assert(f->lower);
+    return f->crc;
+}
+
+
+// io61_open_lz(lower)
+//    Return a layer over `lower` that compresses the bytes written
+//    through it, or decompresses the bytes read, a byte at a time
+//    through codec61.c. Closing the layer closes `lower`. Returns NULL
+//    on error.
+
+io61_file* io61_open_lz(io61_file* lower) {
+    if (lower->mode == O_RDWR)
+        return NULL;
+    io61_file* f = (io61_file*) calloc(1, sizeof(io61_file));
+    if (f) {
+        f->fd = -1;
+        f->mode = lower->mode;
+        f->lower = lower;
+        f->lz = io61_lzframe_open(lower, lower->mode == O_WRONLY);
+    }
+    if (f && !f->lz) {
+        free(f);
+        return NULL;
+    }
+    return f;
+}
+
 // io61_seek(f, pos)
 //    Change the file pointer for file `f` to `pos` bytes into the file.
 //    Returns 0 on success and -1 on failure.
 
 int io61_seek(io61_file* f, size_t pos) {
+    if (f->lz)
+        return io61_lzframe_seek(f->lz, pos);
+    else if (f->lower)
+        return io61_seek(f->lower, pos);
     off_t r = lseek(f->fd, (off_t) pos, SEEK_SET);
     if (r != (off_t) -1)
         return 0;
@@ -131,6 +378,29 @@ int io61_seek(io61_file* f, size_t pos) {
 }
 
 
+// io61_trace_begin(filename), io61_trace_end()
+//    This version does not trace.
+
+int io61_trace_begin(const char* filename) {
+    (void) filename;
+    errno = ENOSYS;
+    return -1;
+}
+
+int io61_trace_end(void) {
+    return 0;
+}
+
+
+// io61_profile_stats(buf, sz)
+//    This version keeps no statistics.
+
+size_t io61_profile_stats(char* buf, size_t sz) {
+    (void) buf, (void) sz;
+    return 0;
+}
+
+
 // You should not need to change either of these functions.
 
 // io61_open_check(filename, mode)
@@ -142,8 +412,8 @@ int io61_seek(io61_file* f, size_t pos) {
 io61_file* io61_open_check(const char* filename, int mode) {
     int fd;
     if (filename)
-        fd = open(filename, mode);
-    else if (mode == O_RDONLY)
+        fd = open(filename, mode & ~IO61_FLAGS);
+    else if ((mode & O_ACCMODE) == O_RDONLY)
         fd = STDIN_FILENO;
     else
         fd = STDOUT_FILENO;
@@ -160,6 +430,10 @@ io61_file* io61_open_check(const char* filename, int mode) {
 //    file (for instance, if it is a pipe).
 
 ssize_t io61_filesize(io61_file* f) {
+    if (f->lz)
+        return io61_lzframe_size(f->lz);
+    else if (f->lower)
+        return io61_filesize(f->lower);
     struct stat s;
     int r = fstat(f->fd, &s);
     if (r >= 0 && S_ISREG(s.st_mode) && s.st_size <= SSIZE_MAX)
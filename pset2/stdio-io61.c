@@ -1,4 +1,6 @@
+#define _GNU_SOURCE 1      /* for fopencookie */
 #include "io61.h"
+#include "codec61.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <limits.h>
@@ -13,49 +15,135 @@
 //    Data structure for io61 file wrappers.
 
 struct io61_file {
+    io61_cursor c;         /* always empty: readc and writec go out of line */
     FILE* f;
+    int writing;           /* nonzero if the last operation was a write */
+    FILE* other;           /* stream for the other direction of an
+                              unseekable O_RDWR file, or NULL */
+    char view[BUFSIZ];     /* holds bytes returned by io61_read_view */
+    char* line;            /* holds the line returned by io61_readline */
+    size_t linecap;        /* bytes allocated at `line` */
+    struct io61_crccookie* crc;  /* CRC32C layer state, or NULL */
+    io61_lzframe* lz;      /* compression layer's frame, or NULL */
 };
 
 
 // io61_fdopen(fd, mode)
 //    Return a new io61_file that reads from and/or writes to the given
-//    file descriptor `fd`. `mode` is either O_RDONLY for a read-only file
-//    or O_WRONLY for a write-only file. You need not support read/write
-//    files.
+//    file descriptor `fd`. `mode` is O_RDONLY for a read-only file,
+//    O_WRONLY for a write-only file, or O_RDWR for a file that is both
+//    read and written.
 
 io61_file* io61_fdopen(int fd, int mode) {
     assert(fd >= 0);
     io61_file* f = (io61_file*) malloc(sizeof(io61_file));
-    f->f = fdopen(fd, mode == O_RDONLY ? "r" : "w");
+    mode &= O_ACCMODE;
+    memset(&f->c, 0, sizeof(f->c));
+    f->f = fdopen(fd, mode == O_RDONLY ? "r" : mode == O_WRONLY ? "w" : "r+");
+    f->writing = mode == O_WRONLY;
+    f->other = NULL;
+    if (mode == O_RDWR && lseek(fd, 0, SEEK_CUR) < 0) {
+        int wfd = dup(fd);
+        f->other = wfd >= 0 ? fdopen(wfd, "w") : NULL;
+    }
+    f->line = NULL;
+    f->linecap = 0;
+    f->crc = NULL;
+    f->lz = NULL;
     return f;
 }
 
 
+// io61_turn(f, writing)
+//    Prepare `f` for a read (`writing == 0`) or a write. stdio requires
+//    a flush or seek between output and input on an update stream; a
+//    socket or pipe cannot seek, so it swaps in its other stream.
+
+static void io61_turn(io61_file* f, int writing) {
+    if (writing != f->writing && f->other) {
+        if (!writing)
+            (void) fflush(f->f);
+        FILE* x = f->f;
+        f->f = f->other;
+        f->other = x;
+        f->writing = writing;
+    } else if (writing != f->writing) {
+        if (writing)
+            (void) fseek(f->f, 0, SEEK_CUR);
+        else
+            (void) fflush(f->f);
+        f->writing = writing;
+    }
+}
+
+
 // io61_close(f)
 //    Close the io61_file `f`.
 
 int io61_close(io61_file* f) {
     io61_flush(f);
     int r = fclose(f->f);
+    if (f->other && fclose(f->other) != 0)
+        r = EOF;
+    free(f->line);
     free(f);
     return r;
 }
 
 
-// io61_readc(f)
+// io61_setcache(f, nslots, slotsize)
+//    Set the buffer size of `f` to `nslots * slotsize` bytes.
+
+int io61_setcache(io61_file* f, size_t nslots, size_t slotsize) {
+    if (f->other && setvbuf(f->other, NULL, _IOFBF, nslots * slotsize) != 0)
+        return -1;
+    return setvbuf(f->f, NULL, _IOFBF, nslots * slotsize) == 0 ? 0 : -1;
+}
+
+
+// io61_setpool(limit)
+//    This version has no shared pool.
+
+int io61_setpool(size_t limit) {
+    return limit == 0 ? -1 : 0;
+}
+
+
+// io61_pair(inf, outf)
+//    This version cannot tell when a read would block, so it does not
+//    support pairing.
+
+int io61_pair(io61_file* inf, io61_file* outf) {
+    (void) inf, (void) outf;
+    return -1;
+}
+
+
+// io61_setdelay(f, usec)
+//    This version does not support an output timer.
+
+int io61_setdelay(io61_file* f, unsigned long usec) {
+    (void) f, (void) usec;
+    return -1;
+}
+
+
+// io61_readc_slow(f)
 //    Read a single (unsigned) character from `f` and return it. Returns EOF
-//    (which is -1) on error or end-of-file.
+//    (which is -1) on error or end-of-file. Called by io61_readc.
 
-int io61_readc(io61_file* f) {
+int io61_readc_slow(io61_file* f) {
+    io61_turn(f, 0);
     return fgetc(f->f);
 }
 
 
-// io61_writec(f)
+// io61_writec_slow(f)
 //    Write a single character `ch` to `f`. Returns 0 on success or
-//    -1 on error.
+//    -1 on error. Called by io61_writec.
 
-int io61_writec(io61_file* f, int ch) {
+int io61_writec_slow(io61_file* f, int ch) {
+    io61_turn(f, 1);
     return fputc(ch, f->f);
 }
 
@@ -64,7 +152,10 @@ int io61_writec(io61_file* f, int ch) {
 //    Forces a write of any `f` buffers that contain data.
 
 int io61_flush(io61_file* f) {
-    return fflush(f->f);
+    int r = fflush(f->other && !f->writing ? f->other : f->f);
+    if (f->lz && io61_lzframe_flush(f->lz) < 0)
+        r = EOF;
+    return r;
 }
 
 
@@ -75,6 +166,7 @@ int io61_flush(io61_file* f) {
 //    -1 an error occurred before any characters were read.
 
 ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
+    io61_turn(f, 0);
     size_t n = fread(buf, 1, sz, f->f);
     if (n)
         return (ssize_t) n;
@@ -85,12 +177,51 @@ ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
 }
 
 
+// io61_read_view(f, ptr, maxsz)
+//    Read up to `maxsz` characters from `f` and set `*ptr` to point at
+//    them. This version has no buffer to point into, so it copies them
+//    into `f->view`, which holds them until the next call.
+
+ssize_t io61_read_view(io61_file* f, const char** ptr, size_t maxsz) {
+    if (maxsz > sizeof(f->view))
+        maxsz = sizeof(f->view);
+    *ptr = f->view;
+    return io61_read(f, f->view, maxsz);
+}
+
+
+// io61_readline(f, ptr, len)
+//    Read characters from `f` through the next newline, or to
+//    end-of-file, with getline, and set `*ptr` and `*len` to them.
+//    Returns their number, 0 at end-of-file, or -1 on error.
+
+ssize_t io61_readline(io61_file* f, const char** ptr, size_t* len) {
+    io61_turn(f, 0);
+    ssize_t n = getline(&f->line, &f->linecap, f->f);
+    *ptr = f->line;
+    *len = n > 0 ? n : 0;
+    return n >= 0 ? n : (feof(f->f) ? 0 : -1);
+}
+
+
+// io61_scan_until(f, byte)
+//    Skip the characters of `f` through the next `byte`, or to
+//    end-of-file. Returns the number skipped, 0 at end-of-file, or -1
+//    on error.
+
+ssize_t io61_scan_until(io61_file* f, int byte) {
+    io61_turn(f, 0);
+    ssize_t n = getdelim(&f->line, &f->linecap, byte, f->f);
+    return n >= 0 ? n : (feof(f->f) ? 0 : -1);
+}
+
 // io61_write(f, buf, sz)
 //    Write `sz` characters from `buf` to `f`. Returns the number of
 //    characters written on success; normally this is `sz`. Returns -1 if
 //    an error occurred before any characters were written.
 
 ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
+    io61_turn(f, 1);
     size_t n = fwrite(buf, 1, sz, f->f);
     if (n)
         return (ssize_t) n;
@@ -101,6 +232,212 @@ ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
 }
 
 
+// io61_readv(f, iov, iovcnt)
+//    Read from `f` into the `iovcnt` buffers of `iov` in order. Returns
+//    the total number read, short only at end-of-file, or -1 if an
+//    error occurred before any were read.
+
+ssize_t io61_readv(io61_file* f, const struct iovec* iov, int iovcnt) {
+    size_t nread = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        ssize_t r = io61_read(f, (char*) iov[i].iov_base, iov[i].iov_len);
+        if (r < 0)
+            return nread ? (ssize_t) nread : -1;
+        nread += r;
+        if ((size_t) r < iov[i].iov_len)
+            break;
+    }
+    return nread;
+}
+
+
+// io61_writev(f, iov, iovcnt)
+//    Write the `iovcnt` buffers of `iov` to `f` in order. Returns the
+//    total number written, or -1 if an error occurred before any were
+//    written.
+
+ssize_t io61_writev(io61_file* f, const struct iovec* iov, int iovcnt) {
+    size_t nwritten = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        ssize_t r = io61_write(f, (const char*) iov[i].iov_base,
+                               iov[i].iov_len);
+        if (r < 0)
+            return nwritten ? (ssize_t) nwritten : -1;
+        nwritten += r;
+        if ((size_t) r < iov[i].iov_len)
+            break;
+    }
+    return nwritten;
+}
+
+
+// io61_copy(inf, outf, sz)
+//    Copy up to `sz` characters from `inf` to `outf`. Returns the number
+//    of characters copied, or -1 if an error occurred before any were.
+//    This version always copies through a buffer.
+
+ssize_t io61_copy(io61_file* inf, io61_file* outf, size_t sz) {
+    char buf[BUFSIZ];
+    size_t ncopied = 0;
+    while (ncopied < sz) {
+        size_t n = sz - ncopied < sizeof(buf) ? sz - ncopied : sizeof(buf);
+        ssize_t r = io61_read(inf, buf, n);
+        if (r <= 0)
+            return ncopied || r == 0 ? (ssize_t) ncopied : -1;
+        ssize_t w = io61_write(outf, buf, r);
+        if (w > 0)
+            ncopied += w;
+        if (w < r)
+            return ncopied ? (ssize_t) ncopied : -1;
+    }
+    return ncopied;
+}
+
+
+// io61_pcopy(inf, outf, sz, nthreads, progress)
+//    This version copies in order on one thread, with io61_copy, and
+//    keeps no progress file.
+
+ssize_t io61_pcopy(io61_file* inf, io61_file* outf, size_t sz,
+                   int nthreads, const char* progress) {
+    (void) nthreads, (void) progress;
+    return io61_copy(inf, outf, sz);
+}
+
+// A CRC32C layer is a stdio stream whose cookie reads or writes the
+// io61_file below it and checksums the bytes on the way.
+
+typedef struct io61_crccookie {
+    io61_file* lower;
+    uint32_t crc;
+} io61_crccookie;
+
+static ssize_t io61_crcread(void* cookie, char* buf, size_t sz) {
+    io61_crccookie* c = (io61_crccookie*) cookie;
+    ssize_t r = io61_read(c->lower, buf, sz);
+    if (r > 0)
+        c->crc = io61_crc32c_update(c->crc, buf, r);
+    return r;
+}
+
+static ssize_t io61_crcwrite(void* cookie, const char* buf, size_t sz) {
+    io61_crccookie* c = (io61_crccookie*) cookie;
+    ssize_t r = io61_write(c->lower, buf, sz);
+    if (r > 0)
+        c->crc = io61_crc32c_update(c->crc, buf, r);
+    return r > 0 ? r : 0;
+}
+
+static int io61_crcseek(void* cookie, off64_t* pos, int whence) {
+    io61_crccookie* c = (io61_crccookie*) cookie;
+    return whence == SEEK_SET ? io61_seek(c->lower, *pos) : -1;
+}
+
+static int io61_crcclose(void* cookie) {
+    io61_crccookie* c = (io61_crccookie*) cookie;
+    int r = io61_close(c->lower);
+    free(c);
+    return r;
+}
+
+
+// io61_open_crc32c(lower)
+//    Return a layer over `lower` that checksums the bytes read or
+//    written through it. Closing the layer closes `lower`. Returns NULL
+//    on error.
+
+io61_file* io61_open_crc32c(io61_file* lower) {
+    cookie_io_functions_t fns = {
+        io61_crcread, io61_crcwrite, io61_crcseek, io61_crcclose
+    };
+    io61_crccookie* c = (io61_crccookie*) calloc(1, sizeof(io61_crccookie));
+    io61_file* f = (io61_file*) calloc(1, sizeof(io61_file));
+    if (c && f) {
+        c->lower = lower;
+        f->f = fopencookie(c, lower->writing ? "w" : "r", fns);
+    }
+    if (!f || !f->f) {
+        free(c);
+        free(f);
+        return NULL;
+    }
+    f->writing = lower->writing;
+    f->crc = c;
+    return f;
+}
+
+
+// io61_crc32c(f)
+//    Return the CRC32C of the bytes that have passed through the
+//    CRC32C layer `f`. Output still buffered in `f` is flushed first.
+
+uint32_t io61_crc32c(io61_file* f) {
+    assert(f->crc);
+    if (f->writing)
+        fflush(f->f);
+    return f->crc->crc;
+}
+
+
+// A compression layer is a stdio stream whose cookie is the layer's
+// io61_file; it reads or writes the layer's frame with codec61.c, so it
+// writes the same bytes as io61.c's.
+
+static ssize_t io61_lzcread(void* cookie, char* buf, size_t sz) {
+    io61_file* f = (io61_file*) cookie;
+    return io61_lzframe_read(f->lz, buf, sz);
+}
+
+static ssize_t io61_lzcwrite(void* cookie, const char* buf, size_t sz) {
+    io61_file* f = (io61_file*) cookie;
+    ssize_t r = io61_lzframe_write(f->lz, buf, sz);
+    return r > 0 ? r : 0;
+}
+
+static int io61_lzcseek(void* cookie, off64_t* pos, int whence) {
+    io61_file* f = (io61_file*) cookie;
+    off64_t p = *pos;
+    if (whence == SEEK_CUR)
+        p += io61_lzframe_tell(f->lz);
+    else if (whence != SEEK_SET)
+        return -1;
+    if (p < 0 || io61_lzframe_seek(f->lz, p) < 0)
+        return -1;
+    *pos = p;
+    return 0;
+}
+
+static int io61_lzcclose(void* cookie) {
+    io61_file* f = (io61_file*) cookie;
+    return f->lz ? io61_lzframe_close(f->lz) : 0;
+}
+
+
+// io61_open_lz(lower)
+//    Return a layer over `lower` that compresses the bytes written
+//    through it, or decompresses the bytes read. Closing the layer
+//    closes `lower`. Returns NULL on error.
+
+io61_file* io61_open_lz(io61_file* lower) {
+    cookie_io_functions_t fns = {
+        io61_lzcread, io61_lzcwrite, io61_lzcseek, io61_lzcclose
+    };
+    io61_file* f = (io61_file*) calloc(1, sizeof(io61_file));
+    if (!f)
+        return NULL;
+    f->writing = lower->writing;
+    f->f = fopencookie(f, f->writing ? "w" : "r", fns);
+    if (f->f && !(f->lz = io61_lzframe_open(lower, f->writing))) {
+        fclose(f->f);
+        f->f = NULL;
+    }
+    if (!f->f) {
+        free(f);
+        return NULL;
+    }
+    return f;
+}
+
 // io61_seek(f, pos)
 //    Change the file pointer for file `f` to `pos` bytes into the file.
 //    Returns 0 on success and -1 on failure.
@@ -110,6 +447,29 @@ int io61_seek(io61_file* f, size_t pos) {
 }
 
 
+// io61_trace_begin(filename), io61_trace_end()
+//    This version does not trace.
+
+int io61_trace_begin(const char* filename) {
+    (void) filename;
+    errno = ENOSYS;
+    return -1;
+}
+
+int io61_trace_end(void) {
+    return 0;
+}
+
+
+// io61_profile_stats(buf, sz)
+//    This version keeps no statistics.
+
+size_t io61_profile_stats(char* buf, size_t sz) {
+    (void) buf, (void) sz;
+    return 0;
+}
+
+
 // You should not need to change either of these functions.
 
 // io61_open_check(filename, mode)
@@ -121,8 +481,8 @@ int io61_seek(io61_file* f, size_t pos) {
 io61_file* io61_open_check(const char* filename, int mode) {
     int fd;
     if (filename)
-        fd = open(filename, mode);
-    else if (mode == O_RDONLY)
+        fd = open(filename, mode & ~IO61_FLAGS);
+    else if ((mode & O_ACCMODE) == O_RDONLY)
         fd = STDIN_FILENO;
     else
         fd = STDOUT_FILENO;
@@ -139,6 +499,10 @@ io61_file* io61_open_check(const char* filename, int mode) {
 //    file (for instance, if it is a pipe).
 
 ssize_t io61_filesize(io61_file* f) {
+    if (f->lz)
+        return io61_lzframe_size(f->lz);
+    else if (f->crc)
+        return io61_filesize(f->crc->lower);
     struct stat s;
     int r = fstat(fileno(f->f), &s);
     if (r >= 0 && S_ISREG(s.st_mode) && s.st_size <= SSIZE_MAX)